@@ -13,6 +13,15 @@ namespace caffe {
 
 /**
  * @brief Bitplane Layer. A layer to covert activation integers into vectors over GF(2).
+ *
+ * With bitplane_param.packed the planes are stored one bit per element in
+ * 64-bit words (see caffe/util/bitplane.hpp) as an (N, bw * C, packed) blob.
+ * A packed blob does not keep the spatial shape, so the bits-to-int direction
+ * takes a second bottom with the shape of the feature map to rebuild,
+ * typically the bottom of the matching int-to-bits layer.
+ *
+ * The CPU passes run on bitplane_param.num_threads OpenMP threads, or on
+ * OMP_NUM_THREADS when it is 0, if Caffe is built with -fopenmp.
  */
 template <typename Dtype>
 class BitplaneLayer : public NeuronLayer<Dtype> {
@@ -25,6 +34,9 @@ class BitplaneLayer : public NeuronLayer<Dtype> {
       const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "Bitplane"; }
+  virtual inline int ExactNumBottomBlobs() const { return -1; }
+  virtual inline int MinBottomBlobs() const { return 1; }
+  virtual inline int MaxBottomBlobs() const { return 2; }
 
  protected:
 
@@ -32,11 +44,15 @@ class BitplaneLayer : public NeuronLayer<Dtype> {
       const vector<Blob<Dtype>*>& top);
   virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  void Forward_packed_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
 
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  int num_threads_;
 };
 
 }  // namespace caffe
@@ -0,0 +1,52 @@
+#ifndef CAFFE_FEATURE_MAP_DATA_LAYER_HPP_
+#define CAFFE_FEATURE_MAP_DATA_LAYER_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/fmap_file.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Reads compressed feature maps from a FeatureMapFile as the packed
+ *        bitplanes of a packed bits-to-int Bitplane layer, so a net resumes
+ *        from the compression point.
+ *
+ * data_param.source names the file and data_param.batch_size the images of
+ * a batch, cycling through the file. The optional second top has the
+ * (N, C, H, W) shape of the feature maps for the Bitplane layer; its data is
+ * not written. bitplane_param.bw_layer and fl_layer, if set, are checked
+ * against the format recorded in the file.
+ */
+template <typename Dtype>
+class FeatureMapDataLayer : public Layer<Dtype> {
+ public:
+  explicit FeatureMapDataLayer(const LayerParameter& param)
+      : Layer<Dtype>(param), cursor_(0) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "FeatureMapData"; }
+  virtual inline int ExactNumBottomBlobs() const { return 0; }
+  virtual inline int MinTopBlobs() const { return 1; }
+  virtual inline int MaxTopBlobs() const { return 2; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
+
+  shared_ptr<FeatureMapFile> file_;
+  int batch_size_;
+  int cursor_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_FEATURE_MAP_DATA_LAYER_HPP_
@@ -0,0 +1,82 @@
+#ifndef CAFFE_TILED_FUSION_LAYER_HPP_
+#define CAFFE_TILED_FUSION_LAYER_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief Runs a chain of layers over tiles of output rows, so only one tile
+ *        of each intermediate blob is live at a time.
+ *
+ * The layers are listed in tiled_fusion_param.layer as in a net, with bottom
+ * and top names; the bottoms and tops of this layer name the blobs going in
+ * and out. Made for the compressed fire modules, squeeze -> i2b -> b2b0 ->
+ * b2b1 -> b2i -> expand: each image is computed tile_rows output rows at a
+ * time, each layer producing the rows its consumers need, halos of the 3x3
+ * and strided (de)convolutions included.
+ *
+ * Supported are 2D convolutions and deconvolutions with one bottom and the
+ * row-wise ReLU, unpacked Bitplane and channel Concat layers; in-place ReLUs
+ * after a ConvolutionRistretto or DeconvolutionRistretto are folded into it
+ * (FoldRistrettoReLU). The blobs of this layer are those of its layers in
+ * order.
+ */
+template <typename Dtype>
+class TiledFusionLayer : public Layer<Dtype> {
+ public:
+  explicit TiledFusionLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "TiledFusion"; }
+  virtual inline int MinBottomBlobs() const { return 1; }
+  virtual inline int MinTopBlobs() const { return 1; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  // How the rows of a layer's top depend on the rows of its bottoms
+  enum RowMapping { ROWS, CONV, DECONV };
+
+  // Blob heights for the given bottoms.
+  void ComputeHeights(const vector<Blob<Dtype>*>& bottom);
+  // Rows of every blob and layer input needed for output rows [r0, r1).
+  void PlanTile(const int r0, const int r1);
+  // The bottoms of layer l for the planned tile of image n, copied when
+  // copy is set and otherwise only shaped.
+  vector<Blob<Dtype>*> LayerInputs(const int l,
+      const vector<Blob<Dtype>*>& bottom, const int n, const bool copy);
+  vector<Blob<Dtype>*> LayerOutputs(const int l);
+  // Copy the planned rows of a deconvolution output into its tile.
+  void CropOutput(const int l, const bool copy);
+
+  vector<shared_ptr<Layer<Dtype> > > layers_;
+  // per layer
+  vector<RowMapping> mapping_;
+  vector<int> kernel_, stride_, pad_;
+  vector<vector<int> > bottom_ids_;
+  vector<int> top_id_;
+  vector<int> need_lo_, need_hi_;
+  vector<vector<shared_ptr<Blob<Dtype> > > > inputs_;
+  vector<shared_ptr<Blob<Dtype> > > outputs_;
+  // per blob: the bottom it is, or -1, its height and the rows of the tile
+  vector<int> bottom_index_;
+  vector<int> height_, lo_, hi_;
+  vector<shared_ptr<Blob<Dtype> > > tiles_;
+  vector<int> top_ids_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_TILED_FUSION_LAYER_HPP_
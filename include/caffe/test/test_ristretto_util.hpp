@@ -0,0 +1,66 @@
+#ifndef CAFFE_TEST_TEST_RISTRETTO_UTIL_HPP_
+#define CAFFE_TEST_TEST_RISTRETTO_UTIL_HPP_
+
+#include <cmath>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+// Dynamic fixed point of 8 bits rounded to nearest, with the inputs at fl 4,
+// the parameters at fl 6 and the outputs at fl 2
+inline void SetRistrettoFixedPoint(QuantizationParameter* param) {
+  param->set_precision(QuantizationParameter_Precision_DYNAMIC_FIXED_POINT);
+  param->set_rounding_scheme(QuantizationParameter_Rounding_NEAREST);
+  param->set_bw_layer_in(8);
+  param->set_bw_layer_out(8);
+  param->set_bw_params(8);
+  param->set_fl_layer_in(4);
+  param->set_fl_layer_out(2);
+  param->set_fl_params(6);
+}
+
+// Uniform weights in [-1, 1) of outputs rows, floored to the grid of the
+// fl_params of their output; a row is a column of the blob if transpose
+template <typename Dtype>
+void FillRistrettoWeights(const QuantizationParameter& param,
+    const int outputs, const bool transpose, Blob<Dtype>* weights) {
+  const int depth = weights->count() / outputs;
+  Dtype* weight = weights->mutable_cpu_data();
+  caffe_rng_uniform<Dtype>(weights->count(), -1, 1, weight);
+  for (int o = 0; o < outputs; ++o) {
+    const int fl = param.fl_params_channel_size() ?
+        param.fl_params_channel(o) : param.fl_params();
+    for (int k = 0; k < depth; ++k) {
+      Dtype& w = weight[transpose ? k * outputs + o : o * depth + k];
+      w = std::floor(std::ldexp(w, fl)) / std::ldexp(Dtype(1), fl);
+    }
+  }
+}
+
+// Bias of both signs in multiples of step, up to 5 steps
+template <typename Dtype>
+void FillRistrettoBias(const Dtype step, Blob<Dtype>* bias) {
+  Dtype* data = bias->mutable_cpu_data();
+  for (int o = 0; o < bias->count(); ++o) {
+    data[o] = (o * 7 % 11 - 5) * step;
+  }
+}
+
+// The outputs of two layers that compute exactly, element by element
+template <typename Dtype>
+void ExpectBlobsEqual(const Blob<Dtype>& expected, const Blob<Dtype>& blob) {
+  ASSERT_EQ(expected.shape(), blob.shape());
+  for (int i = 0; i < blob.count(); ++i) {
+    EXPECT_EQ(expected.cpu_data()[i], blob.cpu_data()[i]) << "output " << i;
+  }
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_TEST_TEST_RISTRETTO_UTIL_HPP_
@@ -0,0 +1,103 @@
+#ifndef CAFFE_UTIL_BITPLANE_HPP_
+#define CAFFE_UTIL_BITPLANE_HPP_
+
+#include <stdint.h>
+
+namespace caffe {
+
+/**
+ * @brief Packed bitplane layout.
+ *
+ * A (C, H, W) feature map quantized to bw bits is stored as bw planes of C
+ * channels, one bit per element. Each channel of each plane occupies
+ * bitplane_words(H * W) 64-bit words, bits LSB first, the unused tail of the
+ * last word is zero:
+ *
+ *   word(b, c, s) = (b * C + c) * words + s / 64,  bit = s % 64
+ *
+ * so the channel stride is `words` and the plane stride is `C * words`.
+ * Images follow each other with a stride of `bw * C * words`.
+ */
+inline int bitplane_words(const int spatial) {
+  return (spatial + 63) / 64;
+}
+
+/**
+ * @brief Number of Dtype elements a packed channel occupies inside a Blob.
+ */
+template <typename Dtype>
+inline int bitplane_packed_dim(const int spatial) {
+  return bitplane_words(spatial) * sizeof(uint64_t) / sizeof(Dtype);
+}
+
+/**
+ * @brief Number of set bits in a 64-bit word.
+ */
+inline int bitplane_popcount(const uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(word);
+#else
+  uint64_t x = word - ((word >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return static_cast<int>((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/**
+ * @brief Index of the lowest set bit of a non-zero word.
+ */
+inline int bitplane_lowest_bit(const uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(word);
+#else
+  return bitplane_popcount((word & (~word + 1)) - 1);
+#endif
+}
+
+/**
+ * @brief Split count fixed point values into bw bitplanes of one element per
+ *        bit, plane b starting at planes + b * plane_stride.
+ */
+template <typename Dtype>
+void i2b_cpu(const Dtype* data, const int count, const int bw, const int fl,
+    Dtype* planes, const int plane_stride);
+
+/**
+ * @brief Sum bw bitplanes back into count fixed point values.
+ */
+template <typename Dtype>
+void b2i_cpu(const Dtype* planes, const int plane_stride, const int count,
+    const int bw, const int fl, Dtype* data);
+
+/**
+ * @brief Convert channels of a fixed point feature map into packed bitplanes.
+ * @param fl The number of bits in the fractional part.
+ * @param plane_stride The plane stride of the whole map, C * words, so that
+ *        a range of channels can be converted on its own.
+ */
+template <typename Dtype>
+void i2b_packed_cpu(const Dtype* data, const int channels, const int spatial,
+    const int bw, const int fl, uint64_t* planes, const int plane_stride);
+
+/**
+ * @brief Rebuild channels of a fixed point feature map from packed bitplanes.
+ */
+template <typename Dtype>
+void b2i_packed_cpu(const uint64_t* planes, const int plane_stride,
+    const int channels, const int spatial, const int bw, const int fl,
+    Dtype* data);
+
+/**
+ * @brief Pack a (channels, spatial) map into channel words per pixel: channel
+ *        c of pixel s is bit c % 64 of bits[s * words + c / 64], with
+ *        words = bitplane_words(channels). Positive values are ones.
+ * @return Whether every value was 0 or 1.
+ */
+template <typename Dtype>
+bool bitplane_pack_channels_cpu(const Dtype* data, const int channels,
+    const int spatial, uint64_t* bits);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_BITPLANE_HPP_
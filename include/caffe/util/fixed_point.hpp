@@ -0,0 +1,29 @@
+#ifndef CAFFE_UTIL_FIXED_POINT_HPP_
+#define CAFFE_UTIL_FIXED_POINT_HPP_
+
+namespace caffe {
+
+/**
+ * @brief Dynamic fixed point trimming of count values: x * scale, rounded
+ *        half away from zero like roundf if nearest, saturated to
+ *        [min_data, max_data] and multiplied by inv_scale. NaN passes like
+ *        std::min / std::max. in and out may be the same.
+ *
+ * AVX-512 and AVX2 builds trim 16 / 8 floats or 8 / 4 doubles at a time.
+ */
+template <typename Dtype>
+void fixed_point_trim_cpu(const Dtype* in, const int count, const Dtype scale,
+    const Dtype max_data, const Dtype min_data, const Dtype inv_scale,
+    const bool nearest, Dtype* out);
+
+/**
+ * @brief fixed_point_trim_cpu with a scale and inv_scale for each element.
+ */
+template <typename Dtype>
+void fixed_point_trim_scaled_cpu(const Dtype* in, const int count,
+    const Dtype* scale, const Dtype max_data, const Dtype min_data,
+    const Dtype* inv_scale, const bool nearest, Dtype* out);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FIXED_POINT_HPP_
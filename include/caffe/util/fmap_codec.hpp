@@ -0,0 +1,101 @@
+#ifndef CAFFE_UTIL_FMAP_CODEC_HPP_
+#define CAFFE_UTIL_FMAP_CODEC_HPP_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Lossless codec turning bitplanes into a compressed byte stream.
+ *
+ * The input is a packed Bitplane blob of N images with bw planes of C
+ * channels (see caffe/util/bitplane.hpp), or the same bits stored one per
+ * element such as an unpacked Bitplane top or a binary b2b code (bw = 1).
+ * The stream is cut into tiles that are coded and decoded independently on
+ * several threads; a tile holds all planes of a range of channels of one
+ * image, the planes from the MSB down.
+ *
+ * RLE_GOLOMB codes each H x W map either as nothing (all zero), as raw bits,
+ * or as the Golomb-Rice coded run lengths between its ones (or zeros when
+ * most bits are set), whichever is smallest.
+ *
+ * CABAC codes every bit of a map that is not all zero with an adaptive binary
+ * arithmetic coder. The probability of a bit depends on its plane, on the
+ * left, up, up-left and up-right bits of the same plane and on the bits at
+ * the same position in the higher planes: the one in the next plane, or
+ * whether any higher plane is set. It is slower than RLE_GOLOMB but takes
+ * the skewed MSB planes of ReLU activations down to a fraction of that.
+ *
+ * The stream is a little endian header, the tile offsets and the tiles:
+ *
+ *   magic, mode, num, bw, channels, height, width, tile_channels, tiles,
+ *   offsets[tiles + 1], tile data
+ */
+class FeatureMapCodec {
+ public:
+  enum Mode { RLE_GOLOMB = 0, CABAC = 1 };
+
+  /**
+   * @param tile_bits The approximate number of input bits per tile.
+   */
+  explicit FeatureMapCodec(const Mode mode = RLE_GOLOMB,
+      const int tile_bits = 1 << 16);
+
+  /**
+   * @brief Encode packed bitplanes of shape (num, bw * channels, words).
+   *
+   * @param plane_bits If not NULL, receives the coded bits per element of
+   *        each plane, plane b at index b.
+   */
+  void Encode(const uint64_t* planes, const int num, const int bw,
+      const int channels, const int height, const int width,
+      string* stream, vector<double>* plane_bits = NULL) const;
+  /**
+   * @brief Encode bits stored one per element, shape (num, bw * channels,
+   *        height, width). The values are 0 or 1.
+   */
+  template <typename Dtype>
+  void EncodeBits(const Dtype* bits, const int num, const int bw,
+      const int channels, const int height, const int width,
+      string* stream, vector<double>* plane_bits = NULL) const;
+
+  /**
+   * @brief Read the shape of the coded bitplanes.
+   *
+   * The decoders check the stream and return false, with the reason in the
+   * log, if it is truncated or corrupt. num * bw * channels * height * width
+   * of a valid stream fits in an int.
+   */
+  static bool DecodeShape(const string& stream, int* num, int* bw,
+      int* channels, int* height, int* width);
+  static bool DecodeShape(const char* stream, const size_t size, int* num,
+      int* bw, int* channels, int* height, int* width);
+  /**
+   * @brief Decode into packed bitplanes, the input of the packed bits-to-int
+   *        Bitplane layer.
+   */
+  static bool Decode(const string& stream, uint64_t* planes);
+  /**
+   * @brief Decode images [first, first + count) of a stream in memory, such
+   *        as a mapped file, into packed bitplanes of count images.
+   */
+  static bool DecodeImages(const char* stream, const size_t size,
+      const int first, const int count, uint64_t* planes);
+  /**
+   * @brief Decode into bits stored one per element.
+   */
+  template <typename Dtype>
+  static bool DecodeBits(const string& stream, Dtype* bits);
+
+ protected:
+  Mode mode_;
+  int tile_bits_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FMAP_CODEC_HPP_
@@ -0,0 +1,66 @@
+#ifndef CAFFE_UTIL_FMAP_FILE_HPP_
+#define CAFFE_UTIL_FMAP_FILE_HPP_
+
+#include <stdint.h>
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/util/fmap_codec.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Compressed feature maps on disk, read through mmap.
+ *
+ * A file is a header of little endian uint32 fields followed by a
+ * FeatureMapCodec stream, which carries the tile index:
+ *
+ *   magic "FMF1", version, num, channels, height, width, bw, fl,
+ *   plane_order, codec, stream_size, stream
+ *
+ * The only plane order so far is PACKED_MSB_FIRST: packed Bitplane planes
+ * (N, bw * C, words) coded from the MSB plane down. The reader decodes the
+ * tiles of the requested images only, straight into the caller's memory.
+ */
+class FeatureMapFile {
+ public:
+  enum PlaneOrder { PACKED_MSB_FIRST = 0 };
+
+  explicit FeatureMapFile(const string& filename);
+  ~FeatureMapFile();
+
+  /**
+   * @brief Write a FeatureMapCodec stream of bitplanes with fl fractional
+   *        bits.
+   */
+  static void Write(const string& filename, const string& stream,
+      const int fl);
+
+  inline int num() const { return num_; }
+  inline int channels() const { return channels_; }
+  inline int height() const { return height_; }
+  inline int width() const { return width_; }
+  inline int bw() const { return bw_; }
+  inline int fl() const { return fl_; }
+  inline FeatureMapCodec::Mode codec() const { return codec_; }
+
+  /**
+   * @brief Decode images [first, first + count) into packed bitplanes.
+   * @return false if the tiles of the images are corrupt.
+   */
+  bool Decode(const int first, const int count, uint64_t* planes) const;
+
+ protected:
+  int num_, channels_, height_, width_, bw_, fl_;
+  FeatureMapCodec::Mode codec_;
+  void* map_;
+  size_t map_size_;
+  const char* stream_;
+  size_t stream_size_;
+
+  DISABLE_COPY_AND_ASSIGN(FeatureMapFile);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FMAP_FILE_HPP_
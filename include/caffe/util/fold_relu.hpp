@@ -0,0 +1,25 @@
+#ifndef CAFFE_UTIL_FOLD_RELU_HPP_
+#define CAFFE_UTIL_FOLD_RELU_HPP_
+
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief Folds in-place ReLU layers into the ConvolutionRistretto or
+ *        DeconvolutionRistretto layer that produces their blob, setting its
+ *        quantization_param.fused_relu.
+ *
+ * The ReLU layers of the compressed SqueezeNets (fire2/relu_squeeze1x1,
+ * fire2/relu_b2b1_squeeze1x1, ...) then cost no pass of their own: the
+ * (de)convolution applies the ReLU in its bias and trimming epilogue. A ReLU
+ * is folded if it has a zero negative_slope, no loss weight and no include /
+ * exclude rules, and no layer reads the blob between the (de)convolution and
+ * the ReLU. Like InsertSplits,
+ * called on a filtered net; TiledFusion folds the layers it fuses.
+ */
+void FoldRistrettoReLU(const NetParameter& param, NetParameter* param_folded);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FOLD_RELU_HPP_
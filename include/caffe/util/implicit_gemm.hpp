@@ -0,0 +1,112 @@
+#ifndef CAFFE_UTIL_IMPLICIT_GEMM_HPP_
+#define CAFFE_UTIL_IMPLICIT_GEMM_HPP_
+
+#include <cstddef>
+
+namespace caffe {
+
+/**
+ * @brief Packed weight layout of the GEMMs below.
+ *
+ * A (rows, depth) weight matrix is stored as blocks of 4 rows, each block
+ * interleaved along depth so the micro-kernel reads it contiguously:
+ *
+ *   packed[(r / 4 * depth + k) * 4 + r % 4] = weight(r, k),
+ *
+ * the rows past the last one are zero. Layers pack their weights once after
+ * quantization and keep the panel while the weights are unchanged.
+ */
+inline int gemm_packed_size(const int rows, const int depth) {
+  return (rows + 3) / 4 * 4 * depth;
+}
+
+/**
+ * @brief Pack weight (rows, depth), or weight (depth, rows) if transpose is
+ *        set, into gemm_packed_size(rows, depth) elements of packed.
+ */
+template <typename Dtype>
+void gemm_pack_weights_cpu(const Dtype* weight, const int rows,
+    const int depth, const bool transpose, Dtype* packed);
+
+/**
+ * @brief output (rows, cols) = weights x col (depth, cols), the weights
+ *        packed by gemm_pack_weights_cpu.
+ *
+ * Tiles of 64 columns by 32 rows run in parallel; each multiplies register
+ * blocks of 4 rows x 16 columns, the last columns from a zero-padded copy.
+ */
+template <typename Dtype>
+void packed_gemm_cpu(const Dtype* packed, const int rows, const int depth,
+    const Dtype* col, const int cols, Dtype* output);
+
+/**
+ * @brief y (rows) = weights x x (depth), the weights packed by
+ *        gemm_pack_weights_cpu.
+ */
+template <typename Dtype>
+void packed_gemv_cpu(const Dtype* packed, const int rows, const int depth,
+    const Dtype* x, Dtype* y);
+
+/**
+ * @brief Whether packed_gemm_cpu is faster than the BLAS on depth x cols
+ *        columns; the layers call caffe_cpu_gemm on the row-major weights
+ *        otherwise.
+ *
+ * packed_gemm_cpu does not block over depth and multiplies doubles, or floats
+ * without AVX2, in scalar code. Against single-threaded OpenBLAS it wins only
+ * in AVX2 float on 16 to 48 columns and a depth of 256 or more, the small
+ * maps and batches of deploy nets, where the BLAS spends much of the call
+ * repacking the weights.
+ */
+template <typename Dtype>
+bool packed_gemm_preferred(const int depth, const int cols);
+
+/**
+ * @brief Whether packed_gemv_cpu is faster than the BLAS, in AVX2 float.
+ */
+template <typename Dtype>
+bool packed_gemv_preferred();
+
+/**
+ * @brief Dynamic fixed point trimming of the input of implicit_gemm_conv_cpu,
+ *        applied with fixed_point_trim_cpu (caffe/util/fixed_point.hpp) as
+ *        the Ristretto layers trim their inputs.
+ */
+template <typename Dtype>
+struct GemmInputTrim {
+  bool nearest;
+  Dtype scale, max_data, min_data, inv_scale;
+};
+
+/**
+ * @brief 2D convolution of one image as a GEMM whose column matrix is never
+ *        built: output (rows, out_h * out_w) = weights (rows, channels *
+ *        kernel_h * kernel_w) x im2col(input), the weights packed by
+ *        gemm_pack_weights_cpu.
+ *
+ * The output pixels are split into tiles of 64 that run in parallel; a task
+ * packs the patches of its tile into a (depth, 64) panel once and multiplies
+ * it with all weight rows, 32 at a time, in register blocks of 4 weight rows
+ * x 16 pixels, so the working memory is one panel per thread.
+ * The input pixel of output (oh, ow) and tap (kh, kw) is
+ *
+ *   (oh * stride_h - pad_h + kh * dilation_h, ow * stride_w - pad_w +
+ *    kw * dilation_w),
+ *
+ * zero outside the image; pad and dilation may be negative. Output (r, oh,
+ * ow) is written to output[r * channel_stride + oh * row_stride + ow *
+ * col_stride], so phases of a deconvolution are written in place. If trim
+ * is given, the patches are trimmed as they are packed, so the input is
+ * read as it is and no trimmed copy of it is made.
+ */
+template <typename Dtype>
+void implicit_gemm_conv_cpu(const Dtype* packed, const int rows,
+    const Dtype* input, const int channels, const int height, const int width,
+    const int* kernel, const int* pad, const int* stride, const int* dilation,
+    const int out_h, const int out_w, Dtype* output, const int channel_stride,
+    const int row_stride, const int col_stride,
+    const GemmInputTrim<Dtype>* trim = NULL);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_IMPLICIT_GEMM_HPP_
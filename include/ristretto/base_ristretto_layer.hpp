@@ -1,8 +1,11 @@
 #ifndef CAFFE_BASE_RISTRETTO_LAYER_HPP_
 #define CAFFE_BASE_RISTRETTO_LAYER_HPP_
 
+#include <stdint.h>
+
 #include "caffe/blob.hpp"
 #include "caffe/util/im2col.hpp"
+#include "caffe/util/implicit_gemm.hpp"
 #include "caffe/layers/conv_layer.hpp"
 #include "caffe/layers/deconv_layer.hpp"
 #include "caffe/layers/inner_product_layer.hpp"
@@ -13,39 +16,162 @@
 
 namespace caffe {
 
+/**
+ * @brief The engine of the fixed point layers whose quantization_param.engine
+ *        is DEFAULT, to switch a whole net at once. EMULATION unless set.
+ */
+void SetRistrettoEngine(const QuantizationParameter_Engine engine);
+QuantizationParameter_Engine RistrettoEngine();
+
+/**
+ * @brief The version of the weights of all Ristretto layers, bumped by every
+ *        backward pass since the solver updates the weights after it. The
+ *        layers trim the weights and rebuild their panels again when it
+ *        changed. Code writing into the weights of a net that already ran
+ *        forward, such as Net::CopyTrainedLayersFrom() or pycaffe
+ *        assignments, must call RistrettoWeightsChanged() afterwards.
+ */
+void RistrettoWeightsChanged();
+uint64_t RistrettoWeightsVersion();
+
+/**
+ * @brief out (rows, cols) = weight * col for the packed power-of-two weights
+ *        of PackPowerOf2Weights_cpu (rows, depth) and integer columns
+ *        (depth, cols), by shifts and adds. The products are at the scale of
+ *        col times 2^pow_2_min_exp_.
+ */
+void ShiftAddGemm_cpu(const uint8_t* weight, const int rows, const int depth,
+    const int32_t* col, const int cols, int32_t* out);
+
+/**
+ * @brief v / 2^shift rounded half away from zero, as round() does, to
+ *        requantize integer sums to the layer output; shift may be negative.
+ */
+inline int64_t IntegerRequantize(const int64_t v, const int shift) {
+  if (shift <= 0) {
+    return v * (static_cast<int64_t>(1) << -shift);
+  }
+  const int64_t half = static_cast<int64_t>(1) << (shift - 1);
+  return v < 0 ? -((half - v) >> shift) : (v + half) >> shift;
+}
+
 /**
  * @brief Provides quantization methods used by other quantized layers.
  */
 template <typename Dtype>
 class BaseRistrettoLayer{
  public:
-  explicit BaseRistrettoLayer();
+  explicit BaseRistrettoLayer(const LayerParameter& param);
  protected:
   void QuantizeLayerOutputs_cpu(Dtype* data, const int count);
+  // The same for a top (num, channels, dim), in the format of each channel.
+  void QuantizeLayerOutputs_cpu(Dtype* data, const int num,
+      const int channels, const int dim);
+  /**
+   * @brief Output epilogue of one image (channels, dim): adds the bias of
+   *        each channel (if not NULL), applies the ReLU (if set) and trims,
+   *        in one pass. Not for stochastic rounding, which trims whole tops.
+   */
+  void QuantizeLayerOutputs_cpu(Dtype* data, const int channels,
+      const int dim, const Dtype* bias, const bool relu);
+  // The same from channels data_stride apart into a (channels, dim) output.
+  void QuantizeLayerOutputs_cpu(const Dtype* data, const int data_stride,
+      const int channels, const int dim, const Dtype* bias, const bool relu,
+      Dtype* output);
   void QuantizeLayerInputs_cpu(Dtype* data, const int count);
+  // Trimmed copy of a layer input, leaving the input as it is.
+  void QuantizeLayerInputs_cpu(const Dtype* data, const int count,
+      Dtype* quantized);
   void QuantizeLayerOutputs_gpu(Dtype* data, const int count);
   void QuantizeLayerInputs_gpu(Dtype* data, const int count);
   void QuantizeWeights_cpu(vector<shared_ptr<Blob<Dtype> > > weights_quantized,
       const int rounding, const bool bias_term = true);
   void QuantizeWeights_gpu(vector<shared_ptr<Blob<Dtype> > > weights_quantized,
       const int rounding, const bool bias_term = true);
+  /**
+   * @brief Update weights_quantized_ if the weights version or the weight
+   *        memory changed since the last call: a trimmed copy of the weights
+   *        if trim_weights_ is set, stochastically and on every call in TRAIN,
+   *        and otherwise the weight blobs themselves, shared without a copy.
+   * @return true if weights_quantized_ changed.
+   */
+  bool UpdateWeightsQuantized_cpu(
+      const vector<shared_ptr<Blob<Dtype> > >& weights, const Phase phase,
+      const bool bias_term = true);
   /**
    * @brief Trim data to fixed point.
    * @param fl The number of bits in the fractional part.
    */
   void Trim2FixedPoint_cpu(Dtype* data, const int cnt, const int bit_width,
       const int rounding, const int fl);
+  void Trim2FixedPoint_cpu(const Dtype* data, const int cnt,
+      const int bit_width, const int rounding, const int fl, Dtype* trimmed);
   void Trim2FixedPoint_gpu(Dtype* data, const int cnt, const int bit_width,
       const int rounding, const int fl);
   /**
-   * @brief Generate random number in [0,1) range.
+   * @brief Trim data to minifloat, as Trim2MiniFloat_device on the GPU.
+   * @param bw_mant The number of mantissa bits, without the hidden one.
+   * @param bw_exp The number of exponent bits, 2 to 8.
    */
-  inline double RandUniform_cpu();
+  void Trim2MiniFloat_cpu(Dtype* data, const int cnt, const int bw_mant,
+      const int bw_exp, const int rounding);
+  void Trim2MiniFloat_cpu(const Dtype* data, const int cnt, const int bw_mant,
+      const int bw_exp, const int rounding, Dtype* trimmed);
+  /**
+   * @brief Trim data to integer powers of two, as Trim2IntegerPowerOf2 on
+   *        the GPU: the exponent of |x| is rounded in the log domain and
+   *        clamped to [min_exp, max_exp], zero becomes 2^min_exp.
+   */
+  void Trim2IntegerPowerOf2_cpu(Dtype* data, const int cnt, const int min_exp,
+      const int max_exp, const int rounding);
+  /**
+   * @brief Packs power-of-two weights (rows, depth) into 4 bits each, two per
+   *        byte and rows (depth + 1) / 2 bytes apart, for ShiftAddGemm_cpu:
+   *        the sign in bit 3 and the exponent above pow_2_min_exp_ in bits
+   *        0 to 2, so the exponent range is at most 7. Weights that are not
+   *        trimmed yet are rounded to the nearest power of two.
+   */
+  void PackPowerOf2Weights_cpu(const Dtype* weight, const int rows,
+      const int depth, vector<uint8_t>* packed) const;
+  /**
+   * @brief Whether the weights are packable and ShiftAddGemm_cpu sums of
+   *        depth trimmed inputs fit IntegerSumBits().
+   */
+  bool ShiftAddFits(const int depth) const;
+  /**
+   * @brief Magnitude bits of the largest sum the integer paths take: it fits
+   *        int32, and Dtype holds it exactly so that the float emulation
+   *        computes the same sum.
+   */
+  static int IntegerSumBits();
+  /**
+   * @brief Number of slots the images of a batch are split into, one thread
+   *        each: image_threads_ at most, and 1 under stochastic rounding,
+   *        which draws its numbers in image order. Slot s runs the images
+   *        [s * num / slots, (s + 1) * num / slots).
+   */
+  int ImageSlots(const int num) const;
+  // Layers with power-of-two weights have dynamic fixed point activations.
+  bool fixed_point_activations() const {
+    return precision_ == QuantizationParameter_Precision_DYNAMIC_FIXED_POINT
+        || precision_ ==
+        QuantizationParameter_Precision_INTEGER_POWER_OF_2_WEIGHTS;
+  }
   // The number of bits used for dynamic fixed point parameters and layer
   // activations.
   int bw_params_, bw_layer_in_, bw_layer_out_;
   // The fractional length of dynamic fixed point numbers.
   int fl_params_, fl_layer_in_, fl_layer_out_;
+  // Fractional lengths per output channel, overriding fl_params_ and
+  // fl_layer_out_ if not empty.
+  vector<int> fl_params_channel_, fl_layer_out_channel_;
+  int fl_params(const int c) const {
+    return fl_params_channel_.empty() ? fl_params_ : fl_params_channel_[c];
+  }
+  int fl_layer_out(const int c) const {
+    return fl_layer_out_channel_.empty() ? fl_layer_out_ :
+        fl_layer_out_channel_[c];
+  }
   // The number of bits used to represent mantissa and exponent of minifloat
   // numbers.
   int fp_mant_, fp_exp_;
@@ -53,8 +179,29 @@ class BaseRistrettoLayer{
   int pow_2_min_exp_, pow_2_max_exp_;
   // The rounding mode for quantization and the quantization scheme.
   int rounding_, precision_;
+  // Stochastic rounding draws from a Philox4x32-10 counter-based generator:
+  // the key is quantization_param.rng_seed, or drawn from the Caffe RNG, the
+  // stream a hash of the layer name. Every trim takes the next counters, 8
+  // per 32 elements, so the numbers do not depend on the threads.
+  uint64_t rng_seed_, rng_stream_, rng_counter_;
+  // Convolution layers: the counter at the input trimming of each bottom in
+  // the forward pass, so that the backward pass trims the same input.
+  vector<uint64_t> input_rng_counter_;
   // For parameter layers: reduced word with parameters.
   vector<shared_ptr<Blob<Dtype> > > weights_quantized_;
+  // Trimmed copy of the layer input.
+  vector<Dtype> quantized_input_;
+  // Convolution layers: threads running the images of a batch
+  // (quantization_param.image_threads) and the trimmed input, column buffer
+  // and weight gradient of each slot of images.
+  int image_threads_;
+  vector<vector<Dtype> > image_input_, image_col_, image_weight_diff_;
+  // Whether the weights are trimmed (quantization_param.trim_weights);
+  // otherwise weights_quantized_ shares the data of the weights.
+  bool trim_weights_;
+  // The weights version and weight memory weights_quantized_ was made from.
+  uint64_t weights_version_;
+  vector<const Dtype*> weights_source_;
 };
 
 /**
@@ -78,6 +225,147 @@ class ConvolutionRistrettoLayer : public ConvolutionLayer<Dtype>,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  /**
+   * @brief Forward one image by adding up the weights of its set input bits.
+   * @return false if the input is not binary and needs the GEMM path.
+   */
+  bool forward_cpu_binary(const Dtype* input, Dtype* output);
+  /**
+   * @brief Forward one trimmed image in integer arithmetic; the output is
+   *        biased and trimmed unless integer_bias_ is empty.
+   */
+  void forward_cpu_integer(const Dtype* input, Dtype* output);
+  /**
+   * @brief Forward images of a 1x1 convolution as one GEMM over their
+   *        trimmed inputs side by side, with the output epilogue.
+   */
+  void forward_cpu_batch_1x1(const Dtype* input, const Dtype* weight,
+      const Dtype* bias, const int images, Dtype* output);
+  // Forward one trimmed image by shifts and adds of power-of-two weights.
+  void forward_cpu_shift_add(const Dtype* input, Dtype* output);
+  // Forward one image by implicit_gemm_conv_cpu, group by group; the image
+  // is trimmed already or, if trim is given, while it is packed.
+  void forward_cpu_implicit_gemm(const Dtype* input, const Dtype* weight,
+      const GemmInputTrim<Dtype>* trim, Dtype* output);
+  // forward_cpu_gemm, weight_cpu_gemm and backward_cpu_gemm with the given
+  // column buffer instead of col_buffer_, for images in parallel; col is
+  // unused for 1x1 convolutions. The forwards multiply packed_weights_
+  // instead of weights where packed_gemm_preferred.
+  void forward_cpu_gemm_col(const Dtype* input, const Dtype* weights,
+      Dtype* col, Dtype* output);
+  void weight_cpu_gemm_col(const Dtype* input, const Dtype* output,
+      Dtype* col, Dtype* weights);
+  void backward_cpu_gemm_col(const Dtype* output, const Dtype* weights,
+      Dtype* col, Dtype* input);
+
+  // The float forward packs the patches of a few output pixels at a time
+  // instead of the im2col of the whole image.
+  bool implicit_gemm_;
+  // The layer input is trimmed to bits (bw_layer_in 2, fl_layer_in 0), so
+  // the forward pass uses additions only.
+  bool binary_input_;
+  // Weights as (input channels, kernel_h * kernel_w, output channels).
+  vector<Dtype> binary_weights_;
+  // Input channel bits per pixel of one image.
+  vector<uint64_t> binary_bits_;
+  // The trimmed inputs and weights are convolved as int16 with int32 sums,
+  // which are requantized to the layer output by a rounding shift.
+  bool integer_engine_;
+  // Weights as (output channels, kernel_dim / 2, 2) and the im2col of one
+  // image as (kernel_dim / 2, output pixels rounded up to 8, 2): neighbouring
+  // kernel_dim entries are paired for multiply-adds.
+  vector<int16_t> integer_weights_;
+  vector<int16_t> integer_input_;
+  vector<int16_t> integer_col_;
+  vector<int32_t> integer_sums_;
+  // Bits of the magnitude of the sums, at most IntegerSumBits().
+  int integer_sum_bits_;
+  // Bias at the scale of the sums, empty if it is off that grid, could take
+  // a sum past IntegerSumBits() or the output is rounded stochastically;
+  // then the sums go through float.
+  vector<int64_t> integer_bias_;
+  // The integer engine with power-of-two weights: packed weights
+  // (PackPowerOf2Weights_cpu) times the im2col of one image as int32.
+  bool shift_add_;
+  vector<uint8_t> shift_add_weights_;
+  vector<int32_t> shift_add_col_;
+  // The float weights of each group packed for the implicit GEMM and
+  // packed_gemm_cpu, repacked only when the quantized weights change.
+  vector<Dtype> packed_weights_;
+  // GEMM output of batched 1x1 convolutions, (output channels, images * dim).
+  vector<Dtype> batch_output_;
+  // A following in-place ReLU was folded into the layer (FoldRistrettoReLU).
+  bool fused_relu_;
+};
+
+/**
+ * @brief Convolutional layer over binary inputs computed with bit operations.
+ *
+ * The inputs are read as bits (a trimmed value > 0 is a one) and packed along
+ * the input channels, 64 channels per word and pixel. The weights are rounded
+ * to bw_params / fl_params and split into two's complement bitplanes, so each
+ * output is a sum of AND + popcount counts scaled by the plane weights, which
+ * equals the fixed point convolution of the trimmed weights exactly.
+ * ConvolutionRistretto convolves the weights as they are, so the two layers
+ * agree only for weights on the fixed point grid.
+ *
+ * With two bottoms the input is a packed Bitplane blob (N, bw * C, packed)
+ * and the second bottom provides the spatial shape, as for the packed
+ * bits-to-int Bitplane layer. An unpacked batch with a value other than 0 or
+ * 1 is convolved by the float path of ConvolutionRistretto instead. Only 2D
+ * convolution without groups is supported. Gradients use the float path of
+ * ConvolutionRistretto.
+ */
+template <typename Dtype>
+class BinaryConvolutionRistrettoLayer
+    : public ConvolutionRistrettoLayer<Dtype> {
+ public:
+  explicit BinaryConvolutionRistrettoLayer(const LayerParameter& param)
+      : ConvolutionRistrettoLayer<Dtype>(param) {}
+  virtual inline const char* type() const {
+    return "BinaryConvolutionRistretto";
+  }
+  virtual inline int MinBottomBlobs() const { return 1; }
+  virtual inline int MaxBottomBlobs() const { return 2; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+  virtual inline bool EqualNumBottomTopBlobs() const { return false; }
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+ protected:
+  void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  // The blob the convolution sees: bottom[0], or the unpacked shape of it.
+  vector<Blob<Dtype>*> conv_bottom(const vector<Blob<Dtype>*>& bottom);
+  // Round the weights to bw_params / fl_params and split them into
+  // bitplanes.
+  void PackWeights_cpu();
+  // Pack one input image into channel words per pixel. Returns whether the
+  // image was {0, 1}; packed bitplanes always are.
+  bool PackInput_cpu(const vector<Blob<Dtype>*>& bottom, const int n,
+      uint64_t* bits);
+
+  // Shape of the unpacked input in packed mode, holds no data.
+  Blob<Dtype> packed_shape_;
+  // Number of 64-bit words holding the input channels of a pixel.
+  int channel_words_;
+  // Number of two's complement weight planes, the last one is negative.
+  int weight_planes_;
+  // Trimmed copy of the unpacked input; the backward pass takes the weight
+  // gradient from it.
+  Blob<Dtype> trimmed_bottom_;
+  // Weight bits, (num_output, weight_planes, kernel_h * kernel_w, words).
+  vector<uint64_t> weight_bits_;
+  // Input bits of all images, (N, height * width, words).
+  vector<uint64_t> input_bits_;
 };
 
 /**
@@ -102,6 +390,43 @@ class DeconvolutionRistrettoLayer : public DeconvolutionLayer<Dtype>,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  /**
+   * @brief Forward one image by scattering the weights of its set input bits.
+   * @return false if the input is not binary and needs the GEMM path.
+   */
+  bool forward_cpu_binary(const Dtype* input, Dtype* output);
+  /**
+   * @brief Forward one trimmed image as stride_h * stride_w dense
+   *        convolutions, one per output phase, interleaved into the output.
+   */
+  void forward_cpu_subpixel(const Dtype* input, Dtype* output);
+  // See ConvolutionRistrettoLayer; forward_cpu_gemm_col reuses the columns
+  // of weight_cpu_gemm_col if skip_im2col is set. backward_cpu_gemm_col runs
+  // the forward, with packed_weights_ instead of weights where
+  // packed_gemm_preferred.
+  void forward_cpu_gemm_col(const Dtype* input, const Dtype* weights,
+      Dtype* col, Dtype* output, const bool skip_im2col);
+  void weight_cpu_gemm_col(const Dtype* input, const Dtype* output,
+      Dtype* col, Dtype* weights);
+  void backward_cpu_gemm_col(const Dtype* output, const Dtype* weights,
+      Dtype* col, Dtype* input);
+
+  // See ConvolutionRistrettoLayer.
+  bool binary_input_;
+  vector<Dtype> binary_weights_;
+  vector<uint64_t> binary_bits_;
+  // Output accumulated as (output pixels, output channels).
+  vector<Dtype> binary_output_;
+  // Sub-pixel deconvolution: the packed weights of each phase one after the
+  // other.
+  bool subpixel_;
+  vector<Dtype> subpixel_weights_;
+  // Otherwise the transposed weights of each group, packed for
+  // packed_gemm_cpu where it beats the BLAS. Both are repacked only when the
+  // weights change.
+  vector<Dtype> packed_weights_;
+  // See ConvolutionRistrettoLayer.
+  bool fused_relu_;
 };
 
 /**
@@ -128,6 +453,46 @@ class FcRistrettoLayer : public InnerProductLayer<Dtype>,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  // Forward the trimmed input (M_, K_) by shifts and adds.
+  void forward_cpu_shift_add(const Dtype* input, Dtype* output);
+  // Forward the trimmed input (M_, K_) with packed_weights_: a GEMV per
+  // sample for a few samples, else a GEMM over the transposed input.
+  void forward_cpu_packed(const Dtype* input, Dtype* output);
+  /**
+   * @brief Trim the weights to int8 at fl_params for forward_cpu_integer,
+   *        blocks of 8 rows with neighbouring inputs paired, and the bias to
+   *        the scale of the sums if it is on their grid.
+   */
+  void PackIntegerWeights_cpu(const Dtype* weight);
+  /**
+   * @brief Forward one trimmed sample as an integer GEMV; the output is
+   *        biased and trimmed unless integer_bias_ is empty.
+   */
+  void forward_cpu_integer(const Dtype* input, Dtype* output);
+
+  // The integer engine with power-of-two weights: packed weights, the input
+  // transposed to (K_, M_) as int32 and the sums as (N_, M_).
+  bool shift_add_;
+  vector<uint8_t> shift_add_weights_;
+  vector<int32_t> shift_add_col_;
+  vector<int32_t> shift_add_sums_;
+  // Otherwise the weights as (N_, K_) packed for the packed kernels where
+  // they beat the BLAS, repacked only when they change, the input as (K_, M_)
+  // and the output as (N_, M_).
+  vector<Dtype> packed_weights_;
+  vector<Dtype> packed_col_;
+  vector<Dtype> packed_output_;
+  // Single samples of dynamic fixed point with int8 weights: the weights as
+  // (N_ / 8, K_ / 2, 8, 2) int8, honouring transpose_, times the trimmed
+  // input as int16 with int32 sums, which are requantized to the layer
+  // output by a rounding shift.
+  bool integer_gemv_;
+  vector<int8_t> integer_weights_;
+  vector<int16_t> integer_input_;
+  vector<int32_t> integer_sums_;
+  // See ConvolutionRistrettoLayer.
+  int integer_sum_bits_;
+  vector<int64_t> integer_bias_;
 };
 
 /**
@@ -150,8 +515,16 @@ class LRNRistrettoLayer : public LRNLayer<Dtype>,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   void Backward_gpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void CrossChannelForward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
   virtual void CrossChannelForward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  virtual void WithinChannelForward(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  void Trim(const Dtype* data, const int cnt, Dtype* trimmed);
+
+  // Trimmed copy of the layer input for the within channel internal layers.
+  Blob<Dtype> quantized_bottom_;
 };
 
 }  // namespace caffe
@@ -1,6 +1,8 @@
 #ifndef QUANTIZATION_HPP_
 #define QUANTIZATION_HPP_
 
+#include <map>
+
 #include "caffe/caffe.hpp"
 
 using caffe::string;
@@ -30,6 +32,11 @@ private:
    */
   void RunForwardBatches(const int iterations, Net<float>* caffe_net,
       float* accuracy, const bool do_stats = false, const int score_number = 0);
+  /**
+   * @brief Find the maximal values in each output channel of the
+   * convolutional and inner product layers, for their outputs and parameters.
+   */
+  void RangeInChannels(Net<float>* caffe_net);
   /**
    * @brief Quantize convolutional and fully connected layers to dynamic fixed
    * point.
@@ -45,20 +52,21 @@ private:
    * This simulates hardware arithmetic which uses IEEE-754 standard (with some
    * small optimizations).
    */
-  //void Quantize2MiniFloat();
+  void Quantize2MiniFloat();
   /**
    * @brief Quantize convolutional and fully connected parameters to
    * integer-power-of-two numbers.
    * Activations in convolutional and fully connected layers are quantized to
    * dynamic fixed point.
    * The parameters (excluding bias) can be written as +/-2^exp where exp
-   * is in [-8,..,-1].
+   * is in [exp_max - 7,..,exp_max] and 2^exp_max is about the largest
+   * parameter of the layer.
    * In a hardware implementation, the parameters can be represented with 4
    * bits. 1 bits is required for the sign, and 3 bits are required to store the
    * exponent.
    * The quantized layers don't need any multipliers in hardware.
    */
-  //void Quantize2IntegerPowerOf2Weights();
+  void Quantize2IntegerPowerOf2Weights();
   /**
    * @brief Change network to dynamic fixed point.
    */
@@ -68,12 +76,18 @@ private:
   /**
    * @brief Change network to minifloat.
    */
-  //void EditNetDescriptionMiniFloat(caffe::NetParameter* param,
-  //    const int bitwidth);
+  void EditNetDescriptionMiniFloat(caffe::NetParameter* param,
+      const int bitwidth);
   /**
    * @brief Change network parameters to integer-power-of-two numbers.
    */
-  //void EditNetDescriptionIntegerPowerOf2Weights(caffe::NetParameter* param);
+  void EditNetDescriptionIntegerPowerOf2Weights(caffe::NetParameter* param);
+  /**
+   * @brief Set the fractional lengths per output channel of a layer's
+   * parameters or outputs (net_part), in the per channel trimming mode.
+   */
+  void SetChannelLengths(caffe::LayerParameter* param_layer,
+      const int bitwidth, const string net_part);
   /**
    * @brief Find the integer length for dynamic fixed point parameters of a
    * certain layer.
@@ -103,6 +117,10 @@ private:
   // The maximal absolute values of layer inputs, parameters and
   // layer outputs.
   vector<float> max_in_, max_params_, max_out_;
+  // With trimming mode dynamic_fixed_point_per_channel: the maximal absolute
+  // values per output channel of layer parameters and outputs, by layer name.
+  bool per_channel_;
+  std::map<string, vector<float> > max_params_channel_, max_out_channel_;
   // The integer bits for dynamic fixed point layer inputs, parameters and
   // layer outputs.
   vector<int> il_in_, il_params_, il_out_;
@@ -1,17 +1,41 @@
 #include <algorithm>
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "caffe/layers/bitplane_layer.hpp"
+#include "caffe/util/bitplane.hpp"
 #include "caffe/util/math_functions.hpp"
 
 namespace caffe {
 
+// The CPU passes are split into (image, tile) work items, a tile being at
+// most kBitplaneTile integers of one image, so both the batch and large maps
+// spread over the threads. Items write disjoint outputs, hence the results
+// do not depend on the number of threads.
+static const int kBitplaneTile = 16384;
+
 template <typename Dtype>
 void BitplaneLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   //const BitplaneParameter& bitplane_param = this->layer_param_.bitplane_param();
-  CHECK_EQ(bottom.size(), 1) << "Box Layer takes a single blob as input.";
+  if (this->layer_param_.bitplane_param().packed() &&
+      !this->layer_param_.bitplane_param().direction()) {
+    CHECK_EQ(bottom.size(), 2) << "Packed Bitplane Layer takes packed bits "
+        << "and a blob with the output shape as input.";
+  } else {
+    CHECK_EQ(bottom.size(), 1) << "Box Layer takes a single blob as input.";
+  }
   CHECK_EQ(top.size(), 1)    << "Box Layer takes exactly one blob as output.";
+  num_threads_ = this->layer_param_.bitplane_param().num_threads();
+#ifdef _OPENMP
+  if (num_threads_ <= 0) {
+    num_threads_ = omp_get_max_threads();
+  }
+#endif
+  num_threads_ = std::max(num_threads_, 1);
   //CHECK(!(bitplane_param.has_direction() && bitplane_param.has_bw_layer() && bitplane_param.has_fl_layer()))
   //    << "Bitplane parameters are missing.";
 }
@@ -21,6 +45,26 @@ void BitplaneLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   const bool dir = this->layer_param_.bitplane_param().direction();
   const int bw   = this->layer_param_.bitplane_param().bw_layer();
+  const bool packed = this->layer_param_.bitplane_param().packed();
+  //
+  if (packed) {
+    if (dir) { // (N, C, H, W) -> (N, bw*C, packed H*W)
+      vector<int> packed_shape(3);
+      packed_shape[0] = bottom[0]->shape(0);
+      packed_shape[1] = bottom[0]->shape(1) * bw;
+      packed_shape[2] = bitplane_packed_dim<Dtype>(bottom[0]->count(2));
+      top[0]->Reshape(packed_shape);
+    } else { // (N, bw*C, packed H*W) -> shape of bottom[1]
+      CHECK_EQ(bottom[0]->num_axes(), 3) << "Expected packed bitplanes.";
+      CHECK_EQ(bottom[0]->shape(0), bottom[1]->shape(0));
+      CHECK_EQ(bottom[0]->shape(1), bottom[1]->shape(1) * bw);
+      CHECK_EQ(bottom[0]->shape(2),
+          bitplane_packed_dim<Dtype>(bottom[1]->count(2)))
+          << "Packed bitplanes do not match the output shape.";
+      top[0]->ReshapeLike(*bottom[1]);
+    }
+    return;
+  }
   //
   int input_dim = bottom[0]->num_axes();
   vector<int> new_shape(bottom[0]->shape());
@@ -44,26 +88,13 @@ void BitplaneLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   CHECK_EQ(top_count, top[0]->count());
 }
 
-template <typename Dtype>
-void i2b(const int n, const Dtype* in, Dtype* out, const int b, const int fl) {
-  for (int index = 0; index < n; ++index) {
-    Dtype otmp = in[index] * powf(2, fl);
-    unsigned utmp = (unsigned)(otmp);
-    unsigned btmp = (utmp >> b) & 0x00000001;
-    out[index] = (float)(btmp);
-  }
-}
-
-template <typename Dtype>
-void b2i(const int n, const Dtype* in, Dtype* out, const int b, const int fl) {
-  for (int index = 0; index < n; ++index) {
-    out[index] += in[index] * powf(2, b-fl);
-  }
-}
-
 template <typename Dtype>
 void BitplaneLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
+  if (this->layer_param_.bitplane_param().packed()) {
+    Forward_packed_cpu(bottom, top);
+    return;
+  }
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
   //
@@ -73,36 +104,89 @@ void BitplaneLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   const int width    = bottom[0]->width();
   const int spatial  = height*width;
   const int fmap     = channels*spatial;
-  const int count    = num*fmap;
   //
   const bool dir = this->layer_param_.bitplane_param().direction();
   const int bw   = this->layer_param_.bitplane_param().bw_layer();
   const int fl   = this->layer_param_.bitplane_param().fl_layer();
   //
   const int fmapI    = fmap/bw;
-  const int countI   = count/bw;
-  // set to zero
-  if (dir != true) {
-    caffe_set(countI, Dtype(0), top_data);
-  }
+  const int len      = dir ? fmap : fmapI; // integers per image
+  const int tiles    = (len + kBitplaneTile - 1) / kBitplaneTile;
   //
-  for (int n = 0; n < num; ++n) {
-    for (int b = 0; b < bw; ++b) {
-      if (dir == true) { // int to bits
-        i2b(fmap, bottom_data + n*fmap, top_data + fmap*(b + n*bw), b, fl);
-      } else { // bits to int
-        b2i(fmapI, bottom_data + fmapI*(b + n*bw), top_data + n*fmapI, b, fl);
-      }
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads_) if (num*tiles > 1)
+#endif
+  for (int item = 0; item < num*tiles; ++item) {
+    const int n  = item / tiles;
+    const int t0 = (item % tiles) * kBitplaneTile;
+    const int tn = std::min(kBitplaneTile, len - t0);
+    if (dir == true) { // int to bits
+      i2b_cpu(bottom_data + n*fmap + t0, tn, bw, fl,
+          top_data + n*bw*fmap + t0, fmap);
+    } else { // bits to int
+      b2i_cpu(bottom_data + n*bw*fmapI + t0, fmapI, tn, bw, fl,
+          top_data + n*fmapI + t0);
     }
   }
   //
 }
 
+template <typename Dtype>
+void BitplaneLayer<Dtype>::Forward_packed_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const bool dir = this->layer_param_.bitplane_param().direction();
+  const int bw   = this->layer_param_.bitplane_param().bw_layer();
+  const int fl   = this->layer_param_.bitplane_param().fl_layer();
+  // the integer side defines the shape
+  const Blob<Dtype>* fmap_blob = dir ? bottom[0] : top[0];
+  const int num      = fmap_blob->shape(0);
+  const int channels = fmap_blob->shape(1);
+  const int spatial  = fmap_blob->count(2);
+  const int fmap     = channels*spatial;
+  const int words    = bitplane_words(spatial);
+  const int pstride  = channels*words; // plane stride
+  const int pmap     = bw*pstride; // words per image
+  // tiles of whole channels
+  const int ctile    = std::max(1, kBitplaneTile / spatial);
+  const int tiles    = (channels + ctile - 1) / ctile;
+  //
+  if (dir == true) { // int to bits
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    uint64_t* planes = reinterpret_cast<uint64_t*>(top[0]->mutable_cpu_data());
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads_) if (num*tiles > 1)
+#endif
+    for (int item = 0; item < num*tiles; ++item) {
+      const int n  = item / tiles;
+      const int c0 = (item % tiles) * ctile;
+      const int cn = std::min(ctile, channels - c0);
+      i2b_packed_cpu(bottom_data + n*fmap + c0*spatial, cn, spatial, bw, fl,
+          planes + n*pmap + c0*words, pstride);
+    }
+  } else { // bits to int
+    const uint64_t* planes =
+        reinterpret_cast<const uint64_t*>(bottom[0]->cpu_data());
+    Dtype* top_data = top[0]->mutable_cpu_data();
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads_) if (num*tiles > 1)
+#endif
+    for (int item = 0; item < num*tiles; ++item) {
+      const int n  = item / tiles;
+      const int c0 = (item % tiles) * ctile;
+      const int cn = std::min(ctile, channels - c0);
+      b2i_packed_cpu(planes + n*pmap + c0*words, pstride, cn, spatial, bw, fl,
+          top_data + n*fmap + c0*spatial);
+    }
+  }
+}
+
 template <typename Dtype>
 void BitplaneLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down,
     const vector<Blob<Dtype>*>& bottom) {
   if (propagate_down[0]) {
+    CHECK(!this->layer_param_.bitplane_param().packed())
+        << "Packed bitplanes do not propagate gradients.";
     //const Dtype* bottom_data = bottom[0]->cpu_data();
     const Dtype* top_diff = top[0]->cpu_diff();
     Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
@@ -113,26 +197,28 @@ void BitplaneLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const int width    = bottom[0]->width();
     const int spatial  = height*width;
     const int fmap     = channels*spatial;
-    const int count    = num*fmap;
     //
     const bool dir = this->layer_param_.bitplane_param().direction();
     const int bw   = this->layer_param_.bitplane_param().bw_layer();
     const int fl   = this->layer_param_.bitplane_param().fl_layer();
     //
     const int fmapI    = fmap/bw;
-    //const int countI   = count/bw;
-    //
-    if (dir == true) { // set to zero
-      caffe_set(count, Dtype(0), bottom_diff);
-    }
+    const int len      = dir ? fmap : fmapI; // integers per image
+    const int tiles    = (len + kBitplaneTile - 1) / kBitplaneTile;
     //
-    for (int n = 0; n < num; ++n) {
-      for (int b = 0; b < bw; ++b) {
-        if (dir != true) { // int to bits
-          i2b(fmapI, top_diff + n*fmapI, bottom_diff + fmapI*(b + n*bw), b, fl);
-        } else { // bits to int
-          b2i(fmap, top_diff + fmap*(b + n*bw), bottom_diff + n*fmap, b, fl);
-        }
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads_) if (num*tiles > 1)
+#endif
+    for (int item = 0; item < num*tiles; ++item) {
+      const int n  = item / tiles;
+      const int t0 = (item % tiles) * kBitplaneTile;
+      const int tn = std::min(kBitplaneTile, len - t0);
+      if (dir != true) { // int to bits
+        i2b_cpu(top_diff + n*fmapI + t0, tn, bw, fl,
+            bottom_diff + n*bw*fmapI + t0, fmapI);
+      } else { // bits to int
+        b2i_cpu(top_diff + n*bw*fmap + t0, fmap, tn, bw, fl,
+            bottom_diff + n*fmap + t0);
       }
     }
     //
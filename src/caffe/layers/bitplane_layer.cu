@@ -26,6 +26,11 @@ __global__ void forward_b2i(const int n, const Dtype* in, Dtype* out, const Dtyp
 template <typename Dtype>
 void BitplaneLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
+  if (this->layer_param_.bitplane_param().packed()) {
+    // bit packing runs on the host
+    this->Forward_packed_cpu(bottom, top);
+    return;
+  }
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = top[0]->mutable_gpu_data();
   //
@@ -91,6 +96,8 @@ void BitplaneLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down,
     const vector<Blob<Dtype>*>& bottom) {
   if (propagate_down[0]) {
+    CHECK(!this->layer_param_.bitplane_param().packed())
+        << "Packed bitplanes do not propagate gradients.";
     const Dtype* bottom_data = bottom[0]->gpu_data();
     const Dtype* top_diff = top[0]->gpu_diff();
     Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layers/feature_map_data_layer.hpp"
+#include "caffe/util/bitplane.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void FeatureMapDataLayer<Dtype>::LayerSetUp(
+      const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const DataParameter& data_param = this->layer_param_.data_param();
+  file_.reset(new FeatureMapFile(data_param.source()));
+  batch_size_ = data_param.batch_size();
+  CHECK_GT(batch_size_, 0) << "Positive batch size required.";
+  CHECK_GT(file_->num(), 0) << "No feature maps in " << data_param.source();
+  LOG(INFO) << "Opened " << data_param.source() << ": " << file_->num()
+      << " x " << file_->channels() << " x " << file_->height() << " x "
+      << file_->width() << ", bw " << file_->bw() << ", fl " << file_->fl();
+  // the format the net reads the planes in, if given
+  const BitplaneParameter& bitplane_param =
+      this->layer_param_.bitplane_param();
+  if (bitplane_param.has_bw_layer()) {
+    CHECK_EQ(file_->bw(), bitplane_param.bw_layer())
+        << data_param.source() << " holds maps of another bit width.";
+  }
+  if (bitplane_param.has_fl_layer()) {
+    CHECK_EQ(file_->fl(), bitplane_param.fl_layer())
+        << data_param.source() << " holds maps of another fractional length.";
+  }
+}
+
+template <typename Dtype>
+void FeatureMapDataLayer<Dtype>::Reshape(
+      const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  vector<int> shape(4);
+  shape[0] = batch_size_;
+  shape[1] = file_->channels();
+  shape[2] = file_->height();
+  shape[3] = file_->width();
+  if (top.size() > 1) {
+    top[1]->Reshape(shape);
+  }
+  // (N, bw*C, packed H*W) like a packed int-to-bits Bitplane top
+  shape.resize(3);
+  shape[1] = file_->bw() * file_->channels();
+  shape[2] = bitplane_packed_dim<Dtype>(file_->height() * file_->width());
+  top[0]->Reshape(shape);
+}
+
+template <typename Dtype>
+void FeatureMapDataLayer<Dtype>::Forward_cpu(
+      const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  // decode straight into the top, wrapping around the end of the file
+  uint64_t* planes = reinterpret_cast<uint64_t*>(top[0]->mutable_cpu_data());
+  const int image_words = file_->bw() * file_->channels() *
+      bitplane_words(file_->height() * file_->width());
+  for (int n = 0; n < batch_size_; ) {
+    const int count = std::min(batch_size_ - n, file_->num() - cursor_);
+    CHECK(file_->Decode(cursor_, count, planes + n * image_words))
+        << "Corrupt feature maps in "
+        << this->layer_param_.data_param().source();
+    n += count;
+    cursor_ = (cursor_ + count) % file_->num();
+  }
+}
+
+INSTANTIATE_CLASS(FeatureMapDataLayer);
+REGISTER_LAYER_CLASS(FeatureMapData);
+
+}  // namespace caffe
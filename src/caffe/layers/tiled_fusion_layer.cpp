@@ -0,0 +1,355 @@
+#include <limits.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/layer_factory.hpp"
+#include "caffe/layers/tiled_fusion_layer.hpp"
+#include "caffe/util/fold_relu.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+// Division rounding towards minus infinity, for a positive divisor.
+static inline int floor_div(const int a, const int b) {
+  return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+template <typename Dtype>
+void TiledFusionLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const TiledFusionParameter& fusion_param =
+      this->layer_param_.tiled_fusion_param();
+  CHECK_GT(fusion_param.tile_rows(), 0) << "Positive tile rows required.";
+  CHECK_GT(fusion_param.layer_size(), 0) << "No layers to fuse.";
+  // ReLUs are applied by the (de)convolutions before them
+  NetParameter fused, fused_folded;
+  fused.mutable_layer()->CopyFrom(fusion_param.layer());
+  FoldRistrettoReLU(fused, &fused_folded);
+  std::map<string, int> blob_ids;
+  for (int i = 0; i < bottom.size(); ++i) {
+    CHECK_EQ(bottom[i]->num_axes(), 4)
+        << "TiledFusion takes (N, C, H, W) bottoms.";
+    blob_ids[this->layer_param_.bottom(i)] = tiles_.size();
+    bottom_index_.push_back(i);
+    tiles_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+  }
+  for (int l = 0; l < fused_folded.layer_size(); ++l) {
+    LayerParameter layer_param(fused_folded.layer(l));
+    layer_param.set_phase(this->phase_);
+    const string& type = layer_param.type();
+    RowMapping mapping = ROWS;
+    int kernel = 1, stride = 1, pad = 0;
+    if (type.find("Deconvolution") != string::npos) {
+      mapping = DECONV;
+    } else if (type.find("Convolution") != string::npos) {
+      mapping = CONV;
+    }
+    if (mapping != ROWS) {
+      CHECK_EQ(layer_param.bottom_size(), 1)
+          << type << " layers in TiledFusion take a single bottom.";
+      ConvolutionParameter* conv_param =
+          layer_param.mutable_convolution_param();
+      kernel = conv_param->has_kernel_h() ? conv_param->kernel_h() :
+          conv_param->kernel_size(0);
+      stride = conv_param->has_stride_h() ? conv_param->stride_h() :
+          conv_param->stride_size() ? conv_param->stride(0) : 1;
+      const int dilation =
+          conv_param->dilation_size() ? conv_param->dilation(0) : 1;
+      kernel = dilation * (kernel - 1) + 1;
+      // the tiles carry the vertical padding as zero rows
+      if (conv_param->has_pad_h()) {
+        pad = conv_param->pad_h();
+      } else {
+        const int pad_size = conv_param->pad_size();
+        pad = pad_size ? conv_param->pad(0) : 0;
+        const int pad_w = pad_size ? conv_param->pad(pad_size - 1) : 0;
+        conv_param->clear_pad();
+        conv_param->set_pad_w(pad_w);
+      }
+      conv_param->set_pad_h(0);
+      if (mapping == DECONV) {
+        CHECK_GE(kernel, stride)
+            << "TiledFusion needs deconvolution kernels of at least stride.";
+      }
+    } else {
+      CHECK(type == "ReLU" || type == "Bitplane" || type == "Concat")
+          << "TiledFusion does not support " << type << " layers.";
+      CHECK(type != "Bitplane" || !layer_param.bitplane_param().packed())
+          << "TiledFusion needs unpacked bitplanes.";
+      CHECK(type != "Concat" || layer_param.concat_param().axis() == 1)
+          << "TiledFusion concatenates channels only.";
+    }
+    CHECK_EQ(layer_param.top_size(), 1)
+        << "TiledFusion layers have a single top.";
+    vector<int> bottom_ids;
+    vector<shared_ptr<Blob<Dtype> > > inputs;
+    for (int j = 0; j < layer_param.bottom_size(); ++j) {
+      CHECK(blob_ids.count(layer_param.bottom(j)))
+          << "Unknown bottom blob " << layer_param.bottom(j);
+      bottom_ids.push_back(blob_ids[layer_param.bottom(j)]);
+      inputs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    }
+    bottom_ids_.push_back(bottom_ids);
+    inputs_.push_back(inputs);
+    // in-place tops become new blobs
+    top_id_.push_back(tiles_.size());
+    blob_ids[layer_param.top(0)] = tiles_.size();
+    bottom_index_.push_back(-1);
+    tiles_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    outputs_.push_back(shared_ptr<Blob<Dtype> >(
+        mapping == DECONV ? new Blob<Dtype>() : NULL));
+    mapping_.push_back(mapping);
+    kernel_.push_back(kernel);
+    stride_.push_back(stride);
+    pad_.push_back(pad);
+    layers_.push_back(LayerRegistry<Dtype>::CreateLayer(layer_param));
+  }
+  for (int i = 0; i < top.size(); ++i) {
+    CHECK(blob_ids.count(this->layer_param_.top(i)))
+        << "Unknown top blob " << this->layer_param_.top(i);
+    top_ids_.push_back(blob_ids[this->layer_param_.top(i)]);
+  }
+  need_lo_.resize(layers_.size());
+  need_hi_.resize(layers_.size());
+  height_.resize(tiles_.size());
+  lo_.resize(tiles_.size());
+  hi_.resize(tiles_.size());
+  // Set the layers up on the first tile
+  ComputeHeights(bottom);
+  PlanTile(0, std::min<int>(fusion_param.tile_rows(), height_[top_ids_[0]]));
+  for (int l = 0; l < layers_.size(); ++l) {
+    CHECK_LT(need_lo_[l], need_hi_[l]) << "Layer "
+        << layers_[l]->layer_param().name() << " does not reach the tops.";
+    layers_[l]->SetUp(LayerInputs(l, bottom, 0, false), LayerOutputs(l));
+    CropOutput(l, false);
+    for (int k = 0; k < layers_[l]->blobs().size(); ++k) {
+      this->blobs_.push_back(layers_[l]->blobs()[k]);
+    }
+  }
+}
+
+template <typename Dtype>
+void TiledFusionLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  ComputeHeights(bottom);
+  const int height = height_[top_ids_[0]];
+  for (int i = 1; i < top_ids_.size(); ++i) {
+    CHECK_EQ(height_[top_ids_[i]], height)
+        << "TiledFusion tops differ in height.";
+  }
+  // The first tile gives the channels and widths of the tops
+  PlanTile(0, std::min<int>(
+      this->layer_param_.tiled_fusion_param().tile_rows(), height));
+  for (int l = 0; l < layers_.size(); ++l) {
+    layers_[l]->Reshape(LayerInputs(l, bottom, 0, false), LayerOutputs(l));
+    CropOutput(l, false);
+  }
+  for (int i = 0; i < top.size(); ++i) {
+    const Blob<Dtype>* tile = tiles_[top_ids_[i]].get();
+    top[i]->Reshape(bottom[0]->num(), tile->shape(1), height,
+        tile->shape(3));
+  }
+}
+
+template <typename Dtype>
+void TiledFusionLayer<Dtype>::ComputeHeights(
+      const vector<Blob<Dtype>*>& bottom) {
+  for (int i = 0; i < bottom.size(); ++i) {
+    CHECK_EQ(bottom[i]->num(), bottom[0]->num());
+    height_[i] = bottom[i]->height();
+  }
+  for (int l = 0; l < layers_.size(); ++l) {
+    const int height = height_[bottom_ids_[l][0]];
+    switch (mapping_[l]) {
+    case CONV:
+      height_[top_id_[l]] = (height + 2 * pad_[l] - kernel_[l]) / stride_[l]
+          + 1;
+      break;
+    case DECONV:
+      height_[top_id_[l]] = stride_[l] * (height - 1) + kernel_[l]
+          - 2 * pad_[l];
+      break;
+    default:
+      for (int j = 1; j < bottom_ids_[l].size(); ++j) {
+        CHECK_EQ(height_[bottom_ids_[l][j]], height);
+      }
+      height_[top_id_[l]] = height;
+    }
+  }
+}
+
+template <typename Dtype>
+void TiledFusionLayer<Dtype>::PlanTile(const int r0, const int r1) {
+  std::fill(lo_.begin(), lo_.end(), INT_MAX);
+  std::fill(hi_.begin(), hi_.end(), INT_MIN);
+  for (int i = 0; i < top_ids_.size(); ++i) {
+    lo_[top_ids_[i]] = r0;
+    hi_[top_ids_[i]] = r1;
+  }
+  // from the tops back to the bottoms
+  for (int l = layers_.size() - 1; l >= 0; --l) {
+    const int lo = lo_[top_id_[l]];
+    const int hi = hi_[top_id_[l]];
+    int a = 0, b = 0;
+    if (lo < hi) {
+      switch (mapping_[l]) {
+      case CONV:  // including the padding rows
+        a = lo * stride_[l] - pad_[l];
+        b = (hi - 1) * stride_[l] - pad_[l] + kernel_[l];
+        break;
+      case DECONV:  // the rows reaching [lo, hi)
+        a = std::max(0,
+            -floor_div(kernel_[l] - 1 - lo - pad_[l], stride_[l]));
+        b = std::min(height_[bottom_ids_[l][0]],
+            floor_div(hi - 1 + pad_[l], stride_[l]) + 1);
+        break;
+      default:
+        a = lo;
+        b = hi;
+      }
+    }
+    need_lo_[l] = a;
+    need_hi_[l] = b;
+    if (a >= b) {
+      continue;
+    }
+    for (int j = 0; j < bottom_ids_[l].size(); ++j) {
+      const int id = bottom_ids_[l][j];
+      lo_[id] = std::min(lo_[id], std::max(a, 0));
+      hi_[id] = std::max(hi_[id], std::min(b, height_[id]));
+    }
+  }
+}
+
+template <typename Dtype>
+vector<Blob<Dtype>*> TiledFusionLayer<Dtype>::LayerInputs(const int l,
+      const vector<Blob<Dtype>*>& bottom, const int n, const bool copy) {
+  const int a = need_lo_[l];
+  const int b = need_hi_[l];
+  vector<Blob<Dtype>*> inputs;
+  for (int j = 0; j < bottom_ids_[l].size(); ++j) {
+    const int id = bottom_ids_[l][j];
+    if (bottom_index_[id] < 0 && lo_[id] == a && hi_[id] == b) {
+      inputs.push_back(tiles_[id].get());
+      continue;
+    }
+    // Rows [a, b) of the blob, zero outside of the image
+    const Blob<Dtype>* source;
+    const Dtype* source_data = NULL;
+    int lo, hi;
+    if (bottom_index_[id] >= 0) {
+      source = bottom[bottom_index_[id]];
+      lo = 0;
+      hi = height_[id];
+      if (copy) {
+        source_data = source->cpu_data() + n * source->count(1);
+      }
+    } else {
+      source = tiles_[id].get();
+      lo = lo_[id];
+      hi = hi_[id];
+      if (copy) {
+        source_data = source->cpu_data();
+      }
+    }
+    const int channels = source->shape(1);
+    const int width = source->shape(3);
+    Blob<Dtype>* input = inputs_[l][j].get();
+    input->Reshape(1, channels, b - a, width);
+    inputs.push_back(input);
+    if (!copy) {
+      continue;
+    }
+    const int begin = std::max(a, lo);
+    const int end = std::min(b, hi);
+    Dtype* input_data = input->mutable_cpu_data();
+    for (int c = 0; c < channels; ++c) {
+      Dtype* rows = input_data + c * (b - a) * width;
+      caffe_set((begin - a) * width, Dtype(0), rows);
+      caffe_copy((end - begin) * width,
+          source_data + (c * (hi - lo) + begin - lo) * width,
+          rows + (begin - a) * width);
+      caffe_set((b - end) * width, Dtype(0), rows + (end - a) * width);
+    }
+  }
+  return inputs;
+}
+
+template <typename Dtype>
+vector<Blob<Dtype>*> TiledFusionLayer<Dtype>::LayerOutputs(const int l) {
+  return vector<Blob<Dtype>*>(1, mapping_[l] == DECONV ?
+      outputs_[l].get() : tiles_[top_id_[l]].get());
+}
+
+template <typename Dtype>
+void TiledFusionLayer<Dtype>::CropOutput(const int l, const bool copy) {
+  if (mapping_[l] != DECONV) {
+    return;
+  }
+  const Blob<Dtype>* output = outputs_[l].get();
+  Blob<Dtype>* tile = tiles_[top_id_[l]].get();
+  const int channels = output->shape(1);
+  const int width = output->shape(3);
+  const int rows = hi_[top_id_[l]] - lo_[top_id_[l]];
+  // the output starts at row need_lo_ * stride - pad
+  const int first = lo_[top_id_[l]] - need_lo_[l] * stride_[l] + pad_[l];
+  CHECK_LE(first + rows, output->shape(2));
+  tile->Reshape(1, channels, rows, width);
+  if (!copy) {
+    return;
+  }
+  const Dtype* output_data = output->cpu_data();
+  Dtype* tile_data = tile->mutable_cpu_data();
+  for (int c = 0; c < channels; ++c) {
+    caffe_copy(rows * width,
+        output_data + (c * output->shape(2) + first) * width,
+        tile_data + c * rows * width);
+  }
+}
+
+template <typename Dtype>
+void TiledFusionLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const int tile_rows = this->layer_param_.tiled_fusion_param().tile_rows();
+  const int height = top[0]->height();
+  for (int n = 0; n < bottom[0]->num(); ++n) {
+    for (int r0 = 0; r0 < height; r0 += tile_rows) {
+      const int r1 = std::min(height, r0 + tile_rows);
+      PlanTile(r0, r1);
+      for (int l = 0; l < layers_.size(); ++l) {
+        if (need_lo_[l] >= need_hi_[l]) {
+          continue;
+        }
+        const vector<Blob<Dtype>*> inputs = LayerInputs(l, bottom, n, true);
+        layers_[l]->Forward(inputs, LayerOutputs(l));
+        CropOutput(l, true);
+      }
+      // rows [r0, r1) of the tops
+      for (int i = 0; i < top.size(); ++i) {
+        const int id = top_ids_[i];
+        const Blob<Dtype>* tile = tiles_[id].get();
+        const int channels = tile->shape(1);
+        const int width = tile->shape(3);
+        const int rows = hi_[id] - lo_[id];
+        for (int c = 0; c < channels; ++c) {
+          caffe_copy((r1 - r0) * width,
+              tile->cpu_data() + (c * rows + r0 - lo_[id]) * width,
+              top[i]->mutable_cpu_data() + top[i]->offset(n, c, r0));
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void TiledFusionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  LOG(FATAL) << "TiledFusion layer does not support backward.";
+}
+
+INSTANTIATE_CLASS(TiledFusionLayer);
+REGISTER_LAYER_CLASS(TiledFusion);
+
+}  // namespace caffe
@@ -1,16 +1,76 @@
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 #include <math.h>
+#include <string.h>
 #include <algorithm>
-#include <stdlib.h>
-#include <time.h>
+#include <cmath>
+#include <limits>
+
+#include <boost/atomic.hpp>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "ristretto/base_ristretto_layer.hpp"
+#include "caffe/util/fixed_point.hpp"
+#include "caffe/util/math_functions.hpp"
 
 namespace caffe {
 
+static QuantizationParameter_Engine ristretto_engine =
+    QuantizationParameter_Engine_EMULATION;
+
+void SetRistrettoEngine(const QuantizationParameter_Engine engine) {
+  CHECK_NE(engine, QuantizationParameter_Engine_DEFAULT)
+      << "The default engine must be EMULATION or INTEGER.";
+  ristretto_engine = engine;
+}
+
+QuantizationParameter_Engine RistrettoEngine() {
+  return ristretto_engine;
+}
+
+// Bumped by the backward passes of solver threads
+static boost::atomic<uint64_t> ristretto_weights_version(1);
+
+void RistrettoWeightsChanged() {
+  ristretto_weights_version.fetch_add(1);
+}
+
+uint64_t RistrettoWeightsVersion() {
+  return ristretto_weights_version.load();
+}
+
 template <typename Dtype>
-BaseRistrettoLayer<Dtype>::BaseRistrettoLayer() {
-  // Initialize random number generator
-  srand(time(NULL));
+BaseRistrettoLayer<Dtype>::BaseRistrettoLayer(const LayerParameter& param)
+    : rng_counter_(0), weights_version_(0) {
+  // Random numbers for stochastic rounding: the seed keys the generator, the
+  // layer name picks the stream (FNV-1a)
+  const QuantizationParameter& quantization_param = param.quantization_param();
+  rng_seed_ = quantization_param.has_rng_seed() ?
+      quantization_param.rng_seed() : caffe_rng_rand();
+  rng_stream_ = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < param.name().size(); ++i) {
+    rng_stream_ = (rng_stream_ ^ static_cast<uint8_t>(param.name()[i])) *
+        0x100000001b3ULL;
+  }
+  // Dynamic fixed point formats per output channel, if given
+  fl_params_channel_.assign(quantization_param.fl_params_channel().begin(),
+      quantization_param.fl_params_channel().end());
+  fl_layer_out_channel_.assign(
+      quantization_param.fl_layer_out_channel().begin(),
+      quantization_param.fl_layer_out_channel().end());
+  // Threads running the images of a convolution
+  image_threads_ = quantization_param.image_threads();
+#ifdef _OPENMP
+  if (image_threads_ <= 0) {
+    image_threads_ = omp_get_max_threads();
+  }
+#endif
+  image_threads_ = std::max(image_threads_, 1);
+  trim_weights_ = quantization_param.trim_weights();
 }
 
 template <typename Dtype>
@@ -21,25 +81,94 @@ void BaseRistrettoLayer<Dtype>::QuantizeWeights_cpu(
   const int cnt_weight = weights_quantized[0]->count();
   switch (precision_) {
   case QuantizationParameter_Precision_DYNAMIC_FIXED_POINT:
-    Trim2FixedPoint_cpu(weight, cnt_weight, bw_params_, rounding, fl_params_);
+    if (fl_params_channel_.empty() && fl_layer_out_channel_.empty()) {
+      Trim2FixedPoint_cpu(weight, cnt_weight, bw_params_, rounding,
+          fl_params_);
+      if (bias_term) {
+        Trim2FixedPoint_cpu(weights_quantized[1]->mutable_cpu_data(),
+            weights_quantized[1]->count(), bw_params_ + bw_layer_out_,
+            rounding, bw_params_ + fl_layer_out_);
+      }
+    } else {
+      // the weights of an output channel are a row
+      const int channels = weights_quantized[0]->shape(0);
+      const int dim = cnt_weight / channels;
+      for (int c = 0; c < channels; ++c) {
+        Trim2FixedPoint_cpu(weight + c * dim, dim, bw_params_, rounding,
+            fl_params(c));
+      }
+      for (int c = 0; bias_term && c < channels; ++c) {
+        Trim2FixedPoint_cpu(weights_quantized[1]->mutable_cpu_data() + c, 1,
+            bw_params_ + bw_layer_out_, rounding,
+            bw_params_ + fl_layer_out(c));
+      }
+    }
+    break;
+  case QuantizationParameter_Precision_MINIFLOAT:
+    Trim2MiniFloat_cpu(weight, cnt_weight, fp_mant_, fp_exp_, rounding);
     if (bias_term) {
-      Trim2FixedPoint_cpu(weights_quantized[1]->mutable_cpu_data(),
-          weights_quantized[1]->count(), bw_params_ + bw_layer_out_, rounding, bw_params_ + fl_layer_out_);
+      Trim2MiniFloat_cpu(weights_quantized[1]->mutable_cpu_data(),
+          weights_quantized[1]->count(), fp_mant_, fp_exp_, rounding);
     }
     break;
+  case QuantizationParameter_Precision_INTEGER_POWER_OF_2_WEIGHTS:
+    Trim2IntegerPowerOf2_cpu(weight, cnt_weight, pow_2_min_exp_,
+        pow_2_max_exp_, rounding);
+    // Don't trim bias
+    break;
   default:
     LOG(FATAL) << "Unknown trimming mode: " << precision_;
     break;
   }
 }
 
+template <typename Dtype>
+bool BaseRistrettoLayer<Dtype>::UpdateWeightsQuantized_cpu(
+      const vector<shared_ptr<Blob<Dtype> > >& weights, const Phase phase,
+      const bool bias_term) {
+  vector<const Dtype*> source(bias_term ? 2 : 1);
+  for (int i = 0; i < source.size(); ++i) {
+    source[i] = weights[i]->cpu_data();
+  }
+  // Trimmed weights are rounded stochastically in TRAIN, anew every pass.
+  // Writes into the weight memory that are not followed by a backward pass
+  // call RistrettoWeightsChanged().
+  const bool changed = (trim_weights_ && phase == TRAIN) ||
+      weights_version_ != RistrettoWeightsVersion() ||
+      source != weights_source_;
+  if (!changed) {
+    return false;
+  }
+  if (trim_weights_) {
+    for (int i = 0; i < source.size(); ++i) {
+      caffe_copy(weights[i]->count(), source[i],
+          weights_quantized_[i]->mutable_cpu_data());
+    }
+    const int rounding = phase == TEST ? rounding_ :
+        QuantizationParameter_Rounding_STOCHASTIC;
+    QuantizeWeights_cpu(weights_quantized_, rounding, bias_term);
+  } else {
+    // the weights as they are, without a copy
+    for (int i = 0; i < source.size(); ++i) {
+      weights_quantized_[i]->ShareData(*weights[i]);
+    }
+  }
+  weights_version_ = RistrettoWeightsVersion();
+  weights_source_ = source;
+  return true;
+}
+
 template <typename Dtype>
 void BaseRistrettoLayer<Dtype>::QuantizeLayerInputs_cpu(Dtype* data,
       const int count) {
   switch (precision_) {
+    case QuantizationParameter_Precision_INTEGER_POWER_OF_2_WEIGHTS:
     case QuantizationParameter_Precision_DYNAMIC_FIXED_POINT:
       Trim2FixedPoint_cpu(data, count, bw_layer_in_, rounding_, fl_layer_in_);
       break;
+    case QuantizationParameter_Precision_MINIFLOAT:
+      Trim2MiniFloat_cpu(data, count, fp_mant_, fp_exp_, rounding_);
+      break;
     default:
       LOG(FATAL) << "Unknown trimming mode: " << precision_;
       break;
@@ -47,11 +176,16 @@ void BaseRistrettoLayer<Dtype>::QuantizeLayerInputs_cpu(Dtype* data,
 }
 
 template <typename Dtype>
-void BaseRistrettoLayer<Dtype>::QuantizeLayerOutputs_cpu(
-      Dtype* data, const int count) {
+void BaseRistrettoLayer<Dtype>::QuantizeLayerInputs_cpu(const Dtype* data,
+      const int count, Dtype* quantized) {
   switch (precision_) {
+    case QuantizationParameter_Precision_INTEGER_POWER_OF_2_WEIGHTS:
     case QuantizationParameter_Precision_DYNAMIC_FIXED_POINT:
-      Trim2FixedPoint_cpu(data, count, bw_layer_out_, rounding_, fl_layer_out_);
+      Trim2FixedPoint_cpu(data, count, bw_layer_in_, rounding_, fl_layer_in_,
+          quantized);
+      break;
+    case QuantizationParameter_Precision_MINIFLOAT:
+      Trim2MiniFloat_cpu(data, count, fp_mant_, fp_exp_, rounding_, quantized);
       break;
     default:
       LOG(FATAL) << "Unknown trimming mode: " << precision_;
@@ -59,81 +193,622 @@ void BaseRistrettoLayer<Dtype>::QuantizeLayerOutputs_cpu(
   }
 }
 
-template <>
-void BaseRistrettoLayer<float>::Trim2FixedPoint_cpu(float* data, const int cnt,
-      const int bit_width, const int rounding, const int fl) {
-  for (int index = 0; index < cnt; ++index) {
-    // round data
-    data[index] *= powf(2, fl);
-    switch (rounding) {
-    case QuantizationParameter_Rounding_NEAREST:
-      data[index] = roundf(data[index]);
+template <typename Dtype>
+void BaseRistrettoLayer<Dtype>::QuantizeLayerOutputs_cpu(
+      Dtype* data, const int count) {
+  switch (precision_) {
+    case QuantizationParameter_Precision_INTEGER_POWER_OF_2_WEIGHTS:
+    case QuantizationParameter_Precision_DYNAMIC_FIXED_POINT:
+      Trim2FixedPoint_cpu(data, count, bw_layer_out_, rounding_, fl_layer_out_);
       break;
-    case QuantizationParameter_Rounding_STOCHASTIC:
-      data[index] = floorf(data[index] + RandUniform_cpu());
+    case QuantizationParameter_Precision_MINIFLOAT:
+      Trim2MiniFloat_cpu(data, count, fp_mant_, fp_exp_, rounding_);
       break;
     default:
+      LOG(FATAL) << "Unknown trimming mode: " << precision_;
       break;
+  }
+}
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+// 3"), evaluated for kPhiloxLanes consecutive counters at a time. Word j of
+// counter ctr + l is random number j * kPhiloxLanes + l of the block.
+static const int kPhiloxLanes = 8;
+static const int kPhiloxBlock = 4 * kPhiloxLanes;
+// Blocks of a stochastic trim per thread at least
+static const int kPhiloxBlocksPerThread = 256;
+
+static void philox_block(const uint64_t key, const uint64_t stream,
+    const uint64_t ctr, uint32_t* words) {
+#if defined(__AVX2__)
+  for (int l = 0; l < kPhiloxLanes; ++l) {
+    words[l] = static_cast<uint32_t>(ctr + l);
+    words[kPhiloxLanes + l] = static_cast<uint32_t>((ctr + l) >> 32);
+  }
+  __m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words));
+  __m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + 8));
+  __m256i x2 = _mm256_set1_epi32(static_cast<uint32_t>(stream));
+  __m256i x3 = _mm256_set1_epi32(static_cast<uint32_t>(stream >> 32));
+  const __m256i m0 = _mm256_set1_epi32(0xD2511F53);
+  const __m256i m1 = _mm256_set1_epi32(0xCD9E8D57);
+  uint32_t k0 = static_cast<uint32_t>(key);
+  uint32_t k1 = static_cast<uint32_t>(key >> 32);
+  for (int r = 0; r < 10; ++r) {
+    // 32x32 -> 64 bit products of the even and the odd lanes
+    const __m256i e0 = _mm256_mul_epu32(x0, m0);
+    const __m256i o0 = _mm256_mul_epu32(_mm256_srli_epi64(x0, 32), m0);
+    const __m256i e1 = _mm256_mul_epu32(x2, m1);
+    const __m256i o1 = _mm256_mul_epu32(_mm256_srli_epi64(x2, 32), m1);
+    const __m256i lo0 =
+        _mm256_blend_epi32(e0, _mm256_slli_epi64(o0, 32), 0xAA);
+    const __m256i hi0 =
+        _mm256_blend_epi32(_mm256_srli_epi64(e0, 32), o0, 0xAA);
+    const __m256i lo1 =
+        _mm256_blend_epi32(e1, _mm256_slli_epi64(o1, 32), 0xAA);
+    const __m256i hi1 =
+        _mm256_blend_epi32(_mm256_srli_epi64(e1, 32), o1, 0xAA);
+    x0 = _mm256_xor_si256(_mm256_xor_si256(hi1, x1), _mm256_set1_epi32(k0));
+    x1 = lo1;
+    x2 = _mm256_xor_si256(_mm256_xor_si256(hi0, x3), _mm256_set1_epi32(k1));
+    x3 = lo0;
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(words), x0);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(words + 8), x1);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(words + 16), x2);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(words + 24), x3);
+#else
+  for (int l = 0; l < kPhiloxLanes; ++l) {
+    uint32_t x[4] = { static_cast<uint32_t>(ctr + l),
+        static_cast<uint32_t>((ctr + l) >> 32),
+        static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32) };
+    uint32_t k0 = static_cast<uint32_t>(key);
+    uint32_t k1 = static_cast<uint32_t>(key >> 32);
+    for (int r = 0; r < 10; ++r) {
+      const uint64_t p0 = static_cast<uint64_t>(0xD2511F53) * x[0];
+      const uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57) * x[2];
+      x[0] = static_cast<uint32_t>(p1 >> 32) ^ x[1] ^ k0;
+      x[1] = static_cast<uint32_t>(p1);
+      x[2] = static_cast<uint32_t>(p0 >> 32) ^ x[3] ^ k1;
+      x[3] = static_cast<uint32_t>(p0);
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
     }
-    // saturate data
-    float max_data = (powf(2, bit_width - 1) - 1.0);
-    float min_data = -powf(2, bit_width - 1);
-    data[index] = std::max(std::min(data[index], max_data), min_data);
-    // back to float
-    data[index] *= powf(2, -fl);
-    }
-}
-template <>
-void BaseRistrettoLayer<double>::Trim2FixedPoint_cpu(double* data, const int cnt,
-      const int bit_width, const int rounding, const int fl) {
-  for (int index = 0; index < cnt; ++index) {
-    // round data
-    data[index] *= pow(2, fl);
-    switch (rounding) {
-    case QuantizationParameter_Rounding_NEAREST:
-      data[index] = round(data[index]);
-      break;
-    case QuantizationParameter_Rounding_STOCHASTIC:
-      data[index] = floor(data[index] + RandUniform_cpu());
-      break;
-    default:
-      break;
+    for (int j = 0; j < 4; ++j) {
+      words[j * kPhiloxLanes + l] = x[j];
     }
-    // saturate data
-    double max_data = (pow(2, bit_width - 1) - 1.0);
-    double min_data = -pow(2, bit_width - 1);
-    data[index] = std::max(std::min(data[index], max_data), min_data);
-    // back to float
-    data[index] *= pow(2, -fl);
+  }
+#endif
+}
+
+// Uniform in [0,1) from a random word
+static inline float philox_uniform(const uint32_t word, float) {
+  return (word >> 8) * (1.f / 16777216.f);
+}
+static inline double philox_uniform(const uint32_t word, double) {
+  return word * (1. / 4294967296.);
+}
+
+// Stochastic rounding of one block: floor(x + uniform)
+static int trim_stochastic_simd(const float* in, float* out, const int cnt,
+    const uint32_t* words, const float scale, const float max_data,
+    const float min_data, const float inv_scale) {
+  int i = 0;
+#if defined(__AVX2__)
+  const __m256 s = _mm256_set1_ps(scale);
+  const __m256 hi = _mm256_set1_ps(max_data);
+  const __m256 lo = _mm256_set1_ps(min_data);
+  const __m256 inv = _mm256_set1_ps(inv_scale);
+  const __m256 step = _mm256_set1_ps(1.f / 16777216.f);
+  for (; i + 8 <= cnt; i += 8) {
+    const __m256 u = _mm256_mul_ps(step, _mm256_cvtepi32_ps(_mm256_srli_epi32(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i)), 8)));
+    __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), s), u);
+    x = _mm256_max_ps(lo, _mm256_min_ps(hi, _mm256_floor_ps(x)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(x, inv));
+  }
+#endif
+  return i;
+}
+
+static int trim_stochastic_simd(const double* in, double* out,
+    const int cnt, const uint32_t* words, const double scale,
+    const double max_data, const double min_data, const double inv_scale) {
+  return 0;
+}
+
+template <typename Dtype>
+static void trim_stochastic_cpu(const Dtype* in, Dtype* out, const int cnt,
+    const Dtype scale, const Dtype max_data, const Dtype min_data,
+    const Dtype inv_scale, const uint64_t key, const uint64_t stream,
+    const uint64_t ctr) {
+  const int blocks = (cnt + kPhiloxBlock - 1) / kPhiloxBlock;
+#ifdef _OPENMP
+#pragma omp parallel for if (blocks >= 2 * kPhiloxBlocksPerThread)
+#endif
+  for (int b = 0; b < blocks; ++b) {
+    uint32_t words[kPhiloxBlock];
+    philox_block(key, stream, ctr + b * kPhiloxLanes, words);
+    const Dtype* block = in + b * kPhiloxBlock;
+    Dtype* block_out = out + b * kPhiloxBlock;
+    const int n = std::min(kPhiloxBlock, cnt - b * kPhiloxBlock);
+    for (int i = trim_stochastic_simd(block, block_out, n, words, scale,
+        max_data, min_data, inv_scale); i < n; ++i) {
+      const Dtype x = std::floor(block[i] * scale +
+          philox_uniform(words[i], Dtype()));
+      block_out[i] = std::max(std::min(x, max_data), min_data) * inv_scale;
     }
+  }
 }
 
 template <typename Dtype>
-double BaseRistrettoLayer<Dtype>::RandUniform_cpu(){
-  return rand() / (RAND_MAX+1.0);
+void BaseRistrettoLayer<Dtype>::Trim2FixedPoint_cpu(Dtype* data,
+      const int cnt, const int bit_width, const int rounding, const int fl) {
+  Trim2FixedPoint_cpu(data, cnt, bit_width, rounding, fl, data);
 }
 
-template BaseRistrettoLayer<double>::BaseRistrettoLayer();
-template BaseRistrettoLayer<float>::BaseRistrettoLayer();
+template <typename Dtype>
+void BaseRistrettoLayer<Dtype>::Trim2FixedPoint_cpu(const Dtype* data,
+      const int cnt, const int bit_width, const int rounding, const int fl,
+      Dtype* trimmed) {
+  // powers of two, exact in Dtype
+  const Dtype scale = pow(2., fl);
+  const Dtype inv_scale = pow(2., -fl);
+  const Dtype max_data = pow(2., bit_width - 1) - 1.0;
+  const Dtype min_data = -pow(2., bit_width - 1);
+  switch (rounding) {
+  case QuantizationParameter_Rounding_NEAREST:
+    fixed_point_trim_cpu(data, cnt, scale, max_data, min_data, inv_scale,
+        true, trimmed);
+    break;
+  case QuantizationParameter_Rounding_STOCHASTIC:
+    trim_stochastic_cpu(data, trimmed, cnt, scale, max_data, min_data,
+        inv_scale, rng_seed_, rng_stream_, rng_counter_);
+    rng_counter_ += (cnt + kPhiloxBlock - 1) / kPhiloxBlock * kPhiloxLanes;
+    break;
+  default:
+    fixed_point_trim_cpu(data, cnt, scale, max_data, min_data, inv_scale,
+        false, trimmed);
+    break;
+  }
+}
+
+// Minifloat trimming on the bits of IEEE floats, as Trim2MiniFloat_device:
+// exponents below the format give 0 (no denormals), magnitudes above its
+// largest number saturate, and the mantissa is rounded to mant bits in
+// place, a carry stepping into the exponent (and saturating past the largest
+// number, unlike on the GPU). Schemes other than nearest and stochastic cut
+// the mantissa. Magnitudes and exponents are compared as unsigned integers,
+// so there is no log2 / pow per element.
+struct MiniFloatFormat {
+  MiniFloatFormat(const int bw_mant, const int bw_exp) {
+    const int bias = (1 << (bw_exp - 1)) - 1;
+    shift = std::max(23 - bw_mant, 0);
+    min_exp = std::max(127 - bias, 1);
+    const uint32_t max_mant = (1u << (23 - shift)) - 1;
+    max_mag = std::min((static_cast<uint32_t>((1 << bw_exp) - 1 - bias + 127)
+        << 23) | (max_mant << shift), 0x7fffffffu);
+    mask = ~((1u << shift) - 1);
+  }
+  int shift;
+  uint32_t min_exp, max_mag, mask;
+};
+
+static inline uint32_t float_bits(const float x) {
+  uint32_t b;
+  memcpy(&b, &x, sizeof(b));
+  return b;
+}
+
+static inline float bits_float(const uint32_t b) {
+  float x;
+  memcpy(&x, &b, sizeof(x));
+  return x;
+}
+
+// One element, adding round to the magnitude before the mantissa is cut.
+static inline float minifloat(const float x, const MiniFloatFormat& f,
+    const uint32_t round) {
+  const uint32_t b = float_bits(x);
+  uint32_t mag = b & 0x7fffffffu;
+  if ((mag >> 23) < f.min_exp) {
+    return 0;
+  }
+  mag = std::min((mag + round) & f.mask, f.max_mag);
+  return bits_float((b & 0x80000000u) | mag);
+}
+
+// Round to nearest, ties to even like rint
+static inline uint32_t minifloat_nearest(const uint32_t b,
+    const MiniFloatFormat& f) {
+  return f.shift ? (1u << (f.shift - 1)) - 1 + ((b >> f.shift) & 1) : 0;
+}
+
+static int minifloat_simd(const float* in, float* out, const int cnt,
+    const MiniFloatFormat& f, const bool nearest) {
+  int i = 0;
+#if defined(__AVX2__)
+  const __m256i abs = _mm256_set1_epi32(0x7fffffff);
+  const __m256i min_exp = _mm256_set1_epi32(f.min_exp - 1);
+  const __m256i max_mag = _mm256_set1_epi32(f.max_mag);
+  const __m256i mask = _mm256_set1_epi32(f.mask);
+  const __m256i half = _mm256_set1_epi32(f.shift ? (1 << (f.shift - 1)) - 1 :
+      0);
+  const __m256i lsb = _mm256_set1_epi32(f.shift ? 1 : 0);
+  const __m128i shift = _mm_cvtsi32_si128(f.shift);
+  for (; i + 8 <= cnt; i += 8) {
+    const __m256i b = _mm256_castps_si256(_mm256_loadu_ps(in + i));
+    __m256i mag = _mm256_and_si256(b, abs);
+    const __m256i keep = _mm256_cmpgt_epi32(_mm256_srli_epi32(mag, 23),
+        min_exp);
+    if (nearest) {
+      mag = _mm256_add_epi32(mag, _mm256_add_epi32(half,
+          _mm256_and_si256(_mm256_srl_epi32(mag, shift), lsb)));
+    }
+    mag = _mm256_min_epu32(_mm256_and_si256(mag, mask), max_mag);
+    const __m256i sign = _mm256_andnot_si256(abs, b);
+    _mm256_storeu_ps(out + i, _mm256_castsi256_ps(
+        _mm256_and_si256(_mm256_or_si256(sign, mag), keep)));
+  }
+#endif
+  return i;
+}
+
+template <typename Dtype>
+static void minifloat_cpu(const Dtype* in, Dtype* out, const int cnt,
+    const MiniFloatFormat& f, const bool nearest) {
+  for (int i = 0; i < cnt; ++i) {
+    // through float like the GPU
+    const float x = in[i];
+    out[i] = minifloat(x, f, nearest ? minifloat_nearest(float_bits(x), f) :
+        0);
+  }
+}
+
+static void minifloat_cpu(const float* in, float* out, const int cnt,
+    const MiniFloatFormat& f, const bool nearest) {
+  for (int i = minifloat_simd(in, out, cnt, f, nearest); i < cnt; ++i) {
+    out[i] = minifloat(in[i], f, nearest ? minifloat_nearest(
+        float_bits(in[i]), f) : 0);
+  }
+}
+
+// Stochastic rounding: a random number below the mantissa step is added
+// before the mantissa is cut
+template <typename Dtype>
+static void minifloat_stochastic_cpu(const Dtype* in, Dtype* out,
+    const int cnt, const MiniFloatFormat& f, const uint64_t key,
+    const uint64_t stream, const uint64_t ctr) {
+  const int blocks = (cnt + kPhiloxBlock - 1) / kPhiloxBlock;
+#ifdef _OPENMP
+#pragma omp parallel for if (blocks >= 2 * kPhiloxBlocksPerThread)
+#endif
+  for (int b = 0; b < blocks; ++b) {
+    uint32_t words[kPhiloxBlock];
+    philox_block(key, stream, ctr + b * kPhiloxLanes, words);
+    const int n = std::min(kPhiloxBlock, cnt - b * kPhiloxBlock);
+    for (int i = 0; i < n; ++i) {
+      const int j = b * kPhiloxBlock + i;
+      out[j] = minifloat(static_cast<float>(in[j]), f,
+          f.shift ? words[i] >> (32 - f.shift) : 0);
+    }
+  }
+}
+
+template <typename Dtype>
+void BaseRistrettoLayer<Dtype>::Trim2MiniFloat_cpu(Dtype* data,
+      const int cnt, const int bw_mant, const int bw_exp, const int rounding) {
+  Trim2MiniFloat_cpu(data, cnt, bw_mant, bw_exp, rounding, data);
+}
+
+template <typename Dtype>
+void BaseRistrettoLayer<Dtype>::Trim2MiniFloat_cpu(const Dtype* data,
+      const int cnt, const int bw_mant, const int bw_exp, const int rounding,
+      Dtype* trimmed) {
+  CHECK(bw_exp >= 2 && bw_exp <= 8 && bw_mant >= 0)
+      << "Minifloat needs 2 to 8 exponent bits.";
+  const MiniFloatFormat format(bw_mant, bw_exp);
+  switch (rounding) {
+  case QuantizationParameter_Rounding_NEAREST:
+    minifloat_cpu(data, trimmed, cnt, format, true);
+    break;
+  case QuantizationParameter_Rounding_STOCHASTIC:
+    minifloat_stochastic_cpu(data, trimmed, cnt, format, rng_seed_,
+        rng_stream_, rng_counter_);
+    rng_counter_ += (cnt + kPhiloxBlock - 1) / kPhiloxBlock * kPhiloxLanes;
+    break;
+  default:
+    minifloat_cpu(data, trimmed, cnt, format, false);
+    break;
+  }
+}
+
+// A power of two with the sign of x and the exponent of |x| rounded by
+// log2, clamped to [min_exp, max_exp]. u is added before the exponent is
+// floored, 0.5 for rounding to nearest.
+template <typename Dtype>
+static inline Dtype power_of_2(const Dtype x, const int min_exp,
+    const int max_exp, const double u) {
+  const double exponent = std::max(std::min(
+      floor(log2(fabs(static_cast<double>(x))) + u), double(max_exp)),
+      double(min_exp));
+  return std::ldexp(x < 0 ? Dtype(-1) : Dtype(1), static_cast<int>(exponent));
+}
+
+template <typename Dtype>
+void BaseRistrettoLayer<Dtype>::Trim2IntegerPowerOf2_cpu(Dtype* data,
+      const int cnt, const int min_exp, const int max_exp,
+      const int rounding) {
+  CHECK_LE(min_exp, max_exp);
+  if (rounding == QuantizationParameter_Rounding_STOCHASTIC) {
+    const int blocks = (cnt + kPhiloxBlock - 1) / kPhiloxBlock;
+#ifdef _OPENMP
+#pragma omp parallel for if (blocks >= 2 * kPhiloxBlocksPerThread)
+#endif
+    for (int b = 0; b < blocks; ++b) {
+      uint32_t words[kPhiloxBlock];
+      philox_block(rng_seed_, rng_stream_, rng_counter_ + b * kPhiloxLanes,
+          words);
+      const int n = std::min(kPhiloxBlock, cnt - b * kPhiloxBlock);
+      for (int i = 0; i < n; ++i) {
+        Dtype& x = data[b * kPhiloxBlock + i];
+        x = power_of_2(x, min_exp, max_exp, philox_uniform(words[i], x));
+      }
+    }
+    rng_counter_ += blocks * kPhiloxLanes;
+  } else {
+#ifdef _OPENMP
+#pragma omp parallel for if (cnt >= 65536)
+#endif
+    for (int i = 0; i < cnt; ++i) {
+      data[i] = power_of_2(data[i], min_exp, max_exp, 0.5);
+    }
+  }
+}
+
+template <typename Dtype>
+void BaseRistrettoLayer<Dtype>::PackPowerOf2Weights_cpu(const Dtype* weight,
+      const int rows, const int depth, vector<uint8_t>* packed) const {
+  CHECK_LE(pow_2_max_exp_ - pow_2_min_exp_, 7)
+      << "Packed weights hold 8 exponents.";
+  const int stride = (depth + 1) / 2;
+  packed->assign(rows * stride, 0);
+  for (int r = 0; r < rows; ++r) {
+    for (int k = 0; k < depth; ++k) {
+      const Dtype w = power_of_2(weight[r * depth + k], pow_2_min_exp_,
+          pow_2_max_exp_, 0.5);
+      int e;
+      std::frexp(w, &e);
+      const uint8_t nibble = (w < 0 ? 8 : 0) | (e - 1 - pow_2_min_exp_);
+      (*packed)[r * stride + k / 2] |= k % 2 ? nibble << 4 : nibble;
+    }
+  }
+}
+
+template <typename Dtype>
+bool BaseRistrettoLayer<Dtype>::ShiftAddFits(const int depth) const {
+  const int range = pow_2_max_exp_ - pow_2_min_exp_;
+  int sum_bits = bw_layer_in_ - 1 + range;
+  for (int k = 1; k < depth; k *= 2) {
+    ++sum_bits;
+  }
+  return range >= 0 && range <= 7 && sum_bits <= IntegerSumBits();
+}
+
+template <typename Dtype>
+int BaseRistrettoLayer<Dtype>::IntegerSumBits() {
+  return std::min(30, std::numeric_limits<Dtype>::digits);
+}
+
+template <typename Dtype>
+int BaseRistrettoLayer<Dtype>::ImageSlots(const int num) const {
+  if (rounding_ == QuantizationParameter_Rounding_STOCHASTIC) {
+    return 1;
+  }
+  return std::max(std::min(image_threads_, num), 1);
+}
+
+// out[c] += w << shift or out[c] -= w << shift for a row of columns
+static inline void shift_add_row(const int32_t* col, const int cols,
+    const int shift, const bool negative, int32_t* out) {
+  int c = 0;
+#ifdef __AVX2__
+  const __m128i count = _mm_cvtsi32_si128(shift);
+  for (; c + 8 <= cols; c += 8) {
+    const __m256i v = _mm256_sll_epi32(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(col + c)), count);
+    __m256i* o = reinterpret_cast<__m256i*>(out + c);
+    _mm256_storeu_si256(o, negative ?
+        _mm256_sub_epi32(_mm256_loadu_si256(o), v) :
+        _mm256_add_epi32(_mm256_loadu_si256(o), v));
+  }
+#endif
+  // shifted as unsigned, which is defined for negative inputs and gives the
+  // same bits as the vector shift
+  if (negative) {
+    for (; c < cols; ++c) {
+      out[c] -= static_cast<int32_t>(static_cast<uint32_t>(col[c]) << shift);
+    }
+  } else {
+    for (; c < cols; ++c) {
+      out[c] += static_cast<int32_t>(static_cast<uint32_t>(col[c]) << shift);
+    }
+  }
+}
+
+void ShiftAddGemm_cpu(const uint8_t* weight, const int rows, const int depth,
+    const int32_t* col, const int cols, int32_t* out) {
+  const int stride = (depth + 1) / 2;
+#ifdef _OPENMP
+#pragma omp parallel for if (static_cast<int64_t>(rows) * depth * cols >= 65536)
+#endif
+  for (int r = 0; r < rows; ++r) {
+    int32_t* o = out + r * cols;
+    std::fill(o, o + cols, 0);
+    for (int k = 0; k < depth; ++k) {
+      const uint8_t nibble = weight[r * stride + k / 2] >> (k % 2 ? 4 : 0);
+      shift_add_row(col + k * cols, cols, nibble & 7, nibble & 8, o);
+    }
+  }
+}
+
+template <typename Dtype>
+void BaseRistrettoLayer<Dtype>::QuantizeLayerOutputs_cpu(Dtype* data,
+      const int num, const int channels, const int dim) {
+  if (fl_layer_out_channel_.empty()) {
+    QuantizeLayerOutputs_cpu(data, num * channels * dim);
+    return;
+  }
+  CHECK(fixed_point_activations())
+      << "Unknown trimming mode: " << precision_;
+  if (dim > 1 || rounding_ == QuantizationParameter_Rounding_STOCHASTIC) {
+    for (int i = 0; i < num * channels; ++i) {
+      Trim2FixedPoint_cpu(data + i * dim, dim, bw_layer_out_, rounding_,
+          fl_layer_out_channel_[i % channels]);
+    }
+    return;
+  }
+  // One output per channel, as of inner products: a scale per element
+  vector<Dtype> scale(channels), inv_scale(channels);
+  for (int c = 0; c < channels; ++c) {
+    scale[c] = pow(2., fl_layer_out_channel_[c]);
+    inv_scale[c] = pow(2., -fl_layer_out_channel_[c]);
+  }
+  const Dtype max_data = pow(2., bw_layer_out_ - 1) - 1.0;
+  const Dtype min_data = -pow(2., bw_layer_out_ - 1);
+  for (int n = 0; n < num; ++n) {
+    Dtype* row = data + n * channels;
+    fixed_point_trim_scaled_cpu(row, channels, &scale[0], max_data,
+        min_data, &inv_scale[0],
+        rounding_ == QuantizationParameter_Rounding_NEAREST, row);
+  }
+}
+
+// Elements of a channel biased and trimmed at a time, while in L1
+static const int kEpilogueChunk = 2048;
+
+template <typename Dtype>
+void BaseRistrettoLayer<Dtype>::QuantizeLayerOutputs_cpu(Dtype* data,
+      const int channels, const int dim, const Dtype* bias, const bool relu) {
+  QuantizeLayerOutputs_cpu(data, dim, channels, dim, bias, relu, data);
+}
+
+template <typename Dtype>
+void BaseRistrettoLayer<Dtype>::QuantizeLayerOutputs_cpu(const Dtype* data,
+      const int data_stride, const int channels, const int dim,
+      const Dtype* bias, const bool relu, Dtype* output) {
+  CHECK(fixed_point_activations())
+      << "Unknown trimming mode: " << precision_;
+  CHECK_NE(rounding_, QuantizationParameter_Rounding_STOCHASTIC)
+      << "Stochastic rounding trims the whole top.";
+  const bool nearest = rounding_ == QuantizationParameter_Rounding_NEAREST;
+  const Dtype max_data = pow(2., bw_layer_out_ - 1) - 1.0;
+  // the ReLU is the lower saturation bound
+  const Dtype min_data = relu ? Dtype(0) : Dtype(-pow(2., bw_layer_out_ - 1));
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int c = 0; c < channels; ++c) {
+    const Dtype scale = pow(2., fl_layer_out(c));
+    const Dtype inv_scale = pow(2., -fl_layer_out(c));
+    for (int i = 0; i < dim; i += kEpilogueChunk) {
+      const Dtype* in = data + c * data_stride + i;
+      Dtype* out = output + c * dim + i;
+      const int n = std::min(kEpilogueChunk, dim - i);
+      if (bias) {
+        for (int j = 0; j < n; ++j) {
+          out[j] = in[j] + bias[c];
+        }
+        in = out;
+      }
+      fixed_point_trim_cpu(in, n, scale, max_data, min_data, inv_scale,
+          nearest, out);
+    }
+  }
+}
+
+template BaseRistrettoLayer<double>::BaseRistrettoLayer(
+    const LayerParameter& param);
+template BaseRistrettoLayer<float>::BaseRistrettoLayer(
+    const LayerParameter& param);
 template void BaseRistrettoLayer<double>::QuantizeWeights_cpu(
     vector<shared_ptr<Blob<double> > > weights_quantized, const int rounding,
     const bool bias_term);
 template void BaseRistrettoLayer<float>::QuantizeWeights_cpu(
     vector<shared_ptr<Blob<float> > > weights_quantized, const int rounding,
     const bool bias_term);
+template bool BaseRistrettoLayer<double>::UpdateWeightsQuantized_cpu(
+    const vector<shared_ptr<Blob<double> > >& weights, const Phase phase,
+    const bool bias_term);
+template bool BaseRistrettoLayer<float>::UpdateWeightsQuantized_cpu(
+    const vector<shared_ptr<Blob<float> > >& weights, const Phase phase,
+    const bool bias_term);
 template void BaseRistrettoLayer<double>::QuantizeLayerInputs_cpu(double* data,
     const int count);
 template void BaseRistrettoLayer<float>::QuantizeLayerInputs_cpu(float* data,
     const int count);
+template void BaseRistrettoLayer<double>::QuantizeLayerInputs_cpu(
+    const double* data, const int count, double* quantized);
+template void BaseRistrettoLayer<float>::QuantizeLayerInputs_cpu(
+    const float* data, const int count, float* quantized);
 template void BaseRistrettoLayer<double>::QuantizeLayerOutputs_cpu(double* data,
     const int count);
 template void BaseRistrettoLayer<float>::QuantizeLayerOutputs_cpu(float* data,
     const int count);
+template void BaseRistrettoLayer<double>::QuantizeLayerOutputs_cpu(
+    double* data, const int num, const int channels, const int dim);
+template void BaseRistrettoLayer<float>::QuantizeLayerOutputs_cpu(
+    float* data, const int num, const int channels, const int dim);
+template void BaseRistrettoLayer<double>::QuantizeLayerOutputs_cpu(
+    double* data, const int channels, const int dim, const double* bias,
+    const bool relu);
+template void BaseRistrettoLayer<float>::QuantizeLayerOutputs_cpu(
+    float* data, const int channels, const int dim, const float* bias,
+    const bool relu);
+template void BaseRistrettoLayer<double>::QuantizeLayerOutputs_cpu(
+    const double* data, const int data_stride, const int channels,
+    const int dim, const double* bias, const bool relu, double* output);
+template void BaseRistrettoLayer<float>::QuantizeLayerOutputs_cpu(
+    const float* data, const int data_stride, const int channels,
+    const int dim, const float* bias, const bool relu, float* output);
+template void BaseRistrettoLayer<double>::Trim2MiniFloat_cpu(double* data,
+    const int cnt, const int bw_mant, const int bw_exp, const int rounding);
+template void BaseRistrettoLayer<float>::Trim2MiniFloat_cpu(float* data,
+    const int cnt, const int bw_mant, const int bw_exp, const int rounding);
+template void BaseRistrettoLayer<double>::Trim2MiniFloat_cpu(
+    const double* data, const int cnt, const int bw_mant, const int bw_exp,
+    const int rounding, double* trimmed);
+template void BaseRistrettoLayer<float>::Trim2MiniFloat_cpu(
+    const float* data, const int cnt, const int bw_mant, const int bw_exp,
+    const int rounding, float* trimmed);
+template void BaseRistrettoLayer<double>::Trim2IntegerPowerOf2_cpu(
+    double* data, const int cnt, const int min_exp, const int max_exp,
+    const int rounding);
+template void BaseRistrettoLayer<float>::Trim2IntegerPowerOf2_cpu(
+    float* data, const int cnt, const int min_exp, const int max_exp,
+    const int rounding);
+template void BaseRistrettoLayer<double>::PackPowerOf2Weights_cpu(
+    const double* weight, const int rows, const int depth,
+    vector<uint8_t>* packed) const;
+template void BaseRistrettoLayer<float>::PackPowerOf2Weights_cpu(
+    const float* weight, const int rows, const int depth,
+    vector<uint8_t>* packed) const;
+template bool BaseRistrettoLayer<double>::ShiftAddFits(const int depth) const;
+template bool BaseRistrettoLayer<float>::ShiftAddFits(const int depth) const;
+template int BaseRistrettoLayer<double>::IntegerSumBits();
+template int BaseRistrettoLayer<float>::IntegerSumBits();
+template int BaseRistrettoLayer<double>::ImageSlots(const int num) const;
+template int BaseRistrettoLayer<float>::ImageSlots(const int num) const;
 template void BaseRistrettoLayer<double>::Trim2FixedPoint_cpu(double* data,
     const int cnt, const int bit_width, const int rounding, const int fl);
 template void BaseRistrettoLayer<float>::Trim2FixedPoint_cpu(float* data,
     const int cnt, const int bit_width, const int rounding, const int fl);
-//
-template double BaseRistrettoLayer<float>::RandUniform_cpu();
+template void BaseRistrettoLayer<double>::Trim2FixedPoint_cpu(
+    const double* data, const int cnt, const int bit_width, const int rounding,
+    const int fl, double* trimmed);
+template void BaseRistrettoLayer<float>::Trim2FixedPoint_cpu(
+    const float* data, const int cnt, const int bit_width, const int rounding,
+    const int fl, float* trimmed);
 
 }  // namespace caffe
@@ -0,0 +1,258 @@
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "ristretto/base_ristretto_layer.hpp"
+#include "caffe/util/bitplane.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+vector<Blob<Dtype>*> BinaryConvolutionRistrettoLayer<Dtype>::conv_bottom(
+      const vector<Blob<Dtype>*>& bottom) {
+  if (bottom.size() == 1) {
+    return bottom;
+  }
+  // (N, bw * C, packed) -> (N, bw * C, H, W) of the reference bottom
+  vector<int> shape(bottom[1]->shape());
+  shape[1] = bottom[0]->shape(1);
+  packed_shape_.Reshape(shape);
+  return vector<Blob<Dtype>*>(1, &packed_shape_);
+}
+
+template <typename Dtype>
+void BinaryConvolutionRistrettoLayer<Dtype>::LayerSetUp(
+      const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  CHECK_EQ(this->precision_,
+      QuantizationParameter_Precision_DYNAMIC_FIXED_POINT)
+      << "Binary convolution needs dynamic fixed point weights.";
+  CHECK(this->fl_params_channel_.empty())
+      << "Binary convolution needs one weight format for all channels.";
+  CHECK(this->bw_layer_in_ == 2 && this->fl_layer_in_ == 0)
+      << "Binary convolution takes {0, 1} inputs, bw_layer_in 2 and "
+      << "fl_layer_in 0.";
+  if (bottom.size() == 2) {
+    CHECK_EQ(bottom[0]->num_axes(), 3) << "Expected packed bitplanes.";
+  }
+  ConvolutionRistrettoLayer<Dtype>::LayerSetUp(conv_bottom(bottom), top);
+  CHECK_EQ(this->num_spatial_axes_, 2)
+      << "Binary convolution supports 2D convolution only.";
+  CHECK_EQ(this->group_, 1) << "Binary convolution does not support groups.";
+  channel_words_ = (this->conv_in_channels_ + 63) / 64;
+}
+
+template <typename Dtype>
+void BinaryConvolutionRistrettoLayer<Dtype>::Reshape(
+      const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  if (bottom.size() == 2) {
+    CHECK_EQ(bottom[0]->shape(0), bottom[1]->shape(0));
+    CHECK_EQ(bottom[0]->shape(2),
+        bitplane_packed_dim<Dtype>(bottom[1]->count(2)))
+        << "Packed bitplanes do not match the input shape.";
+  }
+  ConvolutionRistrettoLayer<Dtype>::Reshape(conv_bottom(bottom), top);
+}
+
+template <typename Dtype>
+void BinaryConvolutionRistrettoLayer<Dtype>::PackWeights_cpu() {
+  const int count = this->blobs_[0]->count();
+  const Dtype* weight = this->weights_quantized_[0]->cpu_data();
+  // Integer weights rounded to the format and the number of two's
+  // complement bits they need
+  const Dtype scale = pow(2, this->fl_params_);
+  const Dtype max_weight_data = pow(2, this->bw_params_ - 1) - 1;
+  vector<int64_t> iweight(count);
+  int64_t min_weight = 0, max_weight = 0;
+  for (int i = 0; i < count; ++i) {
+    iweight[i] = static_cast<int64_t>(std::max(std::min(
+        round(weight[i] * scale), max_weight_data), -max_weight_data - 1));
+    min_weight = std::min(min_weight, iweight[i]);
+    max_weight = std::max(max_weight, iweight[i]);
+  }
+  weight_planes_ = 1;
+  while (min_weight < -(int64_t(1) << (weight_planes_ - 1)) ||
+         max_weight >= (int64_t(1) << (weight_planes_ - 1))) {
+    ++weight_planes_;
+  }
+  // Split them into planes of channel words
+  const int channels = this->conv_in_channels_;
+  const int kernel = this->kernel_dim_ / channels;
+  const int words = channel_words_;
+  weight_bits_.assign(
+      this->conv_out_channels_ * weight_planes_ * kernel * words, 0);
+  for (int o = 0; o < this->conv_out_channels_; ++o) {
+    for (int c = 0; c < channels; ++c) {
+      for (int k = 0; k < kernel; ++k) {
+        const uint64_t u =
+            static_cast<uint64_t>(iweight[(o * channels + c) * kernel + k]);
+        for (int j = 0; j < weight_planes_; ++j) {
+          if ((u >> j) & 0x00000001) {
+            weight_bits_[((o * weight_planes_ + j) * kernel + k) * words +
+                c / 64] |= uint64_t(1) << (c % 64);
+          }
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+bool BinaryConvolutionRistrettoLayer<Dtype>::PackInput_cpu(
+      const vector<Blob<Dtype>*>& bottom, const int n, uint64_t* bits) {
+  const int channels = this->conv_in_channels_;
+  const int spatial = this->conv_input_shape_.cpu_data()[1] *
+      this->conv_input_shape_.cpu_data()[2];
+  const int words = channel_words_;
+  if (bottom.size() == 1) {
+    return bitplane_pack_channels_cpu(trimmed_bottom_.cpu_data() +
+        n * this->bottom_dim_, channels, spatial, bits);
+  } else {
+    // transpose the spatial words of the packed Bitplane layout
+    std::fill(bits, bits + spatial * words, uint64_t(0));
+    const int pwords = bitplane_words(spatial);
+    const uint64_t* planes =
+        reinterpret_cast<const uint64_t*>(bottom[0]->cpu_data()) +
+        n * channels * pwords;
+    for (int c = 0; c < channels; ++c) {
+      const uint64_t bit = uint64_t(1) << (c % 64);
+      uint64_t* out = bits + c / 64;
+      for (int w = 0; w < pwords; ++w) {
+        uint64_t word = planes[c * pwords + w];
+        while (word) {
+          const int s = w * 64 + bitplane_lowest_bit(word);
+          out[s * words] |= bit;
+          word &= word - 1;
+        }
+      }
+    }
+    return true;
+  }
+}
+
+template <typename Dtype>
+void BinaryConvolutionRistrettoLayer<Dtype>::Forward_cpu(
+      const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  // Trim layer input into a copy, the bottom is left as it is
+  if (bottom.size() == 1) {
+    trimmed_bottom_.ReshapeLike(*bottom[0]);
+    Dtype* data = trimmed_bottom_.mutable_cpu_data();
+    caffe_copy(bottom[0]->count(), bottom[0]->cpu_data(), data);
+    this->QuantizeLayerInputs_cpu(data, bottom[0]->count());
+  }
+  // Pack inputs
+  const int* input_shape = this->conv_input_shape_.cpu_data();
+  const int height = input_shape[1];
+  const int width  = input_shape[2];
+  const int words  = channel_words_;
+  const int pixels = height * width * words; // words per image
+  input_bits_.resize(this->num_ * pixels);
+  int binary = 1;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(&&:binary)
+#endif
+  for (int n = 0; n < this->num_; ++n) {
+    binary = PackInput_cpu(bottom, n, &input_bits_[n * pixels]) && binary;
+  }
+  if (!binary) {
+    // an unpacked input that is not {0, 1} takes the float path
+    ConvolutionRistrettoLayer<Dtype>::Forward_cpu(bottom, top);
+    return;
+  }
+  // Round weights and split them into planes when they change
+  if (this->UpdateWeightsQuantized_cpu(this->blobs_, this->phase_,
+      this->bias_term_)) {
+    PackWeights_cpu();
+  }
+  // Do forward propagation
+  const int* kernel_shape = this->kernel_shape_.cpu_data();
+  const int* stride = this->stride_.cpu_data();
+  const int* pad = this->pad_.cpu_data();
+  const int* dilation = this->dilation_.cpu_data();
+  const int kernel = kernel_shape[0] * kernel_shape[1];
+  const int out_h = this->output_shape_[0];
+  const int out_w = this->output_shape_[1];
+  const int num_output = this->conv_out_channels_;
+  const int planes = weight_planes_;
+  vector<int64_t> plane_weight(planes);
+  for (int j = 0; j < planes; ++j) {
+    plane_weight[j] = int64_t(1) << j;
+  }
+  plane_weight[planes - 1] = -plane_weight[planes - 1];
+  const Dtype scale = pow(2, -this->fl_params_);
+  const Dtype* bias = this->bias_term_ ?
+      this->weights_quantized_[1]->cpu_data() : NULL;
+  Dtype* top_data = top[0]->mutable_cpu_data();
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int row = 0; row < this->num_ * out_h; ++row) {
+    const int n  = row / out_h;
+    const int oh = row % out_h;
+    const uint64_t* bits = &input_bits_[n * pixels];
+    vector<const uint64_t*> tap_input(kernel);
+    vector<int> tap_kernel(kernel);
+    for (int ow = 0; ow < out_w; ++ow) {
+      // input words under the kernel, padding contributes nothing
+      int taps = 0;
+      for (int kh = 0; kh < kernel_shape[0]; ++kh) {
+        const int ih = oh * stride[0] - pad[0] + kh * dilation[0];
+        if (ih < 0 || ih >= height) {
+          continue;
+        }
+        for (int kw = 0; kw < kernel_shape[1]; ++kw) {
+          const int iw = ow * stride[1] - pad[1] + kw * dilation[1];
+          if (iw < 0 || iw >= width) {
+            continue;
+          }
+          tap_input[taps] = bits + (ih * width + iw) * words;
+          tap_kernel[taps] = kh * kernel_shape[1] + kw;
+          ++taps;
+        }
+      }
+      for (int o = 0; o < num_output; ++o) {
+        const uint64_t* weight = &weight_bits_[o * planes * kernel * words];
+        int64_t acc = 0;
+        for (int j = 0; j < planes; ++j) {
+          int cnt = 0;
+          for (int t = 0; t < taps; ++t) {
+            const uint64_t* w = weight + tap_kernel[t] * words;
+            const uint64_t* x = tap_input[t];
+            for (int i = 0; i < words; ++i) {
+              cnt += bitplane_popcount(w[i] & x[i]);
+            }
+          }
+          acc += plane_weight[j] * cnt;
+          weight += kernel * words;
+        }
+        Dtype value = acc * scale;
+        if (bias) {
+          value += bias[o];
+        }
+        top_data[((n * num_output + o) * out_h + oh) * out_w + ow] = value;
+      }
+    }
+  }
+  // Trim layer output
+  this->QuantizeLayerOutputs_cpu(top_data, this->num_, num_output,
+      out_h * out_w);
+}
+
+template <typename Dtype>
+void BinaryConvolutionRistrettoLayer<Dtype>::Backward_cpu(
+      const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+      const vector<Blob<Dtype>*>& bottom) {
+  CHECK_EQ(bottom.size(), 1) << "Packed bitplanes do not propagate gradients.";
+  // the weight gradient of the trimmed input, the bottom gradient of bottom
+  trimmed_bottom_.ShareDiff(*bottom[0]);
+  ConvolutionRistrettoLayer<Dtype>::Backward_cpu(top, propagate_down,
+      vector<Blob<Dtype>*>(1, &trimmed_bottom_));
+}
+
+#ifdef CPU_ONLY
+STUB_GPU(BinaryConvolutionRistrettoLayer);
+#endif
+
+INSTANTIATE_CLASS(BinaryConvolutionRistrettoLayer);
+REGISTER_LAYER_CLASS(BinaryConvolutionRistretto);
+
+}  // namespace caffe
@@ -0,0 +1,26 @@
+#include <vector>
+
+#include "ristretto/base_ristretto_layer.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void BinaryConvolutionRistrettoLayer<Dtype>::Forward_gpu(
+      const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  // bit operations run on the host
+  this->Forward_cpu(bottom, top);
+}
+
+template <typename Dtype>
+void BinaryConvolutionRistrettoLayer<Dtype>::Backward_gpu(
+      const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+      const vector<Blob<Dtype>*>& bottom) {
+  CHECK_EQ(bottom.size(), 1) << "Packed bitplanes do not propagate gradients.";
+  trimmed_bottom_.ShareDiff(*bottom[0]);
+  ConvolutionRistrettoLayer<Dtype>::Backward_gpu(top, propagate_down,
+      vector<Blob<Dtype>*>(1, &trimmed_bottom_));
+}
+
+INSTANTIATE_LAYER_GPU_FUNCS(BinaryConvolutionRistrettoLayer);
+
+}  // namespace caffe
@@ -1,14 +1,93 @@
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <vector>
 
 #include "ristretto/base_ristretto_layer.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/util/bitplane.hpp"
+#include "caffe/util/implicit_gemm.hpp"
+#include "caffe/util/math_functions.hpp"
 
 namespace caffe {
 
+// Columns of the integer GEMM per task
+static const int kIntegerTileCols = 256;
+// Columns of a batched 1x1 convolution GEMM
+static const int kBatchGemmCols = 65536;
+
+// sums (rows, cols) = weights (rows, pairs, 2) x col (pairs, cols, 2) for up
+// to 4 rows; cols is a multiple of 8.
+template <int R>
+static void integer_gemm_rows(const int16_t* weights, const int pairs,
+    const int16_t* col, const int cols, const int n0, const int n1,
+    int32_t* sums) {
+#if defined(__AVX2__)
+  for (int n = n0; n < n1; n += 8) {
+    __m256i acc[R];
+    for (int r = 0; r < R; ++r) {
+      acc[r] = _mm256_setzero_si256();
+    }
+    for (int p = 0; p < pairs; ++p) {
+      const __m256i x = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(col + (p * cols + n) * 2));
+      for (int r = 0; r < R; ++r) {
+        int32_t w;
+        memcpy(&w, weights + (r * pairs + p) * 2, sizeof(w));
+        acc[r] = _mm256_add_epi32(acc[r],
+            _mm256_madd_epi16(x, _mm256_set1_epi32(w)));
+      }
+    }
+    for (int r = 0; r < R; ++r) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(sums + r * cols + n),
+          acc[r]);
+    }
+  }
+#else
+  for (int r = 0; r < R; ++r) {
+    int32_t* out = sums + r * cols;
+    std::fill(out + n0, out + n1, 0);
+    for (int p = 0; p < pairs; ++p) {
+      const int32_t w0 = weights[(r * pairs + p) * 2];
+      const int32_t w1 = weights[(r * pairs + p) * 2 + 1];
+      const int16_t* x = col + p * cols * 2;
+      for (int n = n0; n < n1; ++n) {
+        out[n] += w0 * x[2 * n] + w1 * x[2 * n + 1];
+      }
+    }
+  }
+#endif
+}
+
+static void integer_gemm(const int16_t* weights, const int rows,
+    const int pairs, const int16_t* col, const int cols, int32_t* sums) {
+  const int row_blocks = (rows + 3) / 4;
+  const int col_tiles = (cols + kIntegerTileCols - 1) / kIntegerTileCols;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int t = 0; t < row_blocks * col_tiles; ++t) {
+    const int r = t / col_tiles * 4;
+    const int n0 = t % col_tiles * kIntegerTileCols;
+    const int n1 = std::min(n0 + kIntegerTileCols, cols);
+    const int16_t* w = weights + r * pairs * 2;
+    int32_t* out = sums + r * cols;
+    switch (std::min(rows - r, 4)) {
+    case 4: integer_gemm_rows<4>(w, pairs, col, cols, n0, n1, out); break;
+    case 3: integer_gemm_rows<3>(w, pairs, col, cols, n0, n1, out); break;
+    case 2: integer_gemm_rows<2>(w, pairs, col, cols, n0, n1, out); break;
+    default: integer_gemm_rows<1>(w, pairs, col, cols, n0, n1, out); break;
+    }
+  }
+}
+
 template <typename Dtype>
 ConvolutionRistrettoLayer<Dtype>::ConvolutionRistrettoLayer(
       const LayerParameter& param) : ConvolutionLayer<Dtype>(param),
-      BaseRistrettoLayer<Dtype>() {
+      BaseRistrettoLayer<Dtype>(param) {
   this->precision_ = this->layer_param_.quantization_param().precision();
   this->rounding_ = this->layer_param_.quantization_param().rounding_scheme();
   switch (this->precision_) {
@@ -36,6 +115,7 @@ ConvolutionRistrettoLayer<Dtype>::ConvolutionRistrettoLayer(
     LOG(FATAL) << "Unknown precision mode: " << this->precision_;
     break;
   }
+  fused_relu_ = this->layer_param_.quantization_param().fused_relu();
 }
 
 template <typename Dtype>
@@ -217,56 +297,484 @@ void ConvolutionRistrettoLayer<Dtype>::LayerSetUp(
   if (this->bias_term_) {
       this->weights_quantized_[1].reset(new Blob<Dtype>(bias_shape));
   }
+  CHECK(this->fl_params_channel_.empty() ||
+      this->fl_params_channel_.size() == this->num_output_)
+      << "fl_params_channel needs one value per output channel.";
+  CHECK(this->fl_layer_out_channel_.empty() ||
+      this->fl_layer_out_channel_.size() == this->num_output_)
+      << "fl_layer_out_channel needs one value per output channel.";
+  // Binary inputs are convolved with additions only
+  this->binary_input_ = this->precision_ ==
+      QuantizationParameter_Precision_DYNAMIC_FIXED_POINT &&
+      this->bw_layer_in_ == 2 && this->fl_layer_in_ == 0 &&
+      this->group_ == 1 && this->num_spatial_axes_ == 2;
+  // 2D kernels other than 1x1 are convolved without an im2col buffer
+  implicit_gemm_ = this->num_spatial_axes_ == 2 && !this->is_1x1_ &&
+      !this->force_nd_im2col_;
+  // The integer engine needs int16 operands and int32 sums that cannot
+  // overflow, and that the float emulation computes exactly
+  QuantizationParameter_Engine engine =
+      this->layer_param_.quantization_param().engine();
+  if (engine == QuantizationParameter_Engine_DEFAULT) {
+    engine = RistrettoEngine();
+  }
+  integer_engine_ = false;
+  integer_sum_bits_ = 0;
+  shift_add_ = false;
+  if (engine == QuantizationParameter_Engine_INTEGER && !binary_input_) {
+    if (this->precision_ ==
+        QuantizationParameter_Precision_DYNAMIC_FIXED_POINT) {
+      integer_sum_bits_ = this->bw_layer_in_ + this->bw_params_ - 2;
+      for (int k = 1; k < this->kernel_dim_; k *= 2) {
+        ++integer_sum_bits_;
+      }
+      integer_engine_ = this->group_ == 1 && this->num_spatial_axes_ == 2 &&
+          this->bw_layer_in_ <= 16 && this->bw_params_ <= 16 &&
+          this->bw_layer_out_ <= 16 &&
+          integer_sum_bits_ <= this->IntegerSumBits();
+      for (int o = 0; o < this->num_output_; ++o) {
+        const int shift = this->fl_layer_in_ + this->fl_params(o) -
+            this->fl_layer_out(o);
+        integer_engine_ &= shift >= -30 && shift <= 62;
+      }
+    } else if (this->precision_ ==
+        QuantizationParameter_Precision_INTEGER_POWER_OF_2_WEIGHTS) {
+      // power-of-two weights are shifts of the integer inputs
+      shift_add_ = this->group_ == 1 && this->num_spatial_axes_ == 2 &&
+          this->ShiftAddFits(this->kernel_dim_);
+    }
+    if (!integer_engine_ && !shift_add_) {
+      LOG(INFO) << this->layer_param_.name() << " falls back to the float "
+          << "emulation: the integer engine needs dynamic fixed point with "
+          << "up to 16 bits or power-of-two weights of up to 8 exponents, "
+          << "no groups and 2D kernels.";
+    }
+  }
 }
 
 template <typename Dtype>
 void ConvolutionRistrettoLayer<Dtype>::Forward_cpu(
       const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  // Trim layer input
-  //if (this->phase_ == TEST) {
-    for (int i = 0; i < bottom.size(); ++i) {
-      this->QuantizeLayerInputs_cpu(bottom[i]->mutable_cpu_data(),
-          bottom[i]->count());
-    }
-  //}
-  // Trim weights
-  caffe_copy(this->blobs_[0]->count(), this->blobs_[0]->cpu_data(),
-      this->weights_quantized_[0]->mutable_cpu_data());
-  if (this->bias_term_) {
-    caffe_copy(this->blobs_[1]->count(), this->blobs_[1]->cpu_data(),
-        this->weights_quantized_[1]->mutable_cpu_data());
-  }
-  /*int rounding = this->phase_ == TEST ? this->rounding_ :
-      QuantizationParameter_Rounding_STOCHASTIC;
-  this->QuantizeWeights_cpu(this->weights_quantized_, rounding,
-      this->bias_term_);*/
+  // Copy weights, trimmed with trim_weights
+  const bool weights_changed = this->UpdateWeightsQuantized_cpu(this->blobs_,
+      this->phase_, this->bias_term_);
   // Do forward propagation
   const Dtype* weight = this->weights_quantized_[0]->cpu_data();
+  if (binary_input_ && weights_changed) {
+    // (out, in * kernel) -> (in * kernel, out)
+    const int num_output = this->conv_out_channels_;
+    const int kernel_dim = this->kernel_dim_;
+    binary_weights_.resize(num_output * kernel_dim);
+    for (int o = 0; o < num_output; ++o) {
+      for (int k = 0; k < kernel_dim; ++k) {
+        binary_weights_[k * num_output + o] = weight[o * kernel_dim + k];
+      }
+    }
+  }
+  if (integer_engine_ && weights_changed) {
+    // Weights to integers, paired along kernel_dim
+    const int num_output = this->conv_out_channels_;
+    const int kernel_dim = this->kernel_dim_;
+    const int pairs = (kernel_dim + 1) / 2;
+    const Dtype max_weight = (1 << (this->bw_params_ - 1)) - 1;
+    integer_weights_.assign(num_output * pairs * 2, 0);
+    for (int o = 0; o < num_output; ++o) {
+      const Dtype weight_scale = std::pow(Dtype(2), this->fl_params(o));
+      for (int k = 0; k < kernel_dim; ++k) {
+        const Dtype w = round(weight[o * kernel_dim + k] * weight_scale);
+        integer_weights_[o * pairs * 2 + k] = static_cast<int16_t>(
+            std::max(std::min(w, max_weight), -max_weight - 1));
+      }
+    }
+    // The bias is added to the sums if it is on their grid and no sum with
+    // it leaves the IntegerSumBits() the float emulation adds exactly
+    integer_bias_.clear();
+    if (this->rounding_ == QuantizationParameter_Rounding_NEAREST) {
+      const double max_bias = std::pow(2.0, this->IntegerSumBits()) -
+          std::pow(2.0, integer_sum_bits_);
+      integer_bias_.resize(num_output, 0);
+      for (int o = 0; this->bias_term_ && o < num_output; ++o) {
+        const double sum_scale =
+            std::pow(2.0, this->fl_layer_in_ + this->fl_params(o));
+        const double b = this->weights_quantized_[1]->cpu_data()[o] *
+            sum_scale;
+        if (b != std::floor(b) || std::fabs(b) > max_bias) {
+          integer_bias_.clear();
+          break;
+        }
+        integer_bias_[o] = static_cast<int64_t>(b);
+      }
+    }
+  }
+  if (shift_add_ && weights_changed) {
+    this->PackPowerOf2Weights_cpu(weight, this->conv_out_channels_,
+        this->kernel_dim_, &shift_add_weights_);
+  }
+  // Bias, ReLU and output trimming of each image in one pass, unless the
+  // whole top is rounded stochastically
+  const bool epilogue = this->fixed_point_activations() &&
+      this->rounding_ != QuantizationParameter_Rounding_STOCHASTIC;
+  const bool integer_output = integer_engine_ && !integer_bias_.empty();
+  const Dtype* bias = this->bias_term_ ?
+      this->weights_quantized_[1]->cpu_data() : NULL;
+  // 1x1 convolutions of several images are one GEMM
+  const int batch_images = this->is_1x1_ && epilogue && !integer_engine_ &&
+      !shift_add_ && !binary_input_ && this->group_ == 1 ? std::min(this->num_,
+      kBatchGemmCols / std::max(this->out_spatial_dim_, 1)) : 1;
+  // The implicit GEMM reads the weights of each group as packed blocks, the
+  // column GEMMs only where packed_gemm_cpu beats the BLAS
+  const bool packed = !integer_engine_ && !shift_add_ && (implicit_gemm_ ||
+      packed_gemm_preferred<Dtype>(this->kernel_dim_,
+      batch_images * this->out_spatial_dim_));
+  if (packed && (weights_changed || packed_weights_.empty())) {
+    const int num_output = this->conv_out_channels_ / this->group_;
+    const int size = gemm_packed_size(num_output, this->kernel_dim_);
+    packed_weights_.resize(this->group_ * size);
+    for (int g = 0; g < this->group_; ++g) {
+      gemm_pack_weights_cpu(weight + g * this->weight_offset_, num_output,
+          this->kernel_dim_, false, &packed_weights_[g * size]);
+    }
+  }
+  // The other images run in parallel unless a path with buffers of the
+  // layer is taken
+  const int slots = integer_engine_ || shift_add_ || binary_input_ ? 1 :
+      this->ImageSlots(this->num_);
+  const bool use_col = !implicit_gemm_ && !this->is_1x1_;
+  // The implicit GEMM trims the input while it packs the patches, unless
+  // stochastic rounding would round the copies of an input differently
+  const bool trim_packed = implicit_gemm_ && !integer_engine_ &&
+      !shift_add_ && !binary_input_ && this->fixed_point_activations() &&
+      this->rounding_ != QuantizationParameter_Rounding_STOCHASTIC;
+  GemmInputTrim<Dtype> trim;
+  trim.nearest = this->rounding_ == QuantizationParameter_Rounding_NEAREST;
+  trim.scale = std::pow(2., this->fl_layer_in_);
+  trim.inv_scale = std::pow(2., -this->fl_layer_in_);
+  trim.max_data = std::pow(2., this->bw_layer_in_ - 1) - 1.0;
+  trim.min_data = -std::pow(2., this->bw_layer_in_ - 1);
+  this->image_input_.resize(slots);
+  this->image_col_.resize(slots);
+  this->input_rng_counter_.resize(bottom.size());
   for (int i = 0; i < bottom.size(); ++i) {
+    this->input_rng_counter_[i] = this->rng_counter_;
     const Dtype* bottom_data = bottom[i]->cpu_data();
     Dtype* top_data = top[i]->mutable_cpu_data();
-    for (int n = 0; n < this->num_; ++n) {
-      this->forward_cpu_gemm(bottom_data + n * this->bottom_dim_, weight,
-          top_data + n * this->top_dim_);
-      if (this->bias_term_) {
-        const Dtype* bias = this->weights_quantized_[1]->cpu_data();
-        this->forward_cpu_bias(top_data + n * this->top_dim_, bias);
+    if (batch_images > 1) {
+      for (int n = 0; n < this->num_; n += batch_images) {
+        forward_cpu_batch_1x1(bottom_data + n * this->bottom_dim_, weight,
+            bias, std::min(batch_images, this->num_ - n),
+            top_data + n * this->top_dim_);
+      }
+      continue;
+    }
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(slots) schedule(static, 1) if (slots > 1)
+#endif
+    for (int s = 0; s < slots; ++s) {
+      // The layer input is trimmed into a copy or while it is packed, the
+      // bottom is left as it is
+      vector<Dtype>& quantized = this->image_input_[s];
+      quantized.resize(trim_packed ? 0 : this->bottom_dim_);
+      this->image_col_[s].resize(use_col ? this->col_buffer_.count() : 0);
+      const int n_end = (s + 1) * this->num_ / slots;
+      for (int n = s * this->num_ / slots; n < n_end; ++n) {
+        const Dtype* input = bottom_data + n * this->bottom_dim_;
+        Dtype* output = top_data + n * this->top_dim_;
+        if (!trim_packed) {
+          this->QuantizeLayerInputs_cpu(input, this->bottom_dim_,
+              &quantized[0]);
+        }
+        if (trim_packed) {
+          forward_cpu_implicit_gemm(input, &packed_weights_[0], &trim,
+              output);
+        } else if (integer_engine_) {
+          forward_cpu_integer(&quantized[0], output);
+        } else if (shift_add_) {
+          forward_cpu_shift_add(&quantized[0], output);
+        } else if (!binary_input_ ||
+            !forward_cpu_binary(&quantized[0], output)) {
+          if (implicit_gemm_) {
+            forward_cpu_implicit_gemm(&quantized[0], &packed_weights_[0],
+                NULL, output);
+          } else {
+            forward_cpu_gemm_col(&quantized[0], weight,
+                use_col ? &this->image_col_[s][0] : NULL, output);
+          }
+        }
+        if (integer_output) {
+          continue;
+        }
+        if (epilogue) {
+          this->QuantizeLayerOutputs_cpu(output, this->conv_out_channels_,
+              this->out_spatial_dim_, bias, fused_relu_);
+        } else if (this->bias_term_) {
+          for (int o = 0; o < this->conv_out_channels_; ++o) {
+            Dtype* out = output + o * this->out_spatial_dim_;
+            for (int j = 0; j < this->out_spatial_dim_; ++j) {
+              out[j] += bias[o];
+            }
+          }
+        }
       }
     }
     // Trim layer output
     //if (this->phase_ == TEST) {
-      this->QuantizeLayerOutputs_cpu(top_data, top[i]->count());
+    if (!epilogue && !integer_output) {
+      this->QuantizeLayerOutputs_cpu(top_data, this->num_,
+          this->conv_out_channels_, this->out_spatial_dim_);
+      if (fused_relu_) {
+        for (int j = 0; j < top[i]->count(); ++j) {
+          top_data[j] = std::max(top_data[j], Dtype(0));
+        }
+      }
+    }
     //}
   }
 }
 
+template <typename Dtype>
+void ConvolutionRistrettoLayer<Dtype>::forward_cpu_integer(const Dtype* input,
+      Dtype* output) {
+  const int* input_shape = this->conv_input_shape_.cpu_data();
+  const int height = input_shape[1];
+  const int width = input_shape[2];
+  const int* kernel_shape = this->kernel_shape_.cpu_data();
+  const int* stride = this->stride_.cpu_data();
+  const int* pad = this->pad_.cpu_data();
+  const int* dilation = this->dilation_.cpu_data();
+  const int kernel = kernel_shape[0] * kernel_shape[1];
+  const int kernel_dim = this->kernel_dim_;
+  const int pairs = (kernel_dim + 1) / 2;
+  const int num_output = this->conv_out_channels_;
+  const int out_h = this->output_shape_[0];
+  const int out_w = this->output_shape_[1];
+  const int out_dim = out_h * out_w;
+  const int cols = (out_dim + 7) / 8 * 8;
+  // The trimmed input is exact at its fixed point scale
+  const int input_dim = this->conv_in_channels_ * height * width;
+  const Dtype input_scale = std::pow(Dtype(2), this->fl_layer_in_);
+  integer_input_.resize(input_dim);
+  for (int i = 0; i < input_dim; ++i) {
+    integer_input_[i] = static_cast<int16_t>(input[i] * input_scale);
+  }
+  integer_col_.resize(pairs * cols * 2);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int k = 0; k < pairs * 2; ++k) {
+    int16_t* col = &integer_col_[k / 2 * cols * 2 + k % 2];
+    int n = 0;
+    if (k < kernel_dim) {
+      const int16_t* plane = &integer_input_[k / kernel * height * width];
+      const int kh = k % kernel / kernel_shape[1];
+      const int kw = k % kernel_shape[1];
+      for (int oh = 0; oh < out_h; ++oh) {
+        const int ih = oh * stride[0] - pad[0] + kh * dilation[0];
+        for (int ow = 0; ow < out_w; ++ow, ++n) {
+          const int iw = ow * stride[1] - pad[1] + kw * dilation[1];
+          col[2 * n] = ih >= 0 && ih < height && iw >= 0 && iw < width ?
+              plane[ih * width + iw] : 0;
+        }
+      }
+    }
+    for (; n < cols; ++n) {
+      col[2 * n] = 0;
+    }
+  }
+  integer_sums_.resize(num_output * cols);
+  integer_gemm(&integer_weights_[0], num_output, pairs, &integer_col_[0],
+      cols, &integer_sums_[0]);
+  if (integer_bias_.empty()) {
+    // float bias or stochastic rounding: the sums as floats, the bias is
+    // added and the output trimmed like in the emulation
+    for (int o = 0; o < num_output; ++o) {
+      const Dtype sum_step =
+          std::pow(Dtype(2), -this->fl_layer_in_ - this->fl_params(o));
+      for (int n = 0; n < out_dim; ++n) {
+        output[o * out_dim + n] = integer_sums_[o * cols + n] * sum_step;
+      }
+    }
+    return;
+  }
+  // Requantize the sums to the layer output, saturating at 0 for the ReLU
+  const int64_t max_out = (1 << (this->bw_layer_out_ - 1)) - 1;
+  const int64_t min_out = fused_relu_ ? 0 : -max_out - 1;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int o = 0; o < num_output; ++o) {
+    const int shift =
+        this->fl_layer_in_ + this->fl_params(o) - this->fl_layer_out(o);
+    const Dtype out_step = std::pow(Dtype(2), -this->fl_layer_out(o));
+    const int32_t* sums = &integer_sums_[o * cols];
+    for (int n = 0; n < out_dim; ++n) {
+      const int64_t q = IntegerRequantize(sums[n] + integer_bias_[o], shift);
+      output[o * out_dim + n] =
+          std::max(std::min(q, max_out), min_out) * out_step;
+    }
+  }
+}
+
+template <typename Dtype>
+void ConvolutionRistrettoLayer<Dtype>::forward_cpu_shift_add(
+      const Dtype* input, Dtype* output) {
+  const int kernel_dim = this->kernel_dim_;
+  const int out_dim = this->out_spatial_dim_;
+  const int num_output = this->conv_out_channels_;
+  const Dtype* col = input;
+  if (!this->is_1x1_) {
+    this->conv_im2col_cpu(input, this->col_buffer_.mutable_cpu_data());
+    col = this->col_buffer_.cpu_data();
+  }
+  // The trimmed input is exact at its fixed point scale
+  const Dtype input_scale = std::pow(Dtype(2), this->fl_layer_in_);
+  shift_add_col_.resize(kernel_dim * out_dim);
+  for (int i = 0; i < kernel_dim * out_dim; ++i) {
+    shift_add_col_[i] = static_cast<int32_t>(col[i] * input_scale);
+  }
+  integer_sums_.resize(num_output * out_dim);
+  ShiftAddGemm_cpu(&shift_add_weights_[0], num_output, kernel_dim,
+      &shift_add_col_[0], out_dim, &integer_sums_[0]);
+  const Dtype sum_step =
+      std::pow(Dtype(2), this->pow_2_min_exp_ - this->fl_layer_in_);
+  for (int i = 0; i < num_output * out_dim; ++i) {
+    output[i] = integer_sums_[i] * sum_step;
+  }
+}
+
+template <typename Dtype>
+void ConvolutionRistrettoLayer<Dtype>::forward_cpu_implicit_gemm(
+      const Dtype* input, const Dtype* weight,
+      const GemmInputTrim<Dtype>* trim, Dtype* output) {
+  const int* input_shape = this->conv_input_shape_.cpu_data();
+  const int height = input_shape[1];
+  const int width = input_shape[2];
+  const int channels = this->conv_in_channels_ / this->group_;
+  const int num_output = this->conv_out_channels_ / this->group_;
+  const int out_dim = this->out_spatial_dim_;
+  const int size = gemm_packed_size(num_output, this->kernel_dim_);
+  for (int g = 0; g < this->group_; ++g) {
+    implicit_gemm_conv_cpu(weight + g * size, num_output,
+        input + g * channels * height * width, channels, height, width,
+        this->kernel_shape_.cpu_data(), this->pad_.cpu_data(),
+        this->stride_.cpu_data(), this->dilation_.cpu_data(),
+        this->output_shape_[0], this->output_shape_[1],
+        output + g * num_output * out_dim, out_dim, this->output_shape_[1], 1,
+        trim);
+  }
+}
+
+template <typename Dtype>
+void ConvolutionRistrettoLayer<Dtype>::forward_cpu_batch_1x1(
+      const Dtype* input, const Dtype* weight, const Dtype* bias,
+      const int images, Dtype* output) {
+  const int channels = this->conv_in_channels_;
+  const int num_output = this->conv_out_channels_;
+  const int dim = this->out_spatial_dim_;
+  const int cols = images * dim;
+  // The trimmed images side by side, (channels, images * dim)
+  this->quantized_input_.resize(channels * cols);
+  Dtype* col = &this->quantized_input_[0];
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int r = 0; r < channels * images; ++r) {
+    const int c = r / images;
+    const int n = r % images;
+    this->QuantizeLayerInputs_cpu(input + (n * channels + c) * dim, dim,
+        col + c * cols + n * dim);
+  }
+  batch_output_.resize(num_output * cols);
+  if (packed_gemm_preferred<Dtype>(channels, cols)) {
+    packed_gemm_cpu(&packed_weights_[0], num_output, channels, col, cols,
+        &batch_output_[0]);
+  } else {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num_output, cols,
+        channels, (Dtype)1., weight, col, (Dtype)0., &batch_output_[0]);
+  }
+  // Bias, ReLU and trimming back into (images, num_output, dim)
+  for (int n = 0; n < images; ++n) {
+    this->QuantizeLayerOutputs_cpu(&batch_output_[n * dim], cols, num_output,
+        dim, bias, fused_relu_, output + n * num_output * dim);
+  }
+}
+
+template <typename Dtype>
+bool ConvolutionRistrettoLayer<Dtype>::forward_cpu_binary(const Dtype* input,
+      Dtype* output) {
+  const int* input_shape = this->conv_input_shape_.cpu_data();
+  const int height = input_shape[1];
+  const int width = input_shape[2];
+  const int words = bitplane_words(this->conv_in_channels_);
+  binary_bits_.resize(height * width * words);
+  if (!bitplane_pack_channels_cpu(input, this->conv_in_channels_,
+      height * width, &binary_bits_[0])) {
+    return false;
+  }
+  const int* kernel_shape = this->kernel_shape_.cpu_data();
+  const int* stride = this->stride_.cpu_data();
+  const int* pad = this->pad_.cpu_data();
+  const int* dilation = this->dilation_.cpu_data();
+  const int kernel = kernel_shape[0] * kernel_shape[1];
+  const int num_output = this->conv_out_channels_;
+  const int out_h = this->output_shape_[0];
+  const int out_w = this->output_shape_[1];
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int oh = 0; oh < out_h; ++oh) {
+    vector<Dtype> acc(num_output);
+    for (int ow = 0; ow < out_w; ++ow) {
+      std::fill(acc.begin(), acc.end(), Dtype(0));
+      for (int kh = 0; kh < kernel_shape[0]; ++kh) {
+        const int ih = oh * stride[0] - pad[0] + kh * dilation[0];
+        if (ih < 0 || ih >= height) {
+          continue;
+        }
+        for (int kw = 0; kw < kernel_shape[1]; ++kw) {
+          const int iw = ow * stride[1] - pad[1] + kw * dilation[1];
+          if (iw < 0 || iw >= width) {
+            continue;
+          }
+          // add the weight column of every set input channel
+          const uint64_t* bits = &binary_bits_[(ih * width + iw) * words];
+          const int k = kh * kernel_shape[1] + kw;
+          for (int w = 0; w < words; ++w) {
+            for (uint64_t word = bits[w]; word; word &= word - 1) {
+              const int c = w * 64 + bitplane_lowest_bit(word);
+              const Dtype* column = &binary_weights_[(c * kernel + k) *
+                  num_output];
+              for (int o = 0; o < num_output; ++o) {
+                acc[o] += column[o];
+              }
+            }
+          }
+        }
+      }
+      for (int o = 0; o < num_output; ++o) {
+        output[(o * out_h + oh) * out_w + ow] = acc[o];
+      }
+    }
+  }
+  return true;
+}
+
 template <typename Dtype>
 void ConvolutionRistrettoLayer<Dtype>::Backward_cpu(
       const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
       const vector<Blob<Dtype>*>& bottom) {
+  // The solver updates the weights after the backward pass
+  RistrettoWeightsChanged();
   const Dtype* weight = this->weights_quantized_[0]->cpu_data();
   Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
   for (int i = 0; i < top.size(); ++i) {
+    if (fused_relu_) {
+      // backward of the ReLU, in place like the folded layer
+      const Dtype* top_data = top[i]->cpu_data();
+      Dtype* diff = top[i]->mutable_cpu_diff();
+      for (int j = 0; j < top[i]->count(); ++j) {
+        diff[j] *= top_data[j] > 0;
+      }
+    }
     const Dtype* top_diff = top[i]->cpu_diff();
     const Dtype* bottom_data = bottom[i]->cpu_data();
     Dtype* bottom_diff = bottom[i]->mutable_cpu_diff();
@@ -278,22 +786,119 @@ void ConvolutionRistrettoLayer<Dtype>::Backward_cpu(
       }
     }
     if (this->param_propagate_down_[0] || propagate_down[i]) {
-      for (int n = 0; n < this->num_; ++n) {
-        // gradient w.r.t. weight. Note that we will accumulate diffs.
-        if (this->param_propagate_down_[0]) {
-          this->weight_cpu_gemm(bottom_data + n * this->bottom_dim_,
-              top_diff + n * this->top_dim_, weight_diff);
+      // Images in parallel; each slot adds its images' weight gradients
+      // up in its own buffer, and the slots are added in order
+      const int slots = this->ImageSlots(this->num_);
+      this->image_input_.resize(slots);
+      this->image_col_.resize(slots);
+      this->image_weight_diff_.resize(slots > 1 ? slots : 0);
+      // Stochastic rounding replays the counters of the forward pass, which
+      // trimmed the images in the same order
+      const uint64_t rng_counter = this->rng_counter_;
+      this->rng_counter_ = this->input_rng_counter_[i];
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(slots) schedule(static, 1) if (slots > 1)
+#endif
+      for (int s = 0; s < slots; ++s) {
+        vector<Dtype>& quantized = this->image_input_[s];
+        quantized.resize(this->bottom_dim_);
+        this->image_col_[s].resize(this->is_1x1_ ? 0 :
+            this->col_buffer_.count());
+        Dtype* col = this->is_1x1_ ? NULL : &this->image_col_[s][0];
+        Dtype* slot_weight_diff = weight_diff;
+        if (slots > 1 && this->param_propagate_down_[0]) {
+          this->image_weight_diff_[s].assign(this->blobs_[0]->count(),
+              Dtype(0));
+          slot_weight_diff = &this->image_weight_diff_[s][0];
         }
-        // gradient w.r.t. bottom data, if necessary.
-        if (propagate_down[i]) {
-          this->backward_cpu_gemm(top_diff + n * this->top_dim_, weight,
-              bottom_diff + n * this->bottom_dim_);
+        const int n_end = (s + 1) * this->num_ / slots;
+        for (int n = s * this->num_ / slots; n < n_end; ++n) {
+          // gradient w.r.t. weight. Note that we will accumulate diffs.
+          if (this->param_propagate_down_[0]) {
+            // with the input trimmed as in the forward pass
+            this->QuantizeLayerInputs_cpu(bottom_data + n * this->bottom_dim_,
+                this->bottom_dim_, &quantized[0]);
+            weight_cpu_gemm_col(&quantized[0], top_diff + n * this->top_dim_,
+                col, slot_weight_diff);
+          }
+          // gradient w.r.t. bottom data, if necessary.
+          if (propagate_down[i]) {
+            backward_cpu_gemm_col(top_diff + n * this->top_dim_, weight, col,
+                bottom_diff + n * this->bottom_dim_);
+          }
+        }
+      }
+      this->rng_counter_ = rng_counter;
+      if (slots > 1 && this->param_propagate_down_[0]) {
+        for (int s = 0; s < slots; ++s) {
+          caffe_axpy<Dtype>(this->blobs_[0]->count(), (Dtype)1.,
+              &this->image_weight_diff_[s][0], weight_diff);
         }
       }
     }
   }
 }
 
+template <typename Dtype>
+void ConvolutionRistrettoLayer<Dtype>::forward_cpu_gemm_col(
+      const Dtype* input, const Dtype* weights, Dtype* col, Dtype* output) {
+  const Dtype* col_buff = input;
+  if (!this->is_1x1_) {
+    this->conv_im2col_cpu(input, col);
+    col_buff = col;
+  }
+  const int num_output = this->conv_out_channels_ / this->group_;
+  const int size = gemm_packed_size(num_output, this->kernel_dim_);
+  const bool packed = packed_gemm_preferred<Dtype>(this->kernel_dim_,
+      this->conv_out_spatial_dim_);
+  for (int g = 0; g < this->group_; ++g) {
+    if (packed) {
+      packed_gemm_cpu(&packed_weights_[g * size], num_output,
+          this->kernel_dim_, col_buff + this->col_offset_ * g,
+          this->conv_out_spatial_dim_, output + this->output_offset_ * g);
+    } else {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num_output,
+          this->conv_out_spatial_dim_, this->kernel_dim_, (Dtype)1.,
+          weights + this->weight_offset_ * g,
+          col_buff + this->col_offset_ * g, (Dtype)0.,
+          output + this->output_offset_ * g);
+    }
+  }
+}
+
+template <typename Dtype>
+void ConvolutionRistrettoLayer<Dtype>::weight_cpu_gemm_col(
+      const Dtype* input, const Dtype* output, Dtype* col, Dtype* weights) {
+  const Dtype* col_buff = input;
+  if (!this->is_1x1_) {
+    this->conv_im2col_cpu(input, col);
+    col_buff = col;
+  }
+  for (int g = 0; g < this->group_; ++g) {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans,
+        this->conv_out_channels_ / this->group_, this->kernel_dim_,
+        this->conv_out_spatial_dim_, (Dtype)1.,
+        output + this->output_offset_ * g, col_buff + this->col_offset_ * g,
+        (Dtype)1., weights + this->weight_offset_ * g);
+  }
+}
+
+template <typename Dtype>
+void ConvolutionRistrettoLayer<Dtype>::backward_cpu_gemm_col(
+      const Dtype* output, const Dtype* weights, Dtype* col, Dtype* input) {
+  Dtype* col_buff = this->is_1x1_ ? input : col;
+  for (int g = 0; g < this->group_; ++g) {
+    caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, this->kernel_dim_,
+        this->conv_out_spatial_dim_, this->conv_out_channels_ / this->group_,
+        (Dtype)1., weights + this->weight_offset_ * g,
+        output + this->output_offset_ * g, (Dtype)0.,
+        col_buff + this->col_offset_ * g);
+  }
+  if (!this->is_1x1_) {
+    this->conv_col2im_cpu(col_buff, input);
+  }
+}
+
 #ifdef CPU_ONLY
 STUB_GPU(ConvolutionRistrettoLayer);
 #endif
@@ -6,9 +6,28 @@
 
 namespace caffe {
 
+// The folded ReLU, in place
+template <typename Dtype>
+__global__ void FusedReLUForward(const int n, Dtype* data) {
+  CUDA_KERNEL_LOOP(index, n) {
+    data[index] = data[index] > 0 ? data[index] : Dtype(0);
+  }
+}
+
+template <typename Dtype>
+__global__ void FusedReLUBackward(const int n, const Dtype* data,
+    Dtype* diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    diff[index] = data[index] > 0 ? diff[index] : Dtype(0);
+  }
+}
+
 template <typename Dtype>
 void ConvolutionRistrettoLayer<Dtype>::Forward_gpu(
       const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  CHECK(this->fl_params_channel_.empty() &&
+      this->fl_layer_out_channel_.empty())
+      << "Formats per channel are trimmed on the CPU only.";
   // Trim layer input
   //if (this->phase_ == TEST) {
     for (int i = 0; i < bottom.size(); ++i) {
@@ -16,17 +35,21 @@ void ConvolutionRistrettoLayer<Dtype>::Forward_gpu(
           bottom[i]->count());
     }
   //}
-  // Trim weights
+  // Copy weights, trimmed with trim_weights
   caffe_copy(this->blobs_[0]->count(), this->blobs_[0]->gpu_data(),
       this->weights_quantized_[0]->mutable_gpu_data());
   if (this->bias_term_) {
     caffe_copy(this->blobs_[1]->count(), this->blobs_[1]->gpu_data(),
         this->weights_quantized_[1]->mutable_gpu_data());
   }
-  /*int rounding = this->phase_ == TEST ? this->rounding_ :
-      QuantizationParameter_Rounding_STOCHASTIC;
-  this->QuantizeWeights_gpu(this->weights_quantized_, rounding,
-      this->bias_term_);*/
+  if (this->trim_weights_) {
+    const int rounding = this->phase_ == TEST ? this->rounding_ :
+        QuantizationParameter_Rounding_STOCHASTIC;
+    this->QuantizeWeights_gpu(this->weights_quantized_, rounding,
+        this->bias_term_);
+  }
+  // the CPU passes copy the weights again
+  this->weights_source_.clear();
   // Do forward propagation
   const Dtype* weight = this->weights_quantized_[0]->gpu_data();
   for (int i = 0; i < bottom.size(); ++i) {
@@ -44,6 +67,13 @@ void ConvolutionRistrettoLayer<Dtype>::Forward_gpu(
     //if (this->phase_ == TEST) {
       this->QuantizeLayerOutputs_gpu(top_data, top[i]->count());
     //}
+    if (fused_relu_) {
+      const int count = top[i]->count();
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      FusedReLUForward<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS>>>(count, top_data);
+      CUDA_POST_KERNEL_CHECK;
+    }
   }
 }
 
@@ -51,9 +81,19 @@ template <typename Dtype>
 void ConvolutionRistrettoLayer<Dtype>::Backward_gpu(
       const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
       const vector<Blob<Dtype>*>& bottom) {
+  // The solver updates the weights after the backward pass
+  RistrettoWeightsChanged();
   const Dtype* weight = this->weights_quantized_[0]->gpu_data();
   Dtype* weight_diff = this->blobs_[0]->mutable_gpu_diff();
   for (int i = 0; i < top.size(); ++i) {
+    if (fused_relu_) {
+      const int count = top[i]->count();
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      FusedReLUBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
+          CAFFE_CUDA_NUM_THREADS>>>(count, top[i]->gpu_data(),
+          top[i]->mutable_gpu_diff());
+      CUDA_POST_KERNEL_CHECK;
+    }
     const Dtype* top_diff = top[i]->gpu_diff();
     // Bias gradient, if necessary.
     if (this->bias_term_ && this->param_propagate_down_[1]) {
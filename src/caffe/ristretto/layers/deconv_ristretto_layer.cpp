@@ -1,14 +1,18 @@
+#include <algorithm>
 #include <vector>
 
 #include "ristretto/base_ristretto_layer.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/util/bitplane.hpp"
+#include "caffe/util/implicit_gemm.hpp"
+#include "caffe/util/math_functions.hpp"
 
 namespace caffe {
 
 template <typename Dtype>
 DeconvolutionRistrettoLayer<Dtype>::DeconvolutionRistrettoLayer(
       const LayerParameter& param) : DeconvolutionLayer<Dtype>(param),
-      BaseRistrettoLayer<Dtype>() {
+      BaseRistrettoLayer<Dtype>(param) {
   this->precision_ = this->layer_param_.quantization_param().precision();
   this->rounding_ = this->layer_param_.quantization_param().rounding_scheme();
   switch (this->precision_) {
@@ -36,11 +40,15 @@ DeconvolutionRistrettoLayer<Dtype>::DeconvolutionRistrettoLayer(
     LOG(FATAL) << "Unknown precision mode: " << this->precision_;
     break;
   }
+  fused_relu_ = this->layer_param_.quantization_param().fused_relu();
 }
 
 template <typename Dtype>
 void DeconvolutionRistrettoLayer<Dtype>::LayerSetUp(
       const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  CHECK(this->fl_params_channel_.empty() &&
+      this->fl_layer_out_channel_.empty())
+      << "Deconvolution has one format for all channels.";
   // Configure the kernel size, padding, stride, and inputs.
   ConvolutionParameter conv_param = this->layer_param_.convolution_param();
   this->force_nd_im2col_ = conv_param.force_nd_im2col();
@@ -217,55 +225,264 @@ void DeconvolutionRistrettoLayer<Dtype>::LayerSetUp(
   if (this->bias_term_) {
       this->weights_quantized_[1].reset(new Blob<Dtype>(bias_shape));
   }
+  // Binary inputs are convolved with additions only
+  this->binary_input_ = this->precision_ ==
+      QuantizationParameter_Precision_DYNAMIC_FIXED_POINT &&
+      this->bw_layer_in_ == 2 && this->fl_layer_in_ == 0 &&
+      this->group_ == 1 && this->num_spatial_axes_ == 2;
+  // Without dilation, every output phase of the stride is a dense
+  // convolution of the input with every stride-th kernel tap
+  subpixel_ = this->group_ == 1 && this->num_spatial_axes_ == 2 &&
+      dilation_data[0] == 1 && dilation_data[1] == 1;
 }
 
 template <typename Dtype>
 void DeconvolutionRistrettoLayer<Dtype>::Forward_cpu(
       const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  // Trim layer input
-  //if (this->phase_ == TEST) {
-    for (int i = 0; i < bottom.size(); ++i) {
-      this->QuantizeLayerInputs_cpu(bottom[i]->mutable_cpu_data(),
-          bottom[i]->count());
+  // Copy weights, trimmed with trim_weights
+  const bool weights_changed = this->UpdateWeightsQuantized_cpu(this->blobs_,
+      this->phase_, this->bias_term_);
+  const Dtype* weight = this->weights_quantized_[0]->cpu_data();
+  if (binary_input_ && weights_changed) {
+    // (in, out, kernel) -> (in, kernel, out)
+    const int channels = this->conv_out_channels_;
+    const int num_output = this->conv_in_channels_;
+    const int kernel = this->kernel_dim_ / num_output;
+    binary_weights_.resize(channels * num_output * kernel);
+    for (int c = 0; c < channels; ++c) {
+      for (int o = 0; o < num_output; ++o) {
+        for (int k = 0; k < kernel; ++k) {
+          binary_weights_[(c * kernel + k) * num_output + o] =
+              weight[(c * num_output + o) * kernel + k];
+        }
+      }
     }
-  //}
-  // Trim weights
-  caffe_copy(this->blobs_[0]->count(), this->blobs_[0]->cpu_data(),
-      this->weights_quantized_[0]->mutable_cpu_data());
-  if (this->bias_term_) {
-    caffe_copy(this->blobs_[1]->count(), this->blobs_[1]->cpu_data(),
-        this->weights_quantized_[1]->mutable_cpu_data());
   }
-  /*int rounding = this->phase_ == TEST ? this->rounding_ :
-      QuantizationParameter_Rounding_STOCHASTIC;
-  this->QuantizeWeights_cpu(this->weights_quantized_, rounding,
-      this->bias_term_);*/
-  const Dtype* weight = this->weights_quantized_[0]->cpu_data();
+  if (subpixel_ && weights_changed) {
+    // per phase (rh, rw) the weights (out, in, taps_h, taps_w) of the taps
+    // rh + j * stride_h, rw + l * stride_w, packed one after the other
+    const int* kernel_shape = this->kernel_shape_.cpu_data();
+    const int* stride = this->stride_.cpu_data();
+    const int channels = this->conv_out_channels_;
+    const int num_output = this->conv_in_channels_;
+    subpixel_weights_.clear();
+    vector<Dtype> phase;
+    for (int rh = 0; rh < stride[0]; ++rh) {
+      for (int rw = 0; rw < stride[1]; ++rw) {
+        phase.clear();
+        for (int o = 0; o < num_output; ++o) {
+          for (int c = 0; c < channels; ++c) {
+            for (int kh = rh; kh < kernel_shape[0]; kh += stride[0]) {
+              for (int kw = rw; kw < kernel_shape[1]; kw += stride[1]) {
+                phase.push_back(weight[((c * num_output + o) *
+                    kernel_shape[0] + kh) * kernel_shape[1] + kw]);
+              }
+            }
+          }
+        }
+        const int depth = phase.size() / num_output;
+        const int offset = subpixel_weights_.size();
+        if (depth > 0) {
+          subpixel_weights_.resize(offset +
+              gemm_packed_size(num_output, depth));
+          gemm_pack_weights_cpu(&phase[0], num_output, depth, false,
+              &subpixel_weights_[offset]);
+        }
+      }
+    }
+  }
+  // The GEMM of the forward multiplies the transposed weights of each group,
+  // packed as (kernel_dim, output channels of the group) blocks where
+  // packed_gemm_cpu beats the BLAS
+  const bool packed = !subpixel_ && packed_gemm_preferred<Dtype>(
+      this->conv_out_channels_ / this->group_, this->conv_out_spatial_dim_);
+  if (packed && (weights_changed || packed_weights_.empty())) {
+    const int channels = this->conv_out_channels_ / this->group_;
+    const int size = gemm_packed_size(this->kernel_dim_, channels);
+    packed_weights_.resize(this->group_ * size);
+    for (int g = 0; g < this->group_; ++g) {
+      gemm_pack_weights_cpu(weight + g * this->weight_offset_,
+          this->kernel_dim_, channels, true, &packed_weights_[g * size]);
+    }
+  }
+  // Bias, ReLU and output trimming of each image in one pass, unless the
+  // whole top is rounded stochastically
+  const bool epilogue = this->fixed_point_activations() &&
+      this->rounding_ != QuantizationParameter_Rounding_STOCHASTIC;
+  const Dtype* bias = this->bias_term_ ?
+      this->weights_quantized_[1]->cpu_data() : NULL;
+  // Images run in parallel unless the binary path with buffers of the
+  // layer is taken
+  const int slots = binary_input_ ? 1 : this->ImageSlots(this->num_);
+  const bool use_col = !subpixel_ && !this->is_1x1_;
+  this->image_input_.resize(slots);
+  this->image_col_.resize(slots);
+  this->input_rng_counter_.resize(bottom.size());
   for (int i = 0; i < bottom.size(); ++i) {
+    this->input_rng_counter_[i] = this->rng_counter_;
     const Dtype* bottom_data = bottom[i]->cpu_data();
     Dtype* top_data = top[i]->mutable_cpu_data();
-    for (int n = 0; n < this->num_; ++n) {
-      this->backward_cpu_gemm(bottom_data + n * this->bottom_dim_, weight,
-          top_data + n * this->top_dim_);
-      if (this->bias_term_) {
-        const Dtype* bias = this->weights_quantized_[1]->cpu_data();
-        this->forward_cpu_bias(top_data + n * this->top_dim_, bias);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(slots) schedule(static, 1) if (slots > 1)
+#endif
+    for (int s = 0; s < slots; ++s) {
+      // Trim layer input into a copy, the bottom is left as it is
+      vector<Dtype>& input = this->image_input_[s];
+      input.resize(this->bottom_dim_);
+      this->image_col_[s].resize(use_col ? this->col_buffer_.count() : 0);
+      const int n_end = (s + 1) * this->num_ / slots;
+      for (int n = s * this->num_ / slots; n < n_end; ++n) {
+        this->QuantizeLayerInputs_cpu(bottom_data + n * this->bottom_dim_,
+            this->bottom_dim_, &input[0]);
+        Dtype* output = top_data + n * this->top_dim_;
+        if (!binary_input_ || !forward_cpu_binary(&input[0], output)) {
+          if (subpixel_) {
+            forward_cpu_subpixel(&input[0], output);
+          } else {
+            backward_cpu_gemm_col(&input[0], weight,
+                use_col ? &this->image_col_[s][0] : NULL, output);
+          }
+        }
+        if (epilogue) {
+          this->QuantizeLayerOutputs_cpu(output, this->num_output_,
+              this->out_spatial_dim_, bias, fused_relu_);
+        } else if (this->bias_term_) {
+          this->forward_cpu_bias(output, bias);
+        }
       }
     }
     // Trim layer output
     //if (this->phase_ == TEST) {
+    if (!epilogue) {
       this->QuantizeLayerOutputs_cpu(top_data, top[i]->count());
+      if (fused_relu_) {
+        for (int j = 0; j < top[i]->count(); ++j) {
+          top_data[j] = std::max(top_data[j], Dtype(0));
+        }
+      }
+    }
     //}
   }
 }
 
+template <typename Dtype>
+bool DeconvolutionRistrettoLayer<Dtype>::forward_cpu_binary(
+      const Dtype* input, Dtype* output) {
+  const int channels = this->conv_out_channels_;
+  const int height = this->input_shape(1);
+  const int width = this->input_shape(2);
+  const int words = bitplane_words(channels);
+  binary_bits_.resize(height * width * words);
+  if (!bitplane_pack_channels_cpu(input, channels, height * width,
+      &binary_bits_[0])) {
+    return false;
+  }
+  const int* kernel_shape = this->kernel_shape_.cpu_data();
+  const int* stride = this->stride_.cpu_data();
+  const int* pad = this->pad_.cpu_data();
+  const int* dilation = this->dilation_.cpu_data();
+  const int kernel = kernel_shape[0] * kernel_shape[1];
+  const int num_output = this->conv_in_channels_;
+  const int out_h = this->output_shape_[0];
+  const int out_w = this->output_shape_[1];
+  binary_output_.assign(out_h * out_w * num_output, Dtype(0));
+  for (int ih = 0; ih < height; ++ih) {
+    for (int iw = 0; iw < width; ++iw) {
+      const uint64_t* bits = &binary_bits_[(ih * width + iw) * words];
+      for (int kh = 0; kh < kernel_shape[0]; ++kh) {
+        const int oh = ih * stride[0] - pad[0] + kh * dilation[0];
+        if (oh < 0 || oh >= out_h) {
+          continue;
+        }
+        for (int kw = 0; kw < kernel_shape[1]; ++kw) {
+          const int ow = iw * stride[1] - pad[1] + kw * dilation[1];
+          if (ow < 0 || ow >= out_w) {
+            continue;
+          }
+          // scatter the weight column of every set input channel
+          Dtype* acc = &binary_output_[(oh * out_w + ow) * num_output];
+          const int k = kh * kernel_shape[1] + kw;
+          for (int w = 0; w < words; ++w) {
+            for (uint64_t word = bits[w]; word; word &= word - 1) {
+              const int c = w * 64 + bitplane_lowest_bit(word);
+              const Dtype* column = &binary_weights_[(c * kernel + k) *
+                  num_output];
+              for (int o = 0; o < num_output; ++o) {
+                acc[o] += column[o];
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  // (pixels, out) -> (out, pixels)
+  const int out_spatial = out_h * out_w;
+  for (int q = 0; q < out_spatial; ++q) {
+    for (int o = 0; o < num_output; ++o) {
+      output[o * out_spatial + q] = binary_output_[q * num_output + o];
+    }
+  }
+  return true;
+}
+
+template <typename Dtype>
+void DeconvolutionRistrettoLayer<Dtype>::forward_cpu_subpixel(
+      const Dtype* input, Dtype* output) {
+  const int channels = this->conv_out_channels_;
+  const int height = this->input_shape(1);
+  const int width = this->input_shape(2);
+  const int* kernel_shape = this->kernel_shape_.cpu_data();
+  const int* stride = this->stride_.cpu_data();
+  const int* pad = this->pad_.cpu_data();
+  const int num_output = this->conv_in_channels_;
+  const int out_h = this->output_shape_[0];
+  const int out_w = this->output_shape_[1];
+  const Dtype* weights = &subpixel_weights_[0];
+  for (int rh = 0; rh < stride[0]; ++rh) {
+    for (int rw = 0; rw < stride[1]; ++rw) {
+      const int taps_h = (kernel_shape[0] - rh + stride[0] - 1) / stride[0];
+      const int taps_w = (kernel_shape[1] - rw + stride[1] - 1) / stride[1];
+      const int depth = channels * taps_h * taps_w;
+      // the outputs oh0 + i * stride_h, ow0 + j * stride_w of the phase take
+      // the inputs q0 + i - jh, p0 + j - jw
+      const int oh0 = ((rh - pad[0]) % stride[0] + stride[0]) % stride[0];
+      const int ow0 = ((rw - pad[1]) % stride[1] + stride[1]) % stride[1];
+      const int rows = std::max(out_h - oh0 + stride[0] - 1, 0) / stride[0];
+      const int cols = std::max(out_w - ow0 + stride[1] - 1, 0) / stride[1];
+      const int q0 = (oh0 + pad[0] - rh) / stride[0];
+      const int p0 = (ow0 + pad[1] - rw) / stride[1];
+      // as a convolution with the taps flipped: stride 1, dilation -1
+      const int taps[2] = {taps_h, taps_w};
+      const int shift[2] = {-q0, -p0};
+      const int step[2] = {1, 1};
+      const int flip[2] = {-1, -1};
+      implicit_gemm_conv_cpu(weights, num_output, input, channels, height,
+          width, taps, shift, step, flip, rows, cols,
+          output + oh0 * out_w + ow0, out_h * out_w, stride[0] * out_w,
+          stride[1]);
+      weights += gemm_packed_size(num_output, depth);
+    }
+  }
+}
+
 template <typename Dtype>
 void DeconvolutionRistrettoLayer<Dtype>::Backward_cpu(
       const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
       const vector<Blob<Dtype>*>& bottom) {
+  // The solver updates the weights after the backward pass
+  RistrettoWeightsChanged();
   const Dtype* weight = this->weights_quantized_[0]->cpu_data();
   Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
   for (int i = 0; i < top.size(); ++i) {
+    if (fused_relu_) {
+      // backward of the ReLU, in place like the folded layer
+      const Dtype* top_data = top[i]->cpu_data();
+      Dtype* diff = top[i]->mutable_cpu_diff();
+      for (int j = 0; j < top[i]->count(); ++j) {
+        diff[j] *= top_data[j] > 0;
+      }
+    }
     const Dtype* top_diff = top[i]->cpu_diff();
     const Dtype* bottom_data = bottom[i]->cpu_data();
     Dtype* bottom_diff = bottom[i]->mutable_cpu_diff();
@@ -277,24 +494,124 @@ void DeconvolutionRistrettoLayer<Dtype>::Backward_cpu(
       }
     }
     if (this->param_propagate_down_[0] || propagate_down[i]) {
-      for (int n = 0; n < this->num_; ++n) {
-        // Gradient w.r.t. weight. Note that we will accumulate diffs.
-        if (this->param_propagate_down_[0]) {
-          this->weight_cpu_gemm(top_diff + n * this->top_dim_,
-              bottom_data + n * this->bottom_dim_, weight_diff);
+      // Images in parallel; each slot adds its images' weight gradients
+      // up in its own buffer, and the slots are added in order
+      const int slots = this->ImageSlots(this->num_);
+      this->image_input_.resize(slots);
+      this->image_col_.resize(slots);
+      this->image_weight_diff_.resize(slots > 1 ? slots : 0);
+      // Stochastic rounding replays the counters of the forward pass, which
+      // trimmed the images in the same order
+      const uint64_t rng_counter = this->rng_counter_;
+      this->rng_counter_ = this->input_rng_counter_[i];
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(slots) schedule(static, 1) if (slots > 1)
+#endif
+      for (int s = 0; s < slots; ++s) {
+        vector<Dtype>& quantized = this->image_input_[s];
+        quantized.resize(this->bottom_dim_);
+        this->image_col_[s].resize(this->is_1x1_ ? 0 :
+            this->col_buffer_.count());
+        Dtype* col = this->is_1x1_ ? NULL : &this->image_col_[s][0];
+        Dtype* slot_weight_diff = weight_diff;
+        if (slots > 1 && this->param_propagate_down_[0]) {
+          this->image_weight_diff_[s].assign(this->blobs_[0]->count(),
+              Dtype(0));
+          slot_weight_diff = &this->image_weight_diff_[s][0];
+        }
+        const int n_end = (s + 1) * this->num_ / slots;
+        for (int n = s * this->num_ / slots; n < n_end; ++n) {
+          // Gradient w.r.t. weight. Note that we will accumulate diffs.
+          if (this->param_propagate_down_[0]) {
+            // with the input trimmed as in the forward pass
+            this->QuantizeLayerInputs_cpu(bottom_data + n * this->bottom_dim_,
+                this->bottom_dim_, &quantized[0]);
+            weight_cpu_gemm_col(top_diff + n * this->top_dim_, &quantized[0],
+                col, slot_weight_diff);
+          }
+          // Gradient w.r.t. bottom data, if necessary, reusing the column
+          // buffer we might have just computed above.
+          if (propagate_down[i]) {
+            forward_cpu_gemm_col(top_diff + n * this->top_dim_, weight, col,
+                bottom_diff + n * this->bottom_dim_,
+                this->param_propagate_down_[0]);
+          }
         }
-        // Gradient w.r.t. bottom data, if necessary, reusing the column buffer
-        // we might have just computed above.
-        if (propagate_down[i]) {
-          this->forward_cpu_gemm(top_diff + n * this->top_dim_, weight,
-              bottom_diff + n * this->bottom_dim_,
-              this->param_propagate_down_[0]);
+      }
+      this->rng_counter_ = rng_counter;
+      if (slots > 1 && this->param_propagate_down_[0]) {
+        for (int s = 0; s < slots; ++s) {
+          caffe_axpy<Dtype>(this->blobs_[0]->count(), (Dtype)1.,
+              &this->image_weight_diff_[s][0], weight_diff);
         }
       }
     }
   }
 }
 
+template <typename Dtype>
+void DeconvolutionRistrettoLayer<Dtype>::forward_cpu_gemm_col(
+      const Dtype* input, const Dtype* weights, Dtype* col, Dtype* output,
+      const bool skip_im2col) {
+  const Dtype* col_buff = input;
+  if (!this->is_1x1_) {
+    if (!skip_im2col) {
+      this->conv_im2col_cpu(input, col);
+    }
+    col_buff = col;
+  }
+  for (int g = 0; g < this->group_; ++g) {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans,
+        this->conv_out_channels_ / this->group_, this->conv_out_spatial_dim_,
+        this->kernel_dim_, (Dtype)1., weights + this->weight_offset_ * g,
+        col_buff + this->col_offset_ * g, (Dtype)0.,
+        output + this->output_offset_ * g);
+  }
+}
+
+template <typename Dtype>
+void DeconvolutionRistrettoLayer<Dtype>::weight_cpu_gemm_col(
+      const Dtype* input, const Dtype* output, Dtype* col, Dtype* weights) {
+  const Dtype* col_buff = input;
+  if (!this->is_1x1_) {
+    this->conv_im2col_cpu(input, col);
+    col_buff = col;
+  }
+  for (int g = 0; g < this->group_; ++g) {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans,
+        this->conv_out_channels_ / this->group_, this->kernel_dim_,
+        this->conv_out_spatial_dim_, (Dtype)1.,
+        output + this->output_offset_ * g, col_buff + this->col_offset_ * g,
+        (Dtype)1., weights + this->weight_offset_ * g);
+  }
+}
+
+template <typename Dtype>
+void DeconvolutionRistrettoLayer<Dtype>::backward_cpu_gemm_col(
+      const Dtype* output, const Dtype* weights, Dtype* col, Dtype* input) {
+  Dtype* col_buff = this->is_1x1_ ? input : col;
+  const int channels = this->conv_out_channels_ / this->group_;
+  const int size = gemm_packed_size(this->kernel_dim_, channels);
+  const bool packed = packed_gemm_preferred<Dtype>(channels,
+      this->conv_out_spatial_dim_);
+  for (int g = 0; g < this->group_; ++g) {
+    if (packed) {
+      packed_gemm_cpu(&packed_weights_[g * size], this->kernel_dim_,
+          channels, output + this->output_offset_ * g,
+          this->conv_out_spatial_dim_, col_buff + this->col_offset_ * g);
+    } else {
+      caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, this->kernel_dim_,
+          this->conv_out_spatial_dim_, channels, (Dtype)1.,
+          weights + this->weight_offset_ * g,
+          output + this->output_offset_ * g, (Dtype)0.,
+          col_buff + this->col_offset_ * g);
+    }
+  }
+  if (!this->is_1x1_) {
+    this->conv_col2im_cpu(col_buff, input);
+  }
+}
+
 #ifdef CPU_ONLY
 STUB_GPU(DeconvolutionRistrettoLayer);
 #endif
@@ -1,15 +1,86 @@
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <vector>
 
 #include "caffe/filler.hpp"
 #include "caffe/layers/inner_product_layer.hpp"
+#include "caffe/util/implicit_gemm.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "ristretto/base_ristretto_layer.hpp"
 
 namespace caffe {
 
+// Up to this many samples are one GEMV each, more are one GEMM
+static const int kPackedGemvRows = 4;
+// Weight rows of the integer GEMV per block, one per int32 lane
+static const int kIntegerGemvRows = 8;
+
+#if defined(__AVX2__)
+// acc + the sums of the pair products of the int16 in w and x
+static inline __m256i integer_madd(const __m256i acc, const __m256i w,
+    const __m256i x) {
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+  return _mm256_dpwssd_epi32(acc, w, x);
+#elif defined(__AVXVNNI__)
+  return _mm256_dpwssd_avx_epi32(acc, w, x);
+#else
+  return _mm256_add_epi32(acc, _mm256_madd_epi16(w, x));
+#endif
+}
+#endif
+
+// sums (rows) = weights (rows / 8, pairs, 8, 2) x x (pairs, 2), the int8
+// weights of a block sign-extended to int16 and multiplied with a pair of x
+// per instruction.
+static void integer_gemv(const int8_t* weights, const int rows,
+    const int pairs, const int16_t* x, int32_t* sums) {
+  const int blocks = (rows + kIntegerGemvRows - 1) / kIntegerGemvRows;
+#ifdef _OPENMP
+#pragma omp parallel for if (static_cast<int64_t>(rows) * pairs >= 32768)
+#endif
+  for (int b = 0; b < blocks; ++b) {
+    // one pair of inputs for the 8 rows of the block
+    const int step = kIntegerGemvRows * 2;
+    const int8_t* w = weights + b * pairs * step;
+    int32_t acc[kIntegerGemvRows];
+#if defined(__AVX2__)
+    // two accumulators hide the latency of the multiply-adds
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    for (int p = 0; p < pairs; ++p) {
+      int32_t xp;
+      memcpy(&xp, x + 2 * p, sizeof(xp));
+      const __m256i wp = _mm256_cvtepi8_epi16(_mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(w + p * step)));
+      if (p % 2) {
+        acc1 = integer_madd(acc1, wp, _mm256_set1_epi32(xp));
+      } else {
+        acc0 = integer_madd(acc0, wp, _mm256_set1_epi32(xp));
+      }
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc),
+        _mm256_add_epi32(acc0, acc1));
+#else
+    std::fill(acc, acc + kIntegerGemvRows, 0);
+    for (int p = 0; p < pairs; ++p) {
+      const int8_t* wp = w + p * step;
+      for (int r = 0; r < kIntegerGemvRows; ++r) {
+        acc[r] += wp[2 * r] * x[2 * p] + wp[2 * r + 1] * x[2 * p + 1];
+      }
+    }
+#endif
+    const int r0 = b * kIntegerGemvRows;
+    std::copy(acc, acc + std::min(kIntegerGemvRows, rows - r0), sums + r0);
+  }
+}
+
 template <typename Dtype>
 FcRistrettoLayer<Dtype>::FcRistrettoLayer(const LayerParameter& param)
-      : InnerProductLayer<Dtype>(param), BaseRistrettoLayer<Dtype>() {
+      : InnerProductLayer<Dtype>(param), BaseRistrettoLayer<Dtype>(param) {
   this->precision_ = this->layer_param_.quantization_param().precision();
   this->rounding_ = this->layer_param_.quantization_param().rounding_scheme();
   switch (this->precision_) {
@@ -91,38 +162,102 @@ void FcRistrettoLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   weight_shape[0] = this->N_;
   weight_shape[1] = this->K_;
   this->weights_quantized_[0].reset(new Blob<Dtype>(weight_shape));
+  CHECK(this->fl_params_channel_.empty() ||
+      (this->fl_params_channel_.size() == this->N_ && !this->transpose_))
+      << "fl_params_channel needs one value per output and no transpose.";
+  CHECK(this->fl_layer_out_channel_.empty() ||
+      this->fl_layer_out_channel_.size() == this->N_)
+      << "fl_layer_out_channel needs one value per output.";
   vector<int> bias_shape(1, this->N_);
   if (this->bias_term_) {
       this->weights_quantized_[1].reset(new Blob<Dtype>(bias_shape));
   }
+  // Power-of-two weights are shifts of the integer inputs
+  QuantizationParameter_Engine engine =
+      this->layer_param_.quantization_param().engine();
+  if (engine == QuantizationParameter_Engine_DEFAULT) {
+    engine = RistrettoEngine();
+  }
+  shift_add_ = engine == QuantizationParameter_Engine_INTEGER &&
+      this->precision_ ==
+      QuantizationParameter_Precision_INTEGER_POWER_OF_2_WEIGHTS &&
+      !this->transpose_ && this->ShiftAddFits(this->K_);
+  // Dynamic fixed point with int8 weights runs single samples as an integer
+  // GEMV with int32 sums that cannot overflow and are exact in Dtype
+  integer_gemv_ = false;
+  integer_sum_bits_ = 0;
+  if (engine == QuantizationParameter_Engine_INTEGER &&
+      this->precision_ == QuantizationParameter_Precision_DYNAMIC_FIXED_POINT) {
+    integer_sum_bits_ = this->bw_layer_in_ + this->bw_params_ - 2;
+    for (int k = 1; k < this->K_; k *= 2) {
+      ++integer_sum_bits_;
+    }
+    integer_gemv_ = this->bw_layer_in_ <= 16 && this->bw_params_ <= 8 &&
+        this->bw_layer_out_ <= 16 &&
+        integer_sum_bits_ <= this->IntegerSumBits();
+    for (int n = 0; n < this->N_; ++n) {
+      const int shift = this->fl_layer_in_ + this->fl_params(n) -
+          this->fl_layer_out(n);
+      integer_gemv_ &= shift >= -30 && shift <= 62;
+    }
+  }
+  if (engine == QuantizationParameter_Engine_INTEGER && !shift_add_ &&
+      !integer_gemv_) {
+    LOG(INFO) << this->layer_param_.name() << " falls back to the float "
+        << "emulation: the integer engine needs power-of-two weights of up "
+        << "to 8 exponents and no transpose, or dynamic fixed point with "
+        << "weights of up to 8 bits and activations of up to 16 bits.";
+  }
 }
 
 template <typename Dtype>
 void FcRistrettoLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
-  // Trim layer input
-  //if (this->phase_ == TEST) {
-      this->QuantizeLayerInputs_cpu(bottom[0]->mutable_cpu_data(),
-          bottom[0]->count());
-  //}
-  // Trim weights
-  caffe_copy(this->blobs_[0]->count(), this->blobs_[0]->cpu_data(),
-      this->weights_quantized_[0]->mutable_cpu_data());
-  if (this->bias_term_) {
-    caffe_copy(this->blobs_[1]->count(), this->blobs_[1]->cpu_data(),
-        this->weights_quantized_[1]->mutable_cpu_data());
-  }
-  /*int rounding = this->phase_ == TEST ? this->rounding_ :
-      QuantizationParameter_Rounding_STOCHASTIC;
-  this->QuantizeWeights_cpu(this->weights_quantized_, rounding,
-      this->bias_term_);*/
+  // Trim layer input into a copy, the bottom is left as it is
+  this->quantized_input_.resize(bottom[0]->count());
+  this->QuantizeLayerInputs_cpu(bottom[0]->cpu_data(), bottom[0]->count(),
+      &this->quantized_input_[0]);
+  // Copy weights, trimmed with trim_weights
+  const bool weights_changed = this->UpdateWeightsQuantized_cpu(this->blobs_,
+      this->phase_, this->bias_term_);
   // Do forward propagation
-  const Dtype* bottom_data = bottom[0]->cpu_data();
+  const Dtype* bottom_data = &this->quantized_input_[0];
   Dtype* top_data = top[0]->mutable_cpu_data();
   const Dtype* weight = this->weights_quantized_[0]->cpu_data();
-  caffe_cpu_gemm<Dtype>(CblasNoTrans, this->transpose_ ? CblasNoTrans :
-      CblasTrans, this->M_, this->N_, this->K_, (Dtype)1., bottom_data, weight,
-      (Dtype)0., top_data);
+  if (shift_add_) {
+    if (weights_changed) {
+      this->PackPowerOf2Weights_cpu(weight, this->N_, this->K_,
+          &shift_add_weights_);
+    }
+    forward_cpu_shift_add(bottom_data, top_data);
+  } else {
+    // A GEMV per sample for a few samples, else a GEMM, on the packed
+    // weights where the packed kernels beat the BLAS
+    const bool packed = this->M_ <= kPackedGemvRows ?
+        packed_gemv_preferred<Dtype>() :
+        packed_gemm_preferred<Dtype>(this->K_, this->M_);
+    if (packed && (weights_changed || packed_weights_.empty())) {
+      packed_weights_.resize(gemm_packed_size(this->N_, this->K_));
+      gemm_pack_weights_cpu(weight, this->N_, this->K_, this->transpose_,
+          &packed_weights_[0]);
+    }
+    if (integer_gemv_ && weights_changed) {
+      PackIntegerWeights_cpu(weight);
+    }
+    if (integer_gemv_ && this->M_ == 1) {
+      forward_cpu_integer(bottom_data, top_data);
+      if (!integer_bias_.empty()) {
+        // biased and trimmed with the sums
+        return;
+      }
+    } else if (packed) {
+      forward_cpu_packed(bottom_data, top_data);
+    } else {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, this->transpose_ ? CblasNoTrans :
+          CblasTrans, this->M_, this->N_, this->K_, (Dtype)1., bottom_data,
+          weight, (Dtype)0., top_data);
+    }
+  }
   if (this->bias_term_) {
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, this->M_, this->N_, 1,
         (Dtype)1., this->bias_multiplier_.cpu_data(),
@@ -130,16 +265,152 @@ void FcRistrettoLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   }
   // Trim layer output
   //if (this->phase_ == TEST) {
-    this->QuantizeLayerOutputs_cpu(top_data, top[0]->count());
+    this->QuantizeLayerOutputs_cpu(top_data, this->M_, this->N_, 1);
   //}
 }
 
+template <typename Dtype>
+void FcRistrettoLayer<Dtype>::PackIntegerWeights_cpu(const Dtype* weight) {
+  const int N = this->N_;
+  const int K = this->K_;
+  const int pairs = (K + 1) / 2;
+  const int blocks = (N + kIntegerGemvRows - 1) / kIntegerGemvRows;
+  const Dtype max_weight = (1 << (this->bw_params_ - 1)) - 1;
+  integer_weights_.assign(blocks * pairs * kIntegerGemvRows * 2, 0);
+  for (int n = 0; n < N; ++n) {
+    const Dtype weight_scale = std::pow(Dtype(2), this->fl_params(n));
+    int8_t* w = &integer_weights_[(n / kIntegerGemvRows * pairs *
+        kIntegerGemvRows + n % kIntegerGemvRows) * 2];
+    for (int k = 0; k < K; ++k) {
+      const Dtype v = round((this->transpose_ ? weight[k * N + n] :
+          weight[n * K + k]) * weight_scale);
+      w[(k / 2 * kIntegerGemvRows) * 2 + k % 2] = static_cast<int8_t>(
+          std::max(std::min(v, max_weight), -max_weight - 1));
+    }
+  }
+  // The bias is added to the sums if it is on their grid and no sum with it
+  // leaves the IntegerSumBits() the float emulation adds exactly
+  integer_bias_.clear();
+  if (this->rounding_ == QuantizationParameter_Rounding_NEAREST) {
+    const double max_bias = std::pow(2.0, this->IntegerSumBits()) -
+        std::pow(2.0, integer_sum_bits_);
+    integer_bias_.resize(N, 0);
+    for (int n = 0; this->bias_term_ && n < N; ++n) {
+      const double sum_scale =
+          std::pow(2.0, this->fl_layer_in_ + this->fl_params(n));
+      const double b = this->weights_quantized_[1]->cpu_data()[n] *
+          sum_scale;
+      if (b != std::floor(b) || std::fabs(b) > max_bias) {
+        integer_bias_.clear();
+        break;
+      }
+      integer_bias_[n] = static_cast<int64_t>(b);
+    }
+  }
+}
+
+template <typename Dtype>
+void FcRistrettoLayer<Dtype>::forward_cpu_integer(const Dtype* input,
+      Dtype* output) {
+  const int N = this->N_;
+  const int K = this->K_;
+  const int pairs = (K + 1) / 2;
+  // The trimmed input is exact at its fixed point scale
+  const Dtype input_scale = std::pow(Dtype(2), this->fl_layer_in_);
+  integer_input_.assign(pairs * 2, 0);
+  for (int k = 0; k < K; ++k) {
+    integer_input_[k] = static_cast<int16_t>(input[k] * input_scale);
+  }
+  integer_sums_.resize(N);
+  integer_gemv(&integer_weights_[0], N, pairs, &integer_input_[0],
+      &integer_sums_[0]);
+  if (integer_bias_.empty()) {
+    // float bias or stochastic rounding: the sums as floats, the bias is
+    // added and the output trimmed like in the emulation
+    for (int n = 0; n < N; ++n) {
+      output[n] = integer_sums_[n] *
+          std::pow(Dtype(2), -this->fl_layer_in_ - this->fl_params(n));
+    }
+    return;
+  }
+  // Requantize the sums to the layer output
+  const int64_t max_out = (1 << (this->bw_layer_out_ - 1)) - 1;
+  for (int n = 0; n < N; ++n) {
+    const int shift =
+        this->fl_layer_in_ + this->fl_params(n) - this->fl_layer_out(n);
+    const int64_t q = IntegerRequantize(integer_sums_[n] + integer_bias_[n],
+        shift);
+    output[n] = std::max(std::min(q, max_out), -max_out - 1) *
+        std::pow(Dtype(2), -this->fl_layer_out(n));
+  }
+}
+
+template <typename Dtype>
+void FcRistrettoLayer<Dtype>::forward_cpu_packed(const Dtype* input,
+      Dtype* output) {
+  const int M = this->M_;
+  const int N = this->N_;
+  const int K = this->K_;
+  if (M <= kPackedGemvRows) {
+    for (int m = 0; m < M; ++m) {
+      packed_gemv_cpu(&packed_weights_[0], N, K, input + m * K,
+          output + m * N);
+    }
+    return;
+  }
+  // (N, K) x (K, M) with the samples as columns
+  packed_col_.resize(K * M);
+  for (int m = 0; m < M; ++m) {
+    for (int k = 0; k < K; ++k) {
+      packed_col_[k * M + m] = input[m * K + k];
+    }
+  }
+  packed_output_.resize(N * M);
+  packed_gemm_cpu(&packed_weights_[0], N, K, &packed_col_[0], M,
+      &packed_output_[0]);
+  for (int m = 0; m < M; ++m) {
+    for (int n = 0; n < N; ++n) {
+      output[m * N + n] = packed_output_[n * M + m];
+    }
+  }
+}
+
+template <typename Dtype>
+void FcRistrettoLayer<Dtype>::forward_cpu_shift_add(const Dtype* input,
+      Dtype* output) {
+  const int M = this->M_;
+  const int N = this->N_;
+  const int K = this->K_;
+  // The trimmed input is exact at its fixed point scale
+  const Dtype input_scale = std::pow(Dtype(2), this->fl_layer_in_);
+  shift_add_col_.resize(K * M);
+  for (int m = 0; m < M; ++m) {
+    for (int k = 0; k < K; ++k) {
+      shift_add_col_[k * M + m] =
+          static_cast<int32_t>(input[m * K + k] * input_scale);
+    }
+  }
+  shift_add_sums_.resize(N * M);
+  ShiftAddGemm_cpu(&shift_add_weights_[0], N, K, &shift_add_col_[0], M,
+      &shift_add_sums_[0]);
+  const Dtype sum_step =
+      std::pow(Dtype(2), this->pow_2_min_exp_ - this->fl_layer_in_);
+  for (int m = 0; m < M; ++m) {
+    for (int n = 0; n < N; ++n) {
+      output[m * N + n] = shift_add_sums_[n * M + m] * sum_step;
+    }
+  }
+}
+
 template <typename Dtype>
 void FcRistrettoLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  // The solver updates the weights after the backward pass
+  RistrettoWeightsChanged();
   if (this->param_propagate_down_[0]) {
     const Dtype* top_diff = top[0]->cpu_diff();
-    const Dtype* bottom_data = bottom[0]->cpu_data();
+    // the trimmed input of the forward pass
+    const Dtype* bottom_data = &this->quantized_input_[0];
     // Gradient with respect to weight
     if (this->transpose_) {
       caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans,
@@ -10,22 +10,29 @@ namespace caffe {
 template <typename Dtype>
 void FcRistrettoLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  CHECK(this->fl_params_channel_.empty() &&
+      this->fl_layer_out_channel_.empty())
+      << "Formats per channel are trimmed on the CPU only.";
   // Trim layer input
   //if (this->phase_ == TEST) {
       this->QuantizeLayerInputs_gpu(bottom[0]->mutable_gpu_data(),
           bottom[0]->count());
   //}
-  // Trim weights
+  // Copy weights, trimmed with trim_weights
   caffe_copy(this->blobs_[0]->count(), this->blobs_[0]->gpu_data(),
       this->weights_quantized_[0]->mutable_gpu_data());
   if (this->bias_term_) {
     caffe_copy(this->blobs_[1]->count(), this->blobs_[1]->gpu_data(),
         this->weights_quantized_[1]->mutable_gpu_data());
   }
-  /*int rounding = this->phase_ == TEST ? this->rounding_ :
-      QuantizationParameter_Rounding_STOCHASTIC;
-  this->QuantizeWeights_gpu(this->weights_quantized_, rounding,
-      this->bias_term_);*/
+  if (this->trim_weights_) {
+    const int rounding = this->phase_ == TEST ? this->rounding_ :
+        QuantizationParameter_Rounding_STOCHASTIC;
+    this->QuantizeWeights_gpu(this->weights_quantized_, rounding,
+        this->bias_term_);
+  }
+  // the CPU passes copy the weights again
+  this->weights_source_.clear();
   // Do forward propagation
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = top[0]->mutable_gpu_data();
@@ -56,6 +63,8 @@ void FcRistrettoLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void FcRistrettoLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  // The solver updates the weights after the backward pass
+  RistrettoWeightsChanged();
   if (this->param_propagate_down_[0]) {
     const Dtype* top_diff = top[0]->gpu_diff();
     const Dtype* bottom_data = bottom[0]->gpu_data();
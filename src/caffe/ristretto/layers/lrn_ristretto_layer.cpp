@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <vector>
 
 #include "caffe/layers/lrn_layer.hpp"
@@ -8,7 +9,7 @@ namespace caffe {
 
 template <typename Dtype>
 LRNRistrettoLayer<Dtype>::LRNRistrettoLayer(const LayerParameter& param)
-      : LRNLayer<Dtype>(param), BaseRistrettoLayer<Dtype>() {
+      : LRNLayer<Dtype>(param), BaseRistrettoLayer<Dtype>(param) {
   this->precision_ = this->layer_param_.quantization_param().precision();
   this->rounding_ = this->layer_param_.quantization_param().rounding_scheme();
   switch (this->precision_) {
@@ -31,15 +32,145 @@ LRNRistrettoLayer<Dtype>::LRNRistrettoLayer(const LayerParameter& param)
 template <typename Dtype>
 void LRNRistrettoLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-  //TODO
-  LOG(FATAL) << "LRNRistrettoLayer not implemented on CPU yet.";
+  switch (this->layer_param_.lrn_param().norm_region()) {
+  case LRNParameter_NormRegion_ACROSS_CHANNELS:
+    CrossChannelForward_cpu(bottom, top);
+    break;
+  case LRNParameter_NormRegion_WITHIN_CHANNEL:
+    WithinChannelForward(bottom, top);
+    break;
+  default:
+    LOG(FATAL) << "Unknown normalization region.";
+  }
+}
+
+// Trim to minifloat, rounding to nearest like toFP on the GPU
+template <typename Dtype>
+void LRNRistrettoLayer<Dtype>::Trim(const Dtype* data, const int cnt,
+      Dtype* trimmed) {
+  this->Trim2MiniFloat_cpu(data, cnt, this->fp_mant_, this->fp_exp_,
+      QuantizationParameter_Rounding_NEAREST, trimmed);
+}
+
+// Pixels of an image per task of the cross channel forward pass
+static const int kLRNBlockPixels = 1024;
+
+// Same as LRNFillScaleQ and LRNComputeOutputQ on the GPU, for blocks of
+// pixels side by side: the window sum of the trimmed squares slides over the
+// channels, adding the square entering the window and subtracting the one
+// leaving it, and every intermediate result is trimmed.
+template <typename Dtype>
+void LRNRistrettoLayer<Dtype>::CrossChannelForward_cpu(
+      const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
+  Dtype* scale_data = this->scale_.mutable_cpu_data();
+  const int channels = this->channels_;
+  const int dim = this->height_ * this->width_;
+  const int size = this->size_;
+  const int post_pad = size - this->pre_pad_ - 1;
+  const Dtype alpha_over_size = this->alpha_ / size;
+  const Dtype k = this->k_;
+  const int blocks = (dim + kLRNBlockPixels - 1) / kLRNBlockPixels;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int t = 0; t < this->num_ * blocks; ++t) {
+    const int p = t % blocks * kLRNBlockPixels;
+    const int len = std::min(kLRNBlockPixels, dim - p);
+    const int offset = t / blocks * channels * dim + p;
+    vector<Dtype> squares(channels * len);
+    vector<Dtype> accum(len, Dtype(0));
+    // the trimmed inputs into the top, and their trimmed squares
+    for (int c = 0; c < channels; ++c) {
+      Dtype* in = top_data + offset + c * dim;
+      Dtype* square = &squares[c * len];
+      Trim(bottom_data + offset + c * dim, len, in);
+      for (int i = 0; i < len; ++i) {
+        square[i] = in[i] * in[i];
+      }
+      Trim(square, len, square);
+    }
+    for (int head = 0; head < channels + post_pad; ++head) {
+      if (head < channels) {
+        const Dtype* square = &squares[head * len];
+        for (int i = 0; i < len; ++i) {
+          accum[i] += square[i];
+        }
+        Trim(&accum[0], len, &accum[0]);
+      }
+      if (head >= size) {
+        const Dtype* square = &squares[(head - size) * len];
+        for (int i = 0; i < len; ++i) {
+          accum[i] -= square[i];
+        }
+        Trim(&accum[0], len, &accum[0]);
+      }
+      if (head >= post_pad) {
+        Dtype* scale = scale_data + offset + (head - post_pad) * dim;
+        for (int i = 0; i < len; ++i) {
+          scale[i] = accum[i] * alpha_over_size;
+        }
+        Trim(scale, len, scale);
+        for (int i = 0; i < len; ++i) {
+          scale[i] += k;
+        }
+        Trim(scale, len, scale);
+      }
+    }
+    // top = input * scale^-beta
+    vector<Dtype>& power = accum;
+    for (int c = 0; c < channels; ++c) {
+      Dtype* out = top_data + offset + c * dim;
+      caffe_powx<Dtype>(len, scale_data + offset + c * dim, -this->beta_,
+          &power[0]);
+      Trim(&power[0], len, &power[0]);
+      for (int i = 0; i < len; ++i) {
+        out[i] *= power[i];
+      }
+      Trim(out, len, out);
+    }
+  }
+}
+
+// LRNLayer::WithinChannelForward with the input and the output of every
+// internal layer trimmed
+template <typename Dtype>
+void LRNRistrettoLayer<Dtype>::WithinChannelForward(
+      const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  quantized_bottom_.ReshapeLike(*bottom[0]);
+  Trim(bottom[0]->cpu_data(), bottom[0]->count(),
+      quantized_bottom_.mutable_cpu_data());
+  const vector<Blob<Dtype>*> quantized_bottom(1, &quantized_bottom_);
+  this->split_layer_->Forward(quantized_bottom, this->split_top_vec_);
+  this->square_layer_->Forward(this->square_bottom_vec_,
+      this->square_top_vec_);
+  Trim(this->square_output_.cpu_data(), this->square_output_.count(),
+      this->square_output_.mutable_cpu_data());
+  this->pool_layer_->Forward(this->square_top_vec_, this->pool_top_vec_);
+  Trim(this->pool_output_.cpu_data(), this->pool_output_.count(),
+      this->pool_output_.mutable_cpu_data());
+  this->power_layer_->Forward(this->pool_top_vec_, this->power_top_vec_);
+  Trim(this->power_output_.cpu_data(), this->power_output_.count(),
+      this->power_output_.mutable_cpu_data());
+  this->product_layer_->Forward(this->product_bottom_vec_, top);
+  Trim(top[0]->cpu_data(), top[0]->count(), top[0]->mutable_cpu_data());
 }
 
+// The gradients are those of the float layer, as on the GPU
 template <typename Dtype>
 void LRNRistrettoLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
-  //TODO
-  LOG(FATAL) << "LRNRistrettoLayer not implemented on CPU yet.";
+  switch (this->layer_param_.lrn_param().norm_region()) {
+  case LRNParameter_NormRegion_ACROSS_CHANNELS:
+    this->CrossChannelBackward_cpu(top, propagate_down, bottom);
+    break;
+  case LRNParameter_NormRegion_WITHIN_CHANNEL:
+    this->WithinChannelBackward(top, propagate_down, bottom);
+    break;
+  default:
+    LOG(FATAL) << "Unknown normalization region.";
+  }
 }
 
 #ifdef CPU_ONLY
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cmath>
+
 #include "boost/algorithm/string.hpp"
 
 #include "caffe/caffe.hpp"
@@ -22,6 +25,7 @@ Quantization::Quantization(string model, string weights, string model_quantized,
   this->bitwidth_weights_ = bitwidth_weights;
   this->bitwidth_activations_ = bitwidth_activations;
   this->gpus_ = gpus;
+  this->per_channel_ = false;
 
   // Could possibly improve choice of exponent. Experiments show LeNet needs
   // 4bits, but the saturation border is at 3bits (when assuming infinitely long
@@ -32,6 +36,9 @@ Quantization::Quantization(string model, string weights, string model_quantized,
 void Quantization::QuantizeNet() {
   CheckWritePermissions(model_quantized_);
   SetGpu();
+  per_channel_ = trimming_mode_ == "dynamic_fixed_point_per_channel";
+  CHECK(!per_channel_ || Caffe::mode() == Caffe::CPU)
+      << "Formats per channel are trimmed on the CPU only.";
   // Run the reference floating point network on validation set to find baseline
   // accuracy.
   Net<float>* net_val = new Net<float>(model_, caffe::TEST);
@@ -43,8 +50,12 @@ void Quantization::QuantizeNet() {
   test_score_baseline_ = accuracy;
   delete net_val;
   // Do network quantization and scoring.
-  if (trimming_mode_ == "dynamic_fixed_point") {
+  if (trimming_mode_ == "dynamic_fixed_point" || per_channel_) {
     Quantize2DynamicFixedPoint();
+  } else if (trimming_mode_ == "minifloat") {
+    Quantize2MiniFloat();
+  } else if (trimming_mode_ == "integer_power_of_2_weights") {
+    Quantize2IntegerPowerOf2Weights();
   } else {
     LOG(FATAL) << "Unknown trimming mode: " << trimming_mode_;
   }
@@ -110,6 +121,9 @@ void Quantization::RunForwardBatches(const int iterations,
     if(do_stats) {
       caffe_net->RangeInLayers(&layer_names_, &max_in_, &max_out_,
           &max_params_);
+      if (per_channel_) {
+        RangeInChannels(caffe_net);
+      }
     }
     // Keep track of network score over multiple batches.
     loss += iter_loss;
@@ -148,6 +162,40 @@ void Quantization::RunForwardBatches(const int iterations,
   *accuracy = test_score[score_number] / iterations;
 }
 
+// Running maxima of the absolute values in each channel of (num, channels,
+// dim) data.
+static void ChannelMax(const float* data, const int num, const int channels,
+      const int dim, vector<float>* max_data) {
+  max_data->resize(channels, 0);
+  for (int i = 0; i < num * channels; ++i) {
+    float& m = (*max_data)[i % channels];
+    for (int j = 0; j < dim; ++j) {
+      m = std::max(m, std::fabs(data[i * dim + j]));
+    }
+  }
+}
+
+void Quantization::RangeInChannels(Net<float>* caffe_net) {
+  for (int l = 0; l < caffe_net->layers().size(); ++l) {
+    const LayerParameter& layer_param = caffe_net->layers()[l]->layer_param();
+    if (layer_param.type() != "Convolution" &&
+        layer_param.type() != "InnerProduct") {
+      continue;
+    }
+    const string& name = caffe_net->layer_names()[l];
+    const Blob<float>* top = caffe_net->top_vecs()[l][0];
+    ChannelMax(top->cpu_data(), top->shape(0), top->shape(1), top->count(2),
+        &max_out_channel_[name]);
+    // the weights of an output channel are a row, unless transposed
+    if (layer_param.type() == "Convolution" ||
+        !layer_param.inner_product_param().transpose()) {
+      const Blob<float>* weights = caffe_net->layers()[l]->blobs()[0].get();
+      ChannelMax(weights->cpu_data(), 1, weights->shape(0), weights->count(1),
+          &max_params_channel_[name]);
+    }
+  }
+}
+
 void Quantization::Quantize2DynamicFixedPoint() {
   // Find the integer length for dynamic fixed point numbers.
   // The integer length is chosen such that no saturation occurs.
@@ -257,10 +305,94 @@ void Quantization::Quantize2DynamicFixedPoint() {
   LOG(INFO) << "Please fine-tune.";
 }
 
+void Quantization::Quantize2MiniFloat() {
+  // Find the necessary amount of exponent bits.
+  // The exponent bits are chosen such that no saturation occurs.
+  // This approximation assumes an infinitely long mantissa.
+  // Parameters are ignored, since they are normally smaller than layer
+  // activations.
+  for (int i = 0; i < layer_names_.size(); ++i) {
+    const float max_data = std::max(max_in_[i], max_out_[i]);
+    // values up to 4 fit the initial exponent bits
+    if (max_data > 4) {
+      exp_bits_ = std::max(exp_bits_, (int)ceil(log2(log2(max_data) - 1) + 1));
+    }
+  }
+  LOG(INFO) << "Minifloat exponent bits: " << exp_bits_;
+  // Parameters and layer activations share the bit-width of the activations.
+  const int bitwidth = this->bitwidth_activations_;
+  CHECK_GT(bitwidth - 1 - exp_bits_, 0) << "No mantissa bits left in "
+      << bitwidth << "-bit minifloat with " << exp_bits_ << " exponent bits.";
+  // Score the minifloat network.
+  NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(model_, &param);
+  param.mutable_state()->set_phase(caffe::TEST);
+  EditNetDescriptionMiniFloat(&param, bitwidth);
+  Net<float>* net_test = new Net<float>(param, NULL);
+  net_test->CopyTrainedLayersFrom(weights_);
+  float accuracy;
+  RunForwardBatches(iterations_, net_test, &accuracy);
+  delete net_test;
+  param.release_state();
+  WriteProtoToTextFile(param, model_quantized_);
+  // Write summary of minifloat analysis to log
+  LOG(INFO) << "------------------------------";
+  LOG(INFO) << "Network accuracy analysis for convolutional (CONV), fully connected (FC) and LRN layers.";
+  LOG(INFO) << "Baseline 32-bit float: " << test_score_baseline_;
+  LOG(INFO) << "Minifloat net:";
+  LOG(INFO) << bitwidth << "-bit, " << exp_bits_ << " exponent bits, "
+      << bitwidth - 1 - exp_bits_ << " mantissa bits:";
+  LOG(INFO) << "Accuracy: " << accuracy;
+  LOG(INFO) << "Please fine-tune.";
+}
+
+void Quantization::Quantize2IntegerPowerOf2Weights() {
+  // Find the integer length for dynamic fixed point layer activations.
+  for (int i = 0; i < layer_names_.size(); ++i) {
+    il_in_.push_back((int)ceil(log2(max_in_[i]+1e-8+1)));
+    il_out_.push_back((int)ceil(log2(max_out_[i]+1e-8+1)));
+  }
+  // Score net with integer-power-of-two weights and dynamic fixed point
+  // activations.
+  NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(model_, &param);
+  param.mutable_state()->set_phase(caffe::TEST);
+  EditNetDescriptionIntegerPowerOf2Weights(&param);
+  EditNetDescriptionDynamicFixedPoint(&param, "Convolution_and_InnerProduct",
+      "Activations", -1, -1, bitwidth_activations_, bitwidth_activations_);
+  Net<float>* net_test = new Net<float>(param, NULL);
+  net_test->CopyTrainedLayersFrom(weights_);
+  float accuracy;
+  RunForwardBatches(iterations_, net_test, &accuracy);
+  delete net_test;
+  param.release_state();
+  WriteProtoToTextFile(param, model_quantized_);
+  // Write summary of integer-power-of-2-weights analysis to log
+  LOG(INFO) << "------------------------------";
+  LOG(INFO) << "Network accuracy analysis for integer-power-of-two weights in "
+      << "convolutional (CONV) and fully connected (FC) layers.";
+  LOG(INFO) << "Baseline 32-bit float: " << test_score_baseline_;
+  LOG(INFO) << "Integer-power-of-two weights, 8 exponents per layer,";
+  LOG(INFO) << bitwidth_activations_ << "-bit layer activations:";
+  LOG(INFO) << "Accuracy: " << accuracy;
+  LOG(INFO) << "Please fine-tune.";
+}
+
 void Quantization::EditNetDescriptionDynamicFixedPoint(NetParameter* param,
       const string layers_2_quantize, const string net_part, const int bw_conv,
       const int bw_fc, const int bw_in, const int bw_out) {
   for (int i = 0; i < param->layer_size(); ++i) {
+    // layers without ranges are left as they are, as for power-of-two weights
+    const string& type = param->layer(i).type();
+    if ((type.find("Convolution") != string::npos ||
+        type.find("InnerProduct") != string::npos ||
+        type.find("FcRistretto") != string::npos) &&
+        find(layer_names_.begin(), layer_names_.end(),
+        param->layer(i).name()) == layer_names_.end()) {
+      LOG(WARNING) << "No range of layer " << param->layer(i).name()
+          << ", it is left as it is.";
+      continue;
+    }
     // if this is a convolutional layer which should be quantized ...
     if (layers_2_quantize.find("Convolution") != string::npos &&
         param->layer(i).type().find("Convolution") != string::npos) {
@@ -271,6 +403,7 @@ void Quantization::EditNetDescriptionDynamicFixedPoint(NetParameter* param,
         param_layer->mutable_quantization_param()->set_fl_params(bw_conv -
             GetIntegerLengthParams(param->layer(i).name()));
         param_layer->mutable_quantization_param()->set_bw_params(bw_conv);
+        SetChannelLengths(param_layer, bw_conv, "Parameters");
       }
       // quantize activations
       if (net_part.find("Activations") != string::npos) {
@@ -282,6 +415,7 @@ void Quantization::EditNetDescriptionDynamicFixedPoint(NetParameter* param,
         param_layer->mutable_quantization_param()->set_fl_layer_out(bw_out -
             GetIntegerLengthOut(param->layer(i).name()));
         param_layer->mutable_quantization_param()->set_bw_layer_out(bw_out);
+        SetChannelLengths(param_layer, bw_out, "Activations");
       }
     }
     // if this is an inner product layer which should be quantized ...
@@ -295,6 +429,7 @@ void Quantization::EditNetDescriptionDynamicFixedPoint(NetParameter* param,
         param_layer->mutable_quantization_param()->set_fl_params(bw_fc -
             GetIntegerLengthParams(param->layer(i).name()));
         param_layer->mutable_quantization_param()->set_bw_params(bw_fc);
+        SetChannelLengths(param_layer, bw_fc, "Parameters");
       }
       // quantize activations
       if (net_part.find("Activations") != string::npos) {
@@ -306,25 +441,120 @@ void Quantization::EditNetDescriptionDynamicFixedPoint(NetParameter* param,
         param_layer->mutable_quantization_param()->set_fl_layer_out(bw_out -
             GetIntegerLengthOut(param->layer(i).name()) );
         param_layer->mutable_quantization_param()->set_bw_layer_out(bw_out);
+        SetChannelLengths(param_layer, bw_out, "Activations");
       }
     }
   }
 }
 
+void Quantization::EditNetDescriptionMiniFloat(NetParameter* param,
+      const int bitwidth) {
+  for (int i = 0; i < param->layer_size(); ++i) {
+    const string& type = param->layer(i).type();
+    LayerParameter* param_layer = param->mutable_layer(i);
+    if (type == "Convolution" || type == "ConvolutionRistretto") {
+      param_layer->set_type("ConvolutionRistretto");
+    } else if (type == "InnerProduct" || type == "FcRistretto") {
+      param_layer->set_type("FcRistretto");
+    } else if (type == "LRN" || type == "LRNRistretto") {
+      param_layer->set_type("LRNRistretto");
+    } else {
+      continue;
+    }
+    param_layer->mutable_quantization_param()->set_precision(
+        caffe::QuantizationParameter_Precision_MINIFLOAT);
+    param_layer->mutable_quantization_param()->set_mant_bits(bitwidth
+        - exp_bits_ - 1);
+    param_layer->mutable_quantization_param()->set_exp_bits(exp_bits_);
+    if (param_layer->type() != "LRNRistretto") {
+      param_layer->mutable_quantization_param()->set_trim_weights(true);
+    }
+  }
+}
+
+void Quantization::EditNetDescriptionIntegerPowerOf2Weights(
+      NetParameter* param) {
+  for (int i = 0; i < param->layer_size(); ++i) {
+    const string& type = param->layer(i).type();
+    LayerParameter* param_layer = param->mutable_layer(i);
+    if (type != "Convolution" && type != "ConvolutionRistretto" &&
+        type != "InnerProduct" && type != "FcRistretto") {
+      continue;
+    }
+    const int pos = find(layer_names_.begin(), layer_names_.end(),
+        param_layer->name()) - layer_names_.begin();
+    if (pos == static_cast<int>(layer_names_.size())) {
+      LOG(WARNING) << "No weight range of layer " << param_layer->name()
+          << ", it is left as it is.";
+      continue;
+    }
+    if (type == "Convolution" || type == "ConvolutionRistretto") {
+      param_layer->set_type("ConvolutionRistretto");
+    } else {
+      param_layer->set_type("FcRistretto");
+    }
+    // The largest weights round to 2^exp_max; 8 exponents fit the 3 exponent
+    // bits of a packed weight
+    const int exp_max = (int)rint(log2(std::max(max_params_[pos], 1e-30f)));
+    param_layer->mutable_quantization_param()->set_precision(
+        caffe::QuantizationParameter_Precision_INTEGER_POWER_OF_2_WEIGHTS);
+    param_layer->mutable_quantization_param()->set_exp_min(exp_max - 7);
+    param_layer->mutable_quantization_param()->set_exp_max(exp_max);
+    param_layer->mutable_quantization_param()->set_trim_weights(true);
+  }
+}
+
+void Quantization::SetChannelLengths(LayerParameter* param_layer,
+      const int bitwidth, const string net_part) {
+  if (!per_channel_) {
+    return;
+  }
+  caffe::QuantizationParameter* param =
+      param_layer->mutable_quantization_param();
+  const bool params = net_part == "Parameters";
+  const vector<float>& max_data = params ?
+      max_params_channel_[param_layer->name()] :
+      max_out_channel_[param_layer->name()];
+  // Channels far below the layer range, e.g. dead ones, get at most bitwidth
+  // more fractional bits than the layer
+  const int max_fl = (params ? param->fl_params() : param->fl_layer_out()) +
+      bitwidth;
+  if (params) {
+    param->clear_fl_params_channel();
+  } else {
+    param->clear_fl_layer_out_channel();
+  }
+  for (int c = 0; c < max_data.size(); ++c) {
+    // the integer lengths as for whole layers
+    const int il = params ?
+        (int)ceil(log2(std::max(max_data[c], 1e-30f)) + 1e-8 + 1) :
+        (int)ceil(log2(max_data[c] + 1e-8 + 1));
+    const int fl = std::min(bitwidth - il, max_fl);
+    if (params) {
+      param->add_fl_params_channel(fl);
+    } else {
+      param->add_fl_layer_out_channel(fl);
+    }
+  }
+}
+
 int Quantization::GetIntegerLengthParams(const string layer_name) {
   int pos = find(layer_names_.begin(), layer_names_.end(), layer_name)
       - layer_names_.begin();
+  CHECK_LT(pos, il_params_.size()) << "No range of layer " << layer_name;
   return il_params_[pos];
 }
 
 int Quantization::GetIntegerLengthIn(const string layer_name) {
   int pos = find(layer_names_.begin(), layer_names_.end(), layer_name)
       - layer_names_.begin();
+  CHECK_LT(pos, il_in_.size()) << "No range of layer " << layer_name;
   return il_in_[pos];
 }
 
 int Quantization::GetIntegerLengthOut(const string layer_name) {
   int pos = find(layer_names_.begin(), layer_names_.end(), layer_name)
       - layer_names_.begin();
+  CHECK_LT(pos, il_out_.size()) << "No range of layer " << layer_name;
   return il_out_[pos];
 }
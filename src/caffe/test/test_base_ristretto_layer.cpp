@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "ristretto/base_ristretto_layer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+// BaseRistrettoLayer with its trimming open to the tests
+template <typename Dtype>
+class TrimmingLayer : public BaseRistrettoLayer<Dtype> {
+ public:
+  explicit TrimmingLayer(const LayerParameter& param)
+      : BaseRistrettoLayer<Dtype>(param) {
+    this->precision_ = QuantizationParameter_Precision_DYNAMIC_FIXED_POINT;
+    this->rounding_ = QuantizationParameter_Rounding_NEAREST;
+    this->bw_layer_out_ = 8;
+    this->fl_layer_out_ = 2;
+  }
+  using BaseRistrettoLayer<Dtype>::Trim2FixedPoint_cpu;
+  using BaseRistrettoLayer<Dtype>::QuantizeLayerOutputs_cpu;
+  using BaseRistrettoLayer<Dtype>::fl_layer_out_channel_;
+  using BaseRistrettoLayer<Dtype>::rng_seed_;
+  using BaseRistrettoLayer<Dtype>::rng_stream_;
+  using BaseRistrettoLayer<Dtype>::rng_counter_;
+};
+
+// Philox4x32-10 of one counter, as in Random123
+static void Philox(const uint32_t* key, uint32_t* x) {
+  uint32_t k0 = key[0];
+  uint32_t k1 = key[1];
+  for (int r = 0; r < 10; ++r) {
+    const uint64_t p0 = static_cast<uint64_t>(0xD2511F53) * x[0];
+    const uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57) * x[2];
+    const uint32_t y[4] = { static_cast<uint32_t>(p1 >> 32) ^ x[1] ^ k0,
+        static_cast<uint32_t>(p1), static_cast<uint32_t>(p0 >> 32) ^ x[3] ^ k1,
+        static_cast<uint32_t>(p0) };
+    std::copy(y, y + 4, x);
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+}
+
+template <typename Dtype>
+class BaseRistrettoLayerTest : public ::testing::Test {
+ protected:
+  BaseRistrettoLayerTest() : data_(1000) {
+    Caffe::set_random_seed(1701);
+    layer_param_.set_name("trim");
+    caffe_rng_uniform<Dtype>(data_.size(), -40, 40, &data_[0]);
+    // half way between two steps of fl 2, either sign
+    for (int i = 0; i < data_.size(); i += 5) {
+      data_[i] = (std::floor(data_[i] * 4) + 0.5) / 4;
+    }
+  }
+
+  // x to bit_width bits with fl fractional bits, rounded half away from zero
+  static Dtype TrimNearest(const Dtype x, const int bit_width, const int fl,
+      const Dtype min_data) {
+    const double d = std::ldexp(static_cast<double>(x), fl);
+    const double r = d < 0 ? -std::floor(-d + 0.5) : std::floor(d + 0.5);
+    const double max_data = std::ldexp(1., bit_width - 1) - 1;
+    return std::ldexp(std::max(std::min(r, max_data),
+        static_cast<double>(min_data)), -fl);
+  }
+
+  LayerParameter layer_param_;
+  vector<Dtype> data_;
+};
+
+TYPED_TEST_CASE(BaseRistrettoLayerTest, TestDtypes);
+
+TYPED_TEST(BaseRistrettoLayerTest, TestTrimNearest) {
+  typedef TypeParam Dtype;
+  TrimmingLayer<Dtype> layer(this->layer_param_);
+  const Dtype min_data = -128;
+  // every tail of the vector loops, and a length with several
+  vector<int> counts;
+  for (int cnt = 0; cnt <= 40; ++cnt) {
+    counts.push_back(cnt);
+  }
+  counts.push_back(this->data_.size());
+  for (int i = 0; i < counts.size(); ++i) {
+    const int cnt = counts[i];
+    vector<Dtype> trimmed(this->data_.size(), Dtype(-1000));
+    layer.Trim2FixedPoint_cpu(&this->data_[0], cnt, 8,
+        QuantizationParameter_Rounding_NEAREST, 2, &trimmed[0]);
+    for (int j = 0; j < cnt; ++j) {
+      EXPECT_EQ(this->TrimNearest(this->data_[j], 8, 2, min_data),
+          trimmed[j]) << "element " << j << " of " << cnt;
+    }
+    for (int j = cnt; j < trimmed.size(); ++j) {
+      EXPECT_EQ(Dtype(-1000), trimmed[j]) << "past " << cnt;
+    }
+    // in place
+    vector<Dtype> data(this->data_);
+    layer.Trim2FixedPoint_cpu(&data[0], cnt, 8,
+        QuantizationParameter_Rounding_NEAREST, 2);
+    for (int j = 0; j < cnt; ++j) {
+      EXPECT_EQ(trimmed[j], data[j]);
+    }
+  }
+}
+
+TYPED_TEST(BaseRistrettoLayerTest, TestTrimOutputsPerChannel) {
+  typedef TypeParam Dtype;
+  TrimmingLayer<Dtype> layer(this->layer_param_);
+  // one output per channel, as of an inner product, a scale each
+  const int channels = 37;
+  const int num = this->data_.size() / channels;
+  for (int c = 0; c < channels; ++c) {
+    layer.fl_layer_out_channel_.push_back(c % 5 - 1);
+  }
+  vector<Dtype> data(this->data_);
+  layer.QuantizeLayerOutputs_cpu(&data[0], num, channels, 1);
+  for (int i = 0; i < num * channels; ++i) {
+    EXPECT_EQ(this->TrimNearest(this->data_[i], 8, i % channels % 5 - 1,
+        -128), data[i]) << "element " << i;
+  }
+}
+
+TYPED_TEST(BaseRistrettoLayerTest, TestTrimOutputsEpilogue) {
+  typedef TypeParam Dtype;
+  TrimmingLayer<Dtype> layer(this->layer_param_);
+  const int channels = 7;
+  const int dim = this->data_.size() / channels;
+  vector<Dtype> bias(channels);
+  for (int c = 0; c < channels; ++c) {
+    bias[c] = c * 0.75 - 2;
+  }
+  for (int relu = 0; relu < 2; ++relu) {
+    vector<Dtype> data(this->data_);
+    layer.QuantizeLayerOutputs_cpu(&data[0], channels, dim, &bias[0],
+        relu == 1);
+    for (int i = 0; i < channels * dim; ++i) {
+      EXPECT_EQ(this->TrimNearest(this->data_[i] + bias[i / dim], 8, 2,
+          relu ? 0 : -128), data[i]) << "element " << i;
+    }
+  }
+}
+
+TYPED_TEST(BaseRistrettoLayerTest, TestPhiloxKnownAnswer) {
+  // the test vectors of Random123 for the reference above
+  uint32_t key[2] = {0, 0};
+  uint32_t x[4] = {0, 0, 0, 0};
+  Philox(key, x);
+  EXPECT_EQ(0x6627e8d5u, x[0]);
+  EXPECT_EQ(0xe169c58du, x[1]);
+  EXPECT_EQ(0xbc57ac4cu, x[2]);
+  EXPECT_EQ(0x9b00dbd8u, x[3]);
+  key[0] = key[1] = 0xffffffffu;
+  std::fill(x, x + 4, 0xffffffffu);
+  Philox(key, x);
+  EXPECT_EQ(0x408f276du, x[0]);
+  EXPECT_EQ(0x41c83b0eu, x[1]);
+  EXPECT_EQ(0xa20bc7c6u, x[2]);
+  EXPECT_EQ(0x6d5451fdu, x[3]);
+}
+
+TYPED_TEST(BaseRistrettoLayerTest, TestTrimStochastic) {
+  typedef TypeParam Dtype;
+  this->layer_param_.mutable_quantization_param()->set_rng_seed(
+      0x0123456789abcdefULL);
+  TrimmingLayer<Dtype> layer(this->layer_param_);
+  EXPECT_EQ(0x0123456789abcdefULL, layer.rng_seed_);
+  const uint32_t key[2] = { static_cast<uint32_t>(layer.rng_seed_),
+      static_cast<uint32_t>(layer.rng_seed_ >> 32) };
+  // the low word of the counter wraps within the trims
+  layer.rng_counter_ = 0xffffff00ULL;
+  // tails of the 8 lanes and 32 element blocks, and enough blocks for the
+  // threads
+  const int counts[] = {1, 7, 9, 31, 33, 100, 20000};
+  vector<Dtype> data(20000);
+  caffe_rng_uniform<Dtype>(data.size(), -40, 40, &data[0]);
+  for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+    const int cnt = counts[i];
+    const uint64_t ctr = layer.rng_counter_;
+    vector<Dtype> trimmed(cnt);
+    layer.Trim2FixedPoint_cpu(&data[0], cnt, 8,
+        QuantizationParameter_Rounding_STOCHASTIC, 2, &trimmed[0]);
+    EXPECT_EQ(ctr + (cnt + 31) / 32 * 8, layer.rng_counter_);
+    for (int j = 0; j < cnt; ++j) {
+      // word j / 8 % 4 of counter ctr + j / 32 * 8 + j % 8
+      const uint64_t c = ctr + j / 32 * 8 + j % 8;
+      uint32_t x[4] = { static_cast<uint32_t>(c),
+          static_cast<uint32_t>(c >> 32),
+          static_cast<uint32_t>(layer.rng_stream_),
+          static_cast<uint32_t>(layer.rng_stream_ >> 32) };
+      Philox(key, x);
+      const uint32_t word = x[j / 8 % 4];
+      const Dtype u = sizeof(Dtype) == sizeof(float) ?
+          (word >> 8) / 16777216. : word / 4294967296.;
+      const Dtype expected = std::max(std::min(
+          std::floor(data[j] * 4 + u), Dtype(127)), Dtype(-128)) / 4;
+      EXPECT_EQ(expected, trimmed[j]) << "element " << j << " of " << cnt;
+    }
+    // the same counters round the same way
+    vector<Dtype> replayed(cnt);
+    layer.rng_counter_ = ctr;
+    layer.Trim2FixedPoint_cpu(&data[0], cnt, 8,
+        QuantizationParameter_Rounding_STOCHASTIC, 2, &replayed[0]);
+    EXPECT_TRUE(std::equal(trimmed.begin(), trimmed.end(), replayed.begin()));
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,188 @@
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/bitplane.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class BitplaneTest : public ::testing::Test {
+ protected:
+  BitplaneTest() : data_(1100) {
+    Caffe::set_random_seed(1701);
+    caffe_rng_uniform<Dtype>(data_.size(), -40, 40, &data_[0]);
+    // past the int range at either end once scaled
+    data_[5] = 1e10;
+    data_[70] = -1e10;
+    data_[600] = 3e9;
+    data_[1099] = -3e9;
+  }
+
+  // The per-plane i2b() the kernels replaced, one pass over the data per
+  // plane, with the values saturated to the int range
+  static void ReferenceI2B(const Dtype* data, const int count, const int bw,
+      const int fl, Dtype* planes, const int plane_stride) {
+    for (int b = 0; b < bw; ++b) {
+      for (int i = 0; i < count; ++i) {
+        Dtype otmp = data[i] * powf(2, fl);
+        otmp = std::max(std::min(otmp, Dtype(2147483520.0f)),
+            Dtype(-2147483648.0f));
+        const unsigned utmp = (unsigned)(int)otmp;
+        planes[b * plane_stride + i] = (Dtype)((utmp >> b) & 0x00000001);
+      }
+    }
+  }
+
+  // The per-plane b2i() the kernels replaced, planes summed LSB to MSB
+  static void ReferenceB2I(const Dtype* planes, const int plane_stride,
+      const int count, const int bw, const int fl, Dtype* data) {
+    std::fill(data, data + count, Dtype(0));
+    for (int b = 0; b < bw; ++b) {
+      for (int i = 0; i < count; ++i) {
+        data[i] += planes[b * plane_stride + i] * powf(2, b - fl);
+      }
+    }
+  }
+
+  // Packs the reference planes of a (channels, spatial) map
+  static void ReferencePack(const Dtype* planes, const int channels,
+      const int spatial, const int bw, uint64_t* words) {
+    const int n = bitplane_words(spatial);
+    std::fill(words, words + bw * channels * n, uint64_t(0));
+    for (int b = 0; b < bw; ++b) {
+      for (int c = 0; c < channels; ++c) {
+        for (int s = 0; s < spatial; ++s) {
+          if (planes[(b * channels + c) * spatial + s] != 0) {
+            words[(b * channels + c) * n + s / 64] |= uint64_t(1) << (s % 64);
+          }
+        }
+      }
+    }
+  }
+
+  vector<Dtype> data_;
+};
+
+TYPED_TEST_CASE(BitplaneTest, TestDtypes);
+
+TYPED_TEST(BitplaneTest, TestI2B) {
+  typedef TypeParam Dtype;
+  // partial blocks and words, planes with a gap between them
+  const int counts[] = {1, 63, 65, 511, 512, 513, 1100};
+  const int bws[] = {1, 9, 32};
+  const int fls[] = {3, -2};
+  for (int i = 0; i < 7; ++i) {
+    const int count = counts[i];
+    const int plane_stride = count + 7;
+    for (int j = 0; j < 3; ++j) {
+      for (int k = 0; k < 2; ++k) {
+        vector<Dtype> expected(bws[j] * plane_stride, -1);
+        this->ReferenceI2B(&this->data_[0], count, bws[j], fls[k],
+            &expected[0], plane_stride);
+        vector<Dtype> planes(bws[j] * plane_stride, -1);
+        i2b_cpu(&this->data_[0], count, bws[j], fls[k], &planes[0],
+            plane_stride);
+        for (int p = 0; p < planes.size(); ++p) {
+          EXPECT_EQ(expected[p], planes[p]) << "count " << count << " bw "
+              << bws[j] << " fl " << fls[k] << " element " << p;
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(BitplaneTest, TestB2I) {
+  typedef TypeParam Dtype;
+  const int counts[] = {1, 63, 65, 511, 512, 513, 1100};
+  const int bws[] = {1, 9, 32};
+  for (int i = 0; i < 7; ++i) {
+    const int count = counts[i];
+    const int plane_stride = count + 7;
+    for (int j = 0; j < 3; ++j) {
+      // bits, or the diffs of the backward pass on a grid of 1/4
+      vector<Dtype> planes(bws[j] * plane_stride);
+      caffe_rng_uniform<Dtype>(planes.size(), -2, 2, &planes[0]);
+      for (int p = 0; p < planes.size(); ++p) {
+        planes[p] = j == 0 ? Dtype(planes[p] > 0) :
+            std::floor(planes[p] * 4) / 4;
+      }
+      vector<Dtype> expected(count);
+      this->ReferenceB2I(&planes[0], plane_stride, count, bws[j], 3,
+          &expected[0]);
+      vector<Dtype> data(count, -1);
+      b2i_cpu(&planes[0], plane_stride, count, bws[j], 3, &data[0]);
+      for (int p = 0; p < count; ++p) {
+        EXPECT_EQ(expected[p], data[p]) << "count " << count << " bw "
+            << bws[j] << " element " << p;
+      }
+    }
+  }
+}
+
+TYPED_TEST(BitplaneTest, TestI2BPacked) {
+  typedef TypeParam Dtype;
+  const int channels = 3;
+  const int spatials[] = {1, 63, 64, 65, 130, 300};
+  const int bws[] = {1, 9, 32};
+  for (int i = 0; i < 6; ++i) {
+    const int spatial = spatials[i];
+    const int words = bitplane_words(spatial);
+    for (int j = 0; j < 3; ++j) {
+      const int bw = bws[j];
+      vector<Dtype> planes(bw * channels * spatial);
+      this->ReferenceI2B(&this->data_[0], channels * spatial, bw, 3,
+          &planes[0], channels * spatial);
+      vector<uint64_t> expected(bw * channels * words);
+      this->ReferencePack(&planes[0], channels, spatial, bw, &expected[0]);
+      // the first channel on its own, the others as a range of the map
+      vector<uint64_t> packed(expected.size(), ~uint64_t(0));
+      i2b_packed_cpu(&this->data_[0], 1, spatial, bw, 3, &packed[0],
+          channels * words);
+      i2b_packed_cpu(&this->data_[spatial], channels - 1, spatial, bw, 3,
+          &packed[words], channels * words);
+      for (int w = 0; w < packed.size(); ++w) {
+        EXPECT_EQ(expected[w], packed[w]) << "spatial " << spatial << " bw "
+            << bw << " word " << w;
+      }
+    }
+  }
+}
+
+TYPED_TEST(BitplaneTest, TestB2IPacked) {
+  typedef TypeParam Dtype;
+  const int channels = 3;
+  const int spatials[] = {1, 63, 64, 65, 130, 300};
+  const int bws[] = {1, 9, 32};
+  for (int i = 0; i < 6; ++i) {
+    const int spatial = spatials[i];
+    for (int j = 0; j < 3; ++j) {
+      const int bw = bws[j];
+      vector<Dtype> planes(bw * channels * spatial);
+      caffe_rng_uniform<Dtype>(planes.size(), -1, 1, &planes[0]);
+      for (int p = 0; p < planes.size(); ++p) {
+        planes[p] = planes[p] > 0;
+      }
+      vector<uint64_t> packed(bw * channels * bitplane_words(spatial));
+      this->ReferencePack(&planes[0], channels, spatial, bw, &packed[0]);
+      vector<Dtype> expected(channels * spatial);
+      this->ReferenceB2I(&planes[0], channels * spatial, channels * spatial,
+          bw, 3, &expected[0]);
+      vector<Dtype> data(channels * spatial, -1);
+      b2i_packed_cpu(&packed[0], channels * bitplane_words(spatial), channels,
+          spatial, bw, 3, &data[0]);
+      for (int p = 0; p < data.size(); ++p) {
+        EXPECT_EQ(expected[p], data[p]) << "spatial " << spatial << " bw "
+            << bw << " element " << p;
+      }
+    }
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,175 @@
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layers/bitplane_layer.hpp"
+#include "caffe/util/bitplane.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class BitplaneLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  // more than a tile of integers per image
+  BitplaneLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 5, 60, 70)),
+        blob_planes_(new Blob<Dtype>()),
+        blob_top_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    filler_param.set_min(-20);
+    filler_param.set_max(40);
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    // on the grid of fl 3
+    Dtype* bottom = blob_bottom_->mutable_cpu_data();
+    for (int i = 0; i < blob_bottom_->count(); ++i) {
+      bottom[i] = std::floor(bottom[i] * 8) / 8;
+    }
+    layer_param_.mutable_bitplane_param()->set_bw_layer(9);
+    layer_param_.mutable_bitplane_param()->set_fl_layer(3);
+  }
+  virtual ~BitplaneLayerTest() {
+    delete blob_bottom_;
+    delete blob_planes_;
+    delete blob_top_;
+  }
+
+  // Splits the bottom into planes and sums them back. The 9 bits keep the
+  // values modulo 2^6, so the negative ones come back 64 higher.
+  void TestRoundTrip(const bool packed) {
+    layer_param_.mutable_bitplane_param()->set_packed(packed);
+    LayerParameter i2b_param(layer_param_);
+    i2b_param.mutable_bitplane_param()->set_direction(true);
+    BitplaneLayer<Dtype> i2b_layer(i2b_param);
+    vector<Blob<Dtype>*> bottom(1, blob_bottom_);
+    vector<Blob<Dtype>*> planes(1, blob_planes_);
+    i2b_layer.SetUp(bottom, planes);
+    i2b_layer.Forward(bottom, planes);
+    EXPECT_EQ(blob_bottom_->shape(0), blob_planes_->shape(0));
+    EXPECT_EQ(blob_bottom_->shape(1) * 9, blob_planes_->shape(1));
+    LayerParameter b2i_param(layer_param_);
+    b2i_param.mutable_bitplane_param()->set_direction(false);
+    BitplaneLayer<Dtype> b2i_layer(b2i_param);
+    if (packed) {
+      // the shape of the map to rebuild
+      planes.push_back(blob_bottom_);
+    }
+    vector<Blob<Dtype>*> top(1, blob_top_);
+    b2i_layer.SetUp(planes, top);
+    b2i_layer.Forward(planes, top);
+    ASSERT_EQ(blob_bottom_->shape(), blob_top_->shape());
+    const Dtype* data = blob_bottom_->cpu_data();
+    const Dtype* output = blob_top_->cpu_data();
+    for (int i = 0; i < blob_top_->count(); ++i) {
+      EXPECT_EQ(data[i] < 0 ? data[i] + 64 : data[i], output[i])
+          << "element " << i;
+    }
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_planes_;
+  Blob<Dtype>* const blob_top_;
+  LayerParameter layer_param_;
+};
+
+TYPED_TEST_CASE(BitplaneLayerTest, TestDtypes);
+
+TYPED_TEST(BitplaneLayerTest, TestRoundTrip) {
+  this->TestRoundTrip(false);
+}
+
+TYPED_TEST(BitplaneLayerTest, TestRoundTripPacked) {
+  this->TestRoundTrip(true);
+}
+
+TYPED_TEST(BitplaneLayerTest, TestPackedPlanes) {
+  typedef TypeParam Dtype;
+  // the packed words hold the bits of the unpacked planes
+  this->TestRoundTrip(false);
+  Blob<Dtype> unpacked;
+  unpacked.CopyFrom(*this->blob_planes_, false, true);
+  this->TestRoundTrip(true);
+  const int num = this->blob_bottom_->shape(0);
+  const int rows = this->blob_planes_->shape(1);
+  const int spatial = this->blob_bottom_->count(2);
+  const int words = bitplane_words(spatial);
+  const uint64_t* packed =
+      reinterpret_cast<const uint64_t*>(this->blob_planes_->cpu_data());
+  const Dtype* bits = unpacked.cpu_data();
+  for (int i = 0; i < num * rows; ++i) {
+    for (int s = 0; s < spatial; ++s) {
+      EXPECT_EQ(bits[i * spatial + s],
+          (Dtype)((packed[i * words + s / 64] >> (s % 64)) & 1))
+          << "row " << i << " element " << s;
+    }
+  }
+}
+
+TYPED_TEST(BitplaneLayerTest, TestThreads) {
+  typedef TypeParam Dtype;
+  // every thread count gives the planes of one thread
+  for (int packed = 0; packed < 2; ++packed) {
+    Blob<Dtype> expected;
+    for (int num_threads = 1; num_threads <= 3; ++num_threads) {
+      this->layer_param_.mutable_bitplane_param()->set_num_threads(
+          num_threads);
+      this->TestRoundTrip(packed);
+      if (num_threads == 1) {
+        expected.CopyFrom(*this->blob_planes_, false, true);
+        continue;
+      }
+      // packed words compared as words, as bits they may be NaN
+      const uint64_t* expected_words =
+          reinterpret_cast<const uint64_t*>(expected.cpu_data());
+      const uint64_t* words =
+          reinterpret_cast<const uint64_t*>(this->blob_planes_->cpu_data());
+      const int count = expected.count() * sizeof(Dtype) / sizeof(uint64_t);
+      for (int i = 0; i < count; ++i) {
+        EXPECT_EQ(expected_words[i], words[i]) << "threads " << num_threads
+            << " packed " << packed << " word " << i;
+      }
+    }
+  }
+}
+
+TYPED_TEST(BitplaneLayerTest, TestThreadsBackward) {
+  typedef TypeParam Dtype;
+  this->layer_param_.mutable_bitplane_param()->set_direction(true);
+  vector<Blob<Dtype>*> bottom(1, this->blob_bottom_);
+  vector<Blob<Dtype>*> top(1, this->blob_planes_);
+  vector<bool> propagate_down(1, true);
+  Blob<Dtype> expected;
+  for (int num_threads = 1; num_threads <= 3; ++num_threads) {
+    this->layer_param_.mutable_bitplane_param()->set_num_threads(num_threads);
+    BitplaneLayer<Dtype> layer(this->layer_param_);
+    layer.SetUp(bottom, top);
+    // the same diffs on a grid of 1/4 for every thread count
+    Caffe::set_random_seed(1701);
+    Dtype* top_diff = this->blob_planes_->mutable_cpu_diff();
+    caffe_rng_uniform<Dtype>(this->blob_planes_->count(), -2, 2, top_diff);
+    for (int i = 0; i < this->blob_planes_->count(); ++i) {
+      top_diff[i] = std::floor(top_diff[i] * 4) / 4;
+    }
+    layer.Backward(top, propagate_down, bottom);
+    if (num_threads == 1) {
+      expected.CopyFrom(*this->blob_bottom_, true, true);
+      continue;
+    }
+    const Dtype* bottom_diff = this->blob_bottom_->cpu_diff();
+    for (int i = 0; i < expected.count(); ++i) {
+      EXPECT_EQ(expected.cpu_diff()[i], bottom_diff[i]) << "threads "
+          << num_threads << " element " << i;
+    }
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,133 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "ristretto/base_ristretto_layer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_ristretto_util.hpp"
+
+namespace caffe {
+
+// ConvolutionRistrettoLayer telling which engine it runs
+template <typename Dtype>
+class EngineConvolutionLayer : public ConvolutionRistrettoLayer<Dtype> {
+ public:
+  explicit EngineConvolutionLayer(const LayerParameter& param)
+      : ConvolutionRistrettoLayer<Dtype>(param) {}
+  using ConvolutionRistrettoLayer<Dtype>::integer_engine_;
+  using ConvolutionRistrettoLayer<Dtype>::integer_bias_;
+};
+
+template <typename Dtype>
+class ConvolutionRistrettoLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  ConvolutionRistrettoLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 5, 9, 11)),
+        blob_top_integer_(new Blob<Dtype>()),
+        blob_top_emulation_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    // off the input grid, so that the layers trim it
+    FillerParameter filler_param;
+    filler_param.set_min(-3);
+    filler_param.set_max(3);
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    layer_param_.set_name("conv");
+    ConvolutionParameter* convolution_param =
+        layer_param_.mutable_convolution_param();
+    convolution_param->add_kernel_size(3);
+    convolution_param->add_pad(1);
+    convolution_param->set_num_output(4);
+    SetRistrettoFixedPoint(layer_param_.mutable_quantization_param());
+  }
+  virtual ~ConvolutionRistrettoLayerTest() {
+    delete blob_bottom_;
+    delete blob_top_integer_;
+    delete blob_top_emulation_;
+  }
+
+  // Runs the layer with both engines, the weights on the grid of their
+  // fl_params and the bias as multiples of bias_step, which the integer
+  // engine adds to the sums if integer_bias
+  void TestEngines(const Dtype bias_step, const bool integer_bias) {
+    LayerParameter integer_param(layer_param_);
+    integer_param.mutable_quantization_param()->set_engine(
+        QuantizationParameter_Engine_INTEGER);
+    EngineConvolutionLayer<Dtype> integer_layer(integer_param);
+    vector<Blob<Dtype>*> top_integer(1, blob_top_integer_);
+    integer_layer.SetUp(blob_bottom_vec_, top_integer);
+    EXPECT_TRUE(integer_layer.integer_engine_);
+    FillRistrettoWeights(layer_param_.quantization_param(),
+        layer_param_.convolution_param().num_output(), false,
+        integer_layer.blobs()[0].get());
+    FillRistrettoBias(bias_step, integer_layer.blobs()[1].get());
+    integer_layer.Forward(blob_bottom_vec_, top_integer);
+    EXPECT_EQ(integer_bias, !integer_layer.integer_bias_.empty());
+    LayerParameter emulation_param(layer_param_);
+    emulation_param.mutable_quantization_param()->set_engine(
+        QuantizationParameter_Engine_EMULATION);
+    EngineConvolutionLayer<Dtype> emulation_layer(emulation_param);
+    vector<Blob<Dtype>*> top_emulation(1, blob_top_emulation_);
+    emulation_layer.SetUp(blob_bottom_vec_, top_emulation);
+    EXPECT_FALSE(emulation_layer.integer_engine_);
+    for (int i = 0; i < 2; ++i) {
+      caffe_copy(integer_layer.blobs()[i]->count(),
+          integer_layer.blobs()[i]->cpu_data(),
+          emulation_layer.blobs()[i]->mutable_cpu_data());
+    }
+    emulation_layer.Forward(blob_bottom_vec_, top_emulation);
+    // The sums are exact in Dtype, so the outputs are the same
+    ExpectBlobsEqual(*blob_top_emulation_, *blob_top_integer_);
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_integer_;
+  Blob<Dtype>* const blob_top_emulation_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  LayerParameter layer_param_;
+};
+
+TYPED_TEST_CASE(ConvolutionRistrettoLayerTest, TestDtypes);
+
+TYPED_TEST(ConvolutionRistrettoLayerTest, TestIntegerEngine) {
+  // the bias on the grid of the sums, added to them
+  this->TestEngines(1. / 16, true);
+}
+
+TYPED_TEST(ConvolutionRistrettoLayerTest, TestIntegerEngineFloatBias) {
+  // the bias off the grid of the sums, added to them as floats
+  this->TestEngines(1. / 4096, false);
+}
+
+TYPED_TEST(ConvolutionRistrettoLayerTest, TestIntegerEngineLargeBias) {
+  // up to 2^30.3 at the scale of the sums: an int32 still, but a sum with it
+  // can leave IntegerSumBits(), so it is added as a float
+  this->TestEngines(1 << 18, false);
+}
+
+TYPED_TEST(ConvolutionRistrettoLayerTest, TestIntegerEngineStrideChannels) {
+  ConvolutionParameter* convolution_param =
+      this->layer_param_.mutable_convolution_param();
+  convolution_param->set_kernel_size(0, 2);
+  convolution_param->add_kernel_size(3);
+  convolution_param->add_stride(2);
+  QuantizationParameter* quantization_param =
+      this->layer_param_.mutable_quantization_param();
+  quantization_param->set_fused_relu(true);
+  const int fl_params[] = {6, 5, 7, 4};
+  const int fl_layer_out[] = {2, 3, 1, 0};
+  for (int o = 0; o < 4; ++o) {
+    quantization_param->add_fl_params_channel(fl_params[o]);
+    quantization_param->add_fl_layer_out_channel(fl_layer_out[o]);
+  }
+  this->TestEngines(1. / 16, true);
+}
+
+}  // namespace caffe
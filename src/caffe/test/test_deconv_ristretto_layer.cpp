@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/util/im2col.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "ristretto/base_ristretto_layer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_ristretto_util.hpp"
+
+namespace caffe {
+
+// DeconvolutionRistrettoLayer telling which path it runs
+template <typename Dtype>
+class SubpixelDeconvolutionLayer : public DeconvolutionRistrettoLayer<Dtype> {
+ public:
+  explicit SubpixelDeconvolutionLayer(const LayerParameter& param)
+      : DeconvolutionRistrettoLayer<Dtype>(param) {}
+  using DeconvolutionRistrettoLayer<Dtype>::subpixel_;
+};
+
+template <typename Dtype>
+class DeconvolutionRistrettoLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  DeconvolutionRistrettoLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 5, 6, 7)),
+        blob_top_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    // on the input grid, so that trimming leaves it as it is
+    FillerParameter filler_param;
+    filler_param.set_min(-3);
+    filler_param.set_max(3);
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    Dtype* bottom = blob_bottom_->mutable_cpu_data();
+    for (int i = 0; i < blob_bottom_->count(); ++i) {
+      bottom[i] = std::floor(bottom[i] * 16) / 16;
+    }
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+    layer_param_.set_name("deconv");
+    layer_param_.mutable_convolution_param()->set_num_output(4);
+    SetRistrettoFixedPoint(layer_param_.mutable_quantization_param());
+  }
+  virtual ~DeconvolutionRistrettoLayerTest() {
+    delete blob_bottom_;
+    delete blob_top_;
+  }
+
+  // Runs the layer on weights on the fixed point grid and compares it with
+  // the GEMM and col2im of the weights and the input, and the ReLU if fused
+  void TestSubpixel(const int* kernel, const int* stride, const int* pad) {
+    ConvolutionParameter* convolution_param =
+        layer_param_.mutable_convolution_param();
+    convolution_param->set_kernel_h(kernel[0]);
+    convolution_param->set_kernel_w(kernel[1]);
+    convolution_param->set_stride_h(stride[0]);
+    convolution_param->set_stride_w(stride[1]);
+    convolution_param->set_pad_h(pad[0]);
+    convolution_param->set_pad_w(pad[1]);
+    SubpixelDeconvolutionLayer<Dtype> layer(layer_param_);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_TRUE(layer.subpixel_);
+    // one fl_params for all outputs
+    FillRistrettoWeights(layer_param_.quantization_param(), 1, false,
+        layer.blobs()[0].get());
+    FillRistrettoBias(Dtype(1. / 16), layer.blobs()[1].get());
+    const Dtype* weight = layer.blobs()[0]->cpu_data();
+    const Dtype* bias = layer.blobs()[1]->cpu_data();
+    const int num_output = layer_param_.convolution_param().num_output();
+    // stale values in the top, so that every output has to be written
+    layer.Reshape(blob_bottom_vec_, blob_top_vec_);
+    caffe_set(blob_top_->count(), Dtype(1000), blob_top_->mutable_cpu_data());
+    layer.Forward(blob_bottom_vec_, blob_top_vec_);
+    const int num = blob_bottom_->shape(0);
+    const int channels = blob_bottom_->shape(1);
+    const int height = blob_bottom_->shape(2);
+    const int width = blob_bottom_->shape(3);
+    const int out_h = stride[0] * (height - 1) + kernel[0] - 2 * pad[0];
+    const int out_w = stride[1] * (width - 1) + kernel[1] - 2 * pad[1];
+    ASSERT_EQ(num, blob_top_->shape(0));
+    ASSERT_EQ(num_output, blob_top_->shape(1));
+    ASSERT_EQ(out_h, blob_top_->shape(2));
+    ASSERT_EQ(out_w, blob_top_->shape(3));
+    const Dtype min_out =
+        layer_param_.quantization_param().fused_relu() ? 0 : -128;
+    const int kernel_dim = num_output * kernel[0] * kernel[1];
+    vector<Dtype> col(kernel_dim * height * width);
+    vector<Dtype> expected(num_output * out_h * out_w);
+    for (int n = 0; n < num; ++n) {
+      caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, kernel_dim,
+          height * width, channels, 1., weight,
+          blob_bottom_->cpu_data() + n * channels * height * width, 0.,
+          &col[0]);
+      col2im_cpu(&col[0], num_output, out_h, out_w, kernel[0], kernel[1],
+          pad[0], pad[1], stride[0], stride[1], 1, 1, &expected[0]);
+      const Dtype* output = blob_top_->cpu_data() + n * expected.size();
+      for (int i = 0; i < expected.size(); ++i) {
+        // the sums are exact, the bias is added and the output trimmed in
+        // one pass
+        const Dtype sum = (expected[i] + bias[i / (out_h * out_w)]) * 4;
+        const Dtype rounded = sum < 0 ? -std::floor(-sum + Dtype(0.5)) :
+            std::floor(sum + Dtype(0.5));
+        EXPECT_EQ(std::max(std::min(rounded, Dtype(127)), min_out) / 4,
+            output[i]) << "image " << n << " output " << i;
+      }
+    }
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+  LayerParameter layer_param_;
+};
+
+TYPED_TEST_CASE(DeconvolutionRistrettoLayerTest, TestDtypes);
+
+TYPED_TEST(DeconvolutionRistrettoLayerTest, TestSubpixel3x3Stride2) {
+  // the upsampling of the decoders
+  const int kernel[] = {3, 3};
+  const int stride[] = {2, 2};
+  const int pad[] = {1, 1};
+  this->TestSubpixel(kernel, stride, pad);
+}
+
+TYPED_TEST(DeconvolutionRistrettoLayerTest, TestSubpixelImageThreads) {
+  this->layer_param_.mutable_quantization_param()->set_image_threads(2);
+  const int kernel[] = {4, 4};
+  const int stride[] = {2, 2};
+  const int pad[] = {2, 1};
+  this->TestSubpixel(kernel, stride, pad);
+}
+
+TYPED_TEST(DeconvolutionRistrettoLayerTest, TestSubpixelFusedReLU) {
+  // fire*/relu_b2b1_squeeze1x1 folded into the decoder
+  this->layer_param_.mutable_quantization_param()->set_fused_relu(true);
+  const int kernel[] = {3, 3};
+  const int stride[] = {2, 2};
+  const int pad[] = {1, 1};
+  this->TestSubpixel(kernel, stride, pad);
+}
+
+TYPED_TEST(DeconvolutionRistrettoLayerTest, TestSubpixelEmptyPhase) {
+  // the kernel is narrower than the stride, a phase has no taps
+  const int kernel[] = {4, 2};
+  const int stride[] = {2, 3};
+  const int pad[] = {1, 0};
+  this->TestSubpixel(kernel, stride, pad);
+}
+
+}  // namespace caffe
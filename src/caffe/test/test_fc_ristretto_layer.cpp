@@ -0,0 +1,128 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "ristretto/base_ristretto_layer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_ristretto_util.hpp"
+
+namespace caffe {
+
+// FcRistrettoLayer telling which engine it runs
+template <typename Dtype>
+class EngineFcLayer : public FcRistrettoLayer<Dtype> {
+ public:
+  explicit EngineFcLayer(const LayerParameter& param)
+      : FcRistrettoLayer<Dtype>(param) {}
+  using FcRistrettoLayer<Dtype>::integer_gemv_;
+  using FcRistrettoLayer<Dtype>::integer_bias_;
+};
+
+template <typename Dtype>
+class FcRistrettoLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  FcRistrettoLayerTest()
+      : blob_bottom_(new Blob<Dtype>(1, 3, 5, 7)),
+        blob_top_integer_(new Blob<Dtype>()),
+        blob_top_emulation_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    // off the input grid, so that the layers trim it
+    FillerParameter filler_param;
+    filler_param.set_min(-3);
+    filler_param.set_max(3);
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    layer_param_.set_name("fc");
+    // past a block of the GEMV rows
+    layer_param_.mutable_inner_product_param()->set_num_output(13);
+    SetRistrettoFixedPoint(layer_param_.mutable_quantization_param());
+  }
+  virtual ~FcRistrettoLayerTest() {
+    delete blob_bottom_;
+    delete blob_top_integer_;
+    delete blob_top_emulation_;
+  }
+
+  // Runs the layer with both engines, the weights on the grid of their
+  // fl_params and the bias as multiples of bias_step, which the integer
+  // GEMV adds to the sums if integer_bias
+  void TestEngines(const Dtype bias_step, const bool integer_bias) {
+    LayerParameter integer_param(layer_param_);
+    integer_param.mutable_quantization_param()->set_engine(
+        QuantizationParameter_Engine_INTEGER);
+    EngineFcLayer<Dtype> integer_layer(integer_param);
+    vector<Blob<Dtype>*> top_integer(1, blob_top_integer_);
+    integer_layer.SetUp(blob_bottom_vec_, top_integer);
+    EXPECT_TRUE(integer_layer.integer_gemv_);
+    FillRistrettoWeights(layer_param_.quantization_param(),
+        layer_param_.inner_product_param().num_output(),
+        layer_param_.inner_product_param().transpose(),
+        integer_layer.blobs()[0].get());
+    FillRistrettoBias(bias_step, integer_layer.blobs()[1].get());
+    integer_layer.Forward(blob_bottom_vec_, top_integer);
+    EXPECT_EQ(integer_bias, !integer_layer.integer_bias_.empty());
+    LayerParameter emulation_param(layer_param_);
+    emulation_param.mutable_quantization_param()->set_engine(
+        QuantizationParameter_Engine_EMULATION);
+    EngineFcLayer<Dtype> emulation_layer(emulation_param);
+    vector<Blob<Dtype>*> top_emulation(1, blob_top_emulation_);
+    emulation_layer.SetUp(blob_bottom_vec_, top_emulation);
+    EXPECT_FALSE(emulation_layer.integer_gemv_);
+    for (int i = 0; i < 2; ++i) {
+      caffe_copy(integer_layer.blobs()[i]->count(),
+          integer_layer.blobs()[i]->cpu_data(),
+          emulation_layer.blobs()[i]->mutable_cpu_data());
+    }
+    emulation_layer.Forward(blob_bottom_vec_, top_emulation);
+    // The sums are exact in Dtype, so the outputs are the same
+    ExpectBlobsEqual(*blob_top_emulation_, *blob_top_integer_);
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_integer_;
+  Blob<Dtype>* const blob_top_emulation_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  LayerParameter layer_param_;
+};
+
+TYPED_TEST_CASE(FcRistrettoLayerTest, TestDtypes);
+
+TYPED_TEST(FcRistrettoLayerTest, TestIntegerGemv) {
+  // the bias on the grid of the sums, added to them
+  this->TestEngines(1. / 16, true);
+}
+
+TYPED_TEST(FcRistrettoLayerTest, TestIntegerGemvFloatBias) {
+  // the bias off the grid of the sums, added to them as floats
+  this->TestEngines(1. / 4096, false);
+}
+
+TYPED_TEST(FcRistrettoLayerTest, TestIntegerGemvLargeBias) {
+  // an int32 at the scale of the sums, but a sum with it can leave
+  // IntegerSumBits(), so it is added as a float
+  this->TestEngines(1 << 18, false);
+}
+
+TYPED_TEST(FcRistrettoLayerTest, TestIntegerGemvTranspose) {
+  this->layer_param_.mutable_inner_product_param()->set_transpose(true);
+  this->TestEngines(1. / 16, true);
+}
+
+TYPED_TEST(FcRistrettoLayerTest, TestIntegerGemvChannels) {
+  QuantizationParameter* quantization_param =
+      this->layer_param_.mutable_quantization_param();
+  for (int n = 0; n < 13; ++n) {
+    quantization_param->add_fl_params_channel(n % 4 + 4);
+    quantization_param->add_fl_layer_out_channel(n % 3);
+  }
+  this->TestEngines(1. / 16, true);
+}
+
+}  // namespace caffe
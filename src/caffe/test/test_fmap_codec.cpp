@@ -0,0 +1,132 @@
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/bitplane.hpp"
+#include "caffe/util/fmap_codec.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class FeatureMapCodecTest : public ::testing::Test {
+ protected:
+  FeatureMapCodecTest()
+      : num_(3), bw_(4), channels_(5), height_(9), width_(13) {
+    Caffe::set_random_seed(1701);
+    words_ = bitplane_words(height_ * width_);
+    planes_.resize(num_ * bw_ * channels_ * words_);
+    // empty, sparse, dense and full maps, so that every map coding is used
+    const unsigned density[] = {0, 2, 64, 122, 128};
+    const int spatial = height_ * width_;
+    for (int m = 0; m < num_ * bw_ * channels_; ++m) {
+      const unsigned d = density[m % 5];
+      for (int s = 0; s < spatial; ++s) {
+        if (caffe_rng_rand() % 128 < d) {
+          planes_[m * words_ + s / 64] |= uint64_t(1) << (s % 64);
+        }
+      }
+    }
+  }
+
+  void TestRoundTrip(const FeatureMapCodec::Mode mode) {
+    // small tiles, so that the images are cut into several
+    FeatureMapCodec codec(mode, 1000);
+    string stream;
+    vector<double> plane_bits;
+    codec.Encode(&planes_[0], num_, bw_, channels_, height_, width_, &stream,
+        &plane_bits);
+    EXPECT_EQ(plane_bits.size(), bw_);
+    int num, bw, channels, height, width;
+    ASSERT_TRUE(FeatureMapCodec::DecodeShape(stream, &num, &bw, &channels,
+        &height, &width));
+    EXPECT_EQ(num, num_);
+    EXPECT_EQ(bw, bw_);
+    EXPECT_EQ(channels, channels_);
+    EXPECT_EQ(height, height_);
+    EXPECT_EQ(width, width_);
+    vector<uint64_t> decoded(planes_.size(), ~uint64_t(0));
+    ASSERT_TRUE(FeatureMapCodec::Decode(stream, &decoded[0]));
+    for (int i = 0; i < planes_.size(); ++i) {
+      EXPECT_EQ(planes_[i], decoded[i]) << "word " << i;
+    }
+    // the last image on its own
+    const int image_words = bw_ * channels_ * words_;
+    vector<uint64_t> image(image_words, ~uint64_t(0));
+    ASSERT_TRUE(FeatureMapCodec::DecodeImages(stream.data(), stream.size(),
+        num_ - 1, 1, &image[0]));
+    for (int i = 0; i < image_words; ++i) {
+      EXPECT_EQ(planes_[(num_ - 1) * image_words + i], image[i]);
+    }
+    EXPECT_FALSE(FeatureMapCodec::DecodeImages(stream.data(), stream.size(),
+        num_ - 1, 2, &image[0]));
+  }
+
+  void TestCorrupt(const FeatureMapCodec::Mode mode) {
+    FeatureMapCodec codec(mode, 1000);
+    string stream;
+    codec.Encode(&planes_[0], num_, bw_, channels_, height_, width_, &stream);
+    vector<uint64_t> decoded(planes_.size());
+    // cut off
+    string truncated = stream.substr(0, stream.size() - 1);
+    EXPECT_FALSE(FeatureMapCodec::Decode(truncated, &decoded[0]));
+    EXPECT_FALSE(FeatureMapCodec::Decode(stream.substr(0, 20), &decoded[0]));
+    // a shape that does not fit in an int
+    string large = stream;
+    reinterpret_cast<uint32_t*>(&large[0])[5] = 1 << 20;
+    reinterpret_cast<uint32_t*>(&large[0])[6] = 1 << 20;
+    int num, bw, channels, height, width;
+    EXPECT_FALSE(FeatureMapCodec::DecodeShape(large, &num, &bw, &channels,
+        &height, &width));
+    // garbage tiles decode to something or fail, but stay in the planes
+    const int tiles = reinterpret_cast<const uint32_t*>(stream.data())[8];
+    const int header_size = (9 + tiles + 1) * sizeof(uint32_t);
+    for (int i = header_size; i < stream.size(); i += 7) {
+      string corrupt = stream;
+      corrupt[i] = static_cast<char>(~corrupt[i]);
+      FeatureMapCodec::Decode(corrupt, &decoded[0]);
+    }
+    string ones = stream;
+    std::fill(ones.begin() + header_size, ones.end(), '\xff');
+    FeatureMapCodec::Decode(ones, &decoded[0]);
+  }
+
+  int num_, bw_, channels_, height_, width_, words_;
+  vector<uint64_t> planes_;
+};
+
+TEST_F(FeatureMapCodecTest, TestRoundTripRleGolomb) {
+  TestRoundTrip(FeatureMapCodec::RLE_GOLOMB);
+}
+
+TEST_F(FeatureMapCodecTest, TestRoundTripCabac) {
+  TestRoundTrip(FeatureMapCodec::CABAC);
+}
+
+TEST_F(FeatureMapCodecTest, TestRoundTripBits) {
+  const int maps = num_ * bw_ * channels_;
+  const int spatial = height_ * width_;
+  vector<float> bits(maps * spatial);
+  b2i_packed_cpu(&planes_[0], maps * words_, maps, spatial, 1, 0, &bits[0]);
+  FeatureMapCodec codec;
+  string stream;
+  codec.EncodeBits(&bits[0], num_, bw_, channels_, height_, width_, &stream);
+  vector<float> decoded(bits.size(), -1);
+  ASSERT_TRUE(FeatureMapCodec::DecodeBits(stream, &decoded[0]));
+  for (int i = 0; i < bits.size(); ++i) {
+    EXPECT_EQ(bits[i], decoded[i]);
+  }
+}
+
+TEST_F(FeatureMapCodecTest, TestCorruptRleGolomb) {
+  TestCorrupt(FeatureMapCodec::RLE_GOLOMB);
+}
+
+TEST_F(FeatureMapCodecTest, TestCorruptCabac) {
+  TestCorrupt(FeatureMapCodec::CABAC);
+}
+
+}  // namespace caffe
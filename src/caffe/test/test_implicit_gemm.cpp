@@ -0,0 +1,230 @@
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/im2col.hpp"
+#include "caffe/util/implicit_gemm.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class ImplicitGemmTest : public ::testing::Test {
+ protected:
+  ImplicitGemmTest() : channels_(3), height_(11), width_(13) {
+    Caffe::set_random_seed(1701);
+    input_.resize(channels_ * height_ * width_);
+    caffe_rng_uniform<Dtype>(input_.size(), -2, 2, &input_[0]);
+  }
+
+  // im2col of input_ and a GEMM with the unpacked weights
+  void Reference(const vector<Dtype>& input, const vector<Dtype>& weights,
+      const int rows, const int* kernel, const int* pad, const int* stride,
+      const int* dilation, const int out_h, const int out_w,
+      vector<Dtype>* output) {
+    const int depth = channels_ * kernel[0] * kernel[1];
+    vector<Dtype> col(depth * out_h * out_w);
+    im2col_cpu(&input[0], channels_, height_, width_, kernel[0], kernel[1],
+        pad[0], pad[1], stride[0], stride[1], dilation[0], dilation[1],
+        &col[0]);
+    output->resize(rows * out_h * out_w);
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, rows, out_h * out_w,
+        depth, 1., &weights[0], &col[0], 0., &(*output)[0]);
+  }
+
+  void TestConv(const int rows, const int* kernel, const int* pad,
+      const int* stride, const int* dilation) {
+    const int depth = channels_ * kernel[0] * kernel[1];
+    const int out_h = (height_ + 2 * pad[0] - (dilation[0] * (kernel[0] - 1)
+        + 1)) / stride[0] + 1;
+    const int out_w = (width_ + 2 * pad[1] - (dilation[1] * (kernel[1] - 1)
+        + 1)) / stride[1] + 1;
+    vector<Dtype> weights(rows * depth);
+    caffe_rng_uniform<Dtype>(weights.size(), -1, 1, &weights[0]);
+    vector<Dtype> packed(gemm_packed_size(rows, depth));
+    gemm_pack_weights_cpu(&weights[0], rows, depth, false, &packed[0]);
+    vector<Dtype> expected;
+    Reference(input_, weights, rows, kernel, pad, stride, dilation, out_h,
+        out_w, &expected);
+    const int dim = out_h * out_w;
+    vector<Dtype> output(rows * dim, -1);
+    implicit_gemm_conv_cpu(&packed[0], rows, &input_[0], channels_, height_,
+        width_, kernel, pad, stride, dilation, out_h, out_w, &output[0], dim,
+        out_w, 1);
+    for (int i = 0; i < output.size(); ++i) {
+      EXPECT_NEAR(expected[i], output[i], 1e-4) << "output " << i;
+    }
+    // (out_w, out_h, rows) through the strides
+    vector<Dtype> transposed(rows * dim, -1);
+    implicit_gemm_conv_cpu(&packed[0], rows, &input_[0], channels_, height_,
+        width_, kernel, pad, stride, dilation, out_h, out_w, &transposed[0], 1,
+        rows, out_h * rows);
+    for (int r = 0; r < rows; ++r) {
+      for (int oh = 0; oh < out_h; ++oh) {
+        for (int ow = 0; ow < out_w; ++ow) {
+          EXPECT_EQ(output[(r * out_h + oh) * out_w + ow],
+              transposed[(ow * out_h + oh) * rows + r]);
+        }
+      }
+    }
+  }
+
+  void TestTrim(const bool nearest) {
+    const int rows = 5;
+    const int kernel[] = {3, 3};
+    const int pad[] = {1, 1};
+    const int stride[] = {1, 1};
+    const int dilation[] = {1, 1};
+    const int depth = channels_ * 9;
+    const int dim = height_ * width_;
+    GemmInputTrim<Dtype> trim;
+    trim.nearest = nearest;
+    trim.scale = 8;
+    trim.inv_scale = 0.125;
+    trim.max_data = 7;
+    trim.min_data = -8;
+    // the trimmed copy the layers convolved before, half way values included
+    vector<Dtype> input(input_);
+    input[0] = 0.0625;
+    input[1] = -0.1875;
+    vector<Dtype> trimmed(input.size());
+    for (int i = 0; i < input.size(); ++i) {
+      Dtype x = input[i] * trim.scale;
+      if (nearest) {
+        // half away from zero
+        const double d = x;
+        x = d < 0 ? -std::floor(-d + 0.5) : std::floor(d + 0.5);
+      }
+      trimmed[i] = std::max(std::min(x, trim.max_data), trim.min_data) *
+          trim.inv_scale;
+    }
+    vector<Dtype> weights(rows * depth);
+    caffe_rng_uniform<Dtype>(weights.size(), -1, 1, &weights[0]);
+    vector<Dtype> packed(gemm_packed_size(rows, depth));
+    gemm_pack_weights_cpu(&weights[0], rows, depth, false, &packed[0]);
+    vector<Dtype> expected(rows * dim);
+    implicit_gemm_conv_cpu(&packed[0], rows, &trimmed[0], channels_, height_,
+        width_, kernel, pad, stride, dilation, height_, width_, &expected[0],
+        dim, width_, 1);
+    vector<Dtype> output(rows * dim);
+    implicit_gemm_conv_cpu(&packed[0], rows, &input[0], channels_, height_,
+        width_, kernel, pad, stride, dilation, height_, width_, &output[0],
+        dim, width_, 1, &trim);
+    for (int i = 0; i < output.size(); ++i) {
+      EXPECT_EQ(expected[i], output[i]) << "output " << i;
+    }
+  }
+
+  int channels_, height_, width_;
+  vector<Dtype> input_;
+};
+
+TYPED_TEST_CASE(ImplicitGemmTest, TestDtypes);
+
+TYPED_TEST(ImplicitGemmTest, TestPackedGemm) {
+  typedef TypeParam Dtype;
+  // rows and columns past the blocks and tiles
+  const int rows = 37;
+  const int depth = 19;
+  const int cols = 83;
+  vector<Dtype> weights(rows * depth);
+  vector<Dtype> col(depth * cols);
+  caffe_rng_uniform<Dtype>(weights.size(), -1, 1, &weights[0]);
+  caffe_rng_uniform<Dtype>(col.size(), -1, 1, &col[0]);
+  vector<Dtype> expected(rows * cols);
+  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, rows, cols, depth, 1.,
+      &weights[0], &col[0], 0., &expected[0]);
+  vector<Dtype> packed(gemm_packed_size(rows, depth));
+  gemm_pack_weights_cpu(&weights[0], rows, depth, false, &packed[0]);
+  vector<Dtype> output(rows * cols);
+  packed_gemm_cpu(&packed[0], rows, depth, &col[0], cols, &output[0]);
+  for (int i = 0; i < output.size(); ++i) {
+    EXPECT_NEAR(expected[i], output[i], 1e-4);
+  }
+  // the transposed weights and a single column
+  vector<Dtype> transposed(depth * rows);
+  for (int r = 0; r < rows; ++r) {
+    for (int k = 0; k < depth; ++k) {
+      transposed[k * rows + r] = weights[r * depth + k];
+    }
+  }
+  gemm_pack_weights_cpu(&transposed[0], rows, depth, true, &packed[0]);
+  vector<Dtype> x(depth);
+  for (int k = 0; k < depth; ++k) {
+    x[k] = col[k * cols];
+  }
+  vector<Dtype> y(rows);
+  packed_gemv_cpu(&packed[0], rows, depth, &x[0], &y[0]);
+  for (int r = 0; r < rows; ++r) {
+    EXPECT_NEAR(expected[r * cols], y[r], 1e-4);
+  }
+}
+
+TYPED_TEST(ImplicitGemmTest, TestConv3x3) {
+  const int kernel[] = {3, 3};
+  const int pad[] = {1, 1};
+  const int stride[] = {1, 1};
+  const int dilation[] = {1, 1};
+  this->TestConv(6, kernel, pad, stride, dilation);
+}
+
+TYPED_TEST(ImplicitGemmTest, TestConvStrideDilation) {
+  const int kernel[] = {3, 2};
+  const int pad[] = {2, 0};
+  const int stride[] = {2, 3};
+  const int dilation[] = {2, 1};
+  this->TestConv(37, kernel, pad, stride, dilation);
+}
+
+TYPED_TEST(ImplicitGemmTest, TestConvNegativePad) {
+  // the taps of a deconvolution phase read the input flipped
+  const int kernel[] = {2, 2};
+  const int pad[] = {-1, -1};
+  const int stride[] = {1, 1};
+  const int dilation[] = {-1, -1};
+  const int depth = this->channels_ * 4;
+  const int rows = 3;
+  const int out_h = this->height_ - 1;
+  const int out_w = this->width_ - 1;
+  typedef TypeParam Dtype;
+  vector<Dtype> weights(rows * depth);
+  caffe_rng_uniform<Dtype>(weights.size(), -1, 1, &weights[0]);
+  vector<Dtype> packed(gemm_packed_size(rows, depth));
+  gemm_pack_weights_cpu(&weights[0], rows, depth, false, &packed[0]);
+  vector<Dtype> output(rows * out_h * out_w);
+  implicit_gemm_conv_cpu(&packed[0], rows, &this->input_[0], this->channels_,
+      this->height_, this->width_, kernel, pad, stride, dilation, out_h,
+      out_w, &output[0], out_h * out_w, out_w, 1);
+  for (int r = 0; r < rows; ++r) {
+    for (int oh = 0; oh < out_h; ++oh) {
+      for (int ow = 0; ow < out_w; ++ow) {
+        Dtype expected = 0;
+        for (int c = 0; c < this->channels_; ++c) {
+          for (int kh = 0; kh < 2; ++kh) {
+            for (int kw = 0; kw < 2; ++kw) {
+              const int ih = oh + 1 - kh;
+              const int iw = ow + 1 - kw;
+              expected += weights[r * depth + (c * 2 + kh) * 2 + kw] *
+                  this->input_[(c * this->height_ + ih) * this->width_ + iw];
+            }
+          }
+        }
+        EXPECT_NEAR(expected, output[(r * out_h + oh) * out_w + ow], 1e-4);
+      }
+    }
+  }
+}
+
+TYPED_TEST(ImplicitGemmTest, TestTrimNearest) {
+  this->TestTrim(true);
+}
+
+TYPED_TEST(ImplicitGemmTest, TestTrimTruncate) {
+  this->TestTrim(false);
+}
+
+}  // namespace caffe
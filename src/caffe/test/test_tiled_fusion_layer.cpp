@@ -0,0 +1,186 @@
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/layers/tiled_fusion_layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_ristretto_util.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class TiledFusionLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  // odd sizes, so that the encoder and decoder give the height back
+  TiledFusionLayerTest()
+      : blob_bottom_(new Blob<Dtype>(2, 5, 9, 11)),
+        blob_top_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    filler_param.set_min(-3);
+    filler_param.set_max(3);
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+    layer_param_.set_name("fire");
+    layer_param_.set_type("TiledFusion");
+    layer_param_.add_bottom("data");
+    layer_param_.add_top("concat");
+    // A fire module of the compressed SqueezeNets with few channels: the
+    // squeeze output as 8 bitplanes, encoded and decoded at stride 2
+    AddConvolution("squeeze", "data", 3, 1, 1, 0);
+    AddReLU("squeeze");
+    AddBitplane("i2b", "squeeze", true);
+    QuantizationParameter* b2b0 =
+        AddConvolution("b2b0", "i2b", 5, 3, 2, 1)->mutable_quantization_param();
+    b2b0->set_bw_layer_in(2);
+    b2b0->set_bw_layer_out(2);
+    b2b0->set_fl_layer_in(0);
+    b2b0->set_fl_layer_out(0);
+    AddReLU("b2b0");
+    LayerParameter* b2b1 = AddConvolution("b2b1", "b2b0", 24, 3, 2, 1);
+    b2b1->set_type("DeconvolutionRistretto");
+    b2b1->mutable_quantization_param()->CopyFrom(*b2b0);
+    AddReLU("b2b1");
+    AddBitplane("b2i", "b2b1", false);
+    AddConvolution("expand1x1", "b2i", 4, 1, 1, 0);
+    AddReLU("expand1x1");
+    AddConvolution("expand3x3", "b2i", 4, 3, 1, 1);
+    AddReLU("expand3x3");
+    LayerParameter* concat = AddLayer("concat", "Concat", "expand1x1");
+    concat->add_bottom("expand3x3");
+  }
+  virtual ~TiledFusionLayerTest() {
+    delete blob_bottom_;
+    delete blob_top_;
+  }
+
+  LayerParameter* AddLayer(const string& name, const string& type,
+      const string& bottom) {
+    LayerParameter* param =
+        layer_param_.mutable_tiled_fusion_param()->add_layer();
+    param->set_name(name);
+    param->set_type(type);
+    param->add_bottom(bottom);
+    param->add_top(name);
+    return param;
+  }
+  LayerParameter* AddConvolution(const string& name, const string& bottom,
+      const int num_output, const int kernel, const int stride,
+      const int pad) {
+    LayerParameter* param = AddLayer(name, "ConvolutionRistretto", bottom);
+    ConvolutionParameter* convolution_param =
+        param->mutable_convolution_param();
+    convolution_param->set_num_output(num_output);
+    convolution_param->add_kernel_size(kernel);
+    convolution_param->add_stride(stride);
+    convolution_param->add_pad(pad);
+    SetRistrettoFixedPoint(param->mutable_quantization_param());
+    return param;
+  }
+  // in place, like the ReLUs of the prototxt
+  void AddReLU(const string& bottom) {
+    LayerParameter* param = AddLayer("relu_" + bottom, "ReLU", bottom);
+    param->set_top(0, bottom);
+  }
+  // 8 bits of the outputs at fl 2 of SetRistrettoFixedPoint
+  void AddBitplane(const string& name, const string& bottom,
+      const bool direction) {
+    BitplaneParameter* bitplane_param =
+        AddLayer(name, "Bitplane", bottom)->mutable_bitplane_param();
+    bitplane_param->set_direction(direction);
+    bitplane_param->set_bw_layer(8);
+    bitplane_param->set_fl_layer(2);
+  }
+
+  // Runs the layers one after another on whole blobs, as in the unfused
+  // net, then the TiledFusion layer on their weights, and compares the tops
+  void TestTiles(const int tile_rows) {
+    const TiledFusionParameter& fusion_param =
+        layer_param_.tiled_fusion_param();
+    std::map<string, Blob<Dtype>*> blobs;
+    blobs["data"] = blob_bottom_;
+    vector<shared_ptr<Blob<Dtype> > > unfused_blobs;
+    vector<shared_ptr<Blob<Dtype> > > weights;
+    for (int l = 0; l < fusion_param.layer_size(); ++l) {
+      const LayerParameter& param = fusion_param.layer(l);
+      vector<Blob<Dtype>*> bottom;
+      for (int j = 0; j < param.bottom_size(); ++j) {
+        bottom.push_back(blobs[param.bottom(j)]);
+      }
+      if (!blobs.count(param.top(0))) {
+        unfused_blobs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+        blobs[param.top(0)] = unfused_blobs.back().get();
+      }
+      vector<Blob<Dtype>*> top(1, blobs[param.top(0)]);
+      shared_ptr<Layer<Dtype> > layer =
+          LayerRegistry<Dtype>::CreateLayer(param);
+      layer->SetUp(bottom, top);
+      if (layer->blobs().size()) {
+        // one fl_params for all outputs
+        FillRistrettoWeights(param.quantization_param(), 1, false,
+            layer->blobs()[0].get());
+        FillRistrettoBias(Dtype(1. / 16), layer->blobs()[1].get());
+        weights.insert(weights.end(), layer->blobs().begin(),
+            layer->blobs().end());
+      }
+      layer->Forward(bottom, top);
+    }
+    // the decoded squeeze carries bits through the encoder and decoder
+    const Blob<Dtype>* decoded = blobs["b2i"];
+    EXPECT_GT(caffe_cpu_asum(decoded->count(), decoded->cpu_data()), 0);
+    layer_param_.mutable_tiled_fusion_param()->set_tile_rows(tile_rows);
+    TiledFusionLayer<Dtype> layer(layer_param_);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    ASSERT_EQ(weights.size(), layer.blobs().size());
+    for (int i = 0; i < weights.size(); ++i) {
+      caffe_copy(weights[i]->count(), weights[i]->cpu_data(),
+          layer.blobs()[i]->mutable_cpu_data());
+    }
+    // stale values in the top, so that every row has to be written
+    caffe_set(blob_top_->count(), Dtype(1000), blob_top_->mutable_cpu_data());
+    layer.Forward(blob_bottom_vec_, blob_top_vec_);
+    // The tiles see the same inputs and zero padding rows, and the folded
+    // ReLUs clamp like the ReLU layers, so the tops are the same
+    ExpectBlobsEqual(*blobs["concat"], *blob_top_);
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+  LayerParameter layer_param_;
+};
+
+TYPED_TEST_CASE(TiledFusionLayerTest, TestDtypes);
+
+TYPED_TEST(TiledFusionLayerTest, TestOneRow) {
+  this->TestTiles(1);
+}
+
+TYPED_TEST(TiledFusionLayerTest, TestRowsNotDividingHeight) {
+  // tiles of 4, 4 and 1 rows, halos across the strided layers
+  this->TestTiles(4);
+}
+
+TYPED_TEST(TiledFusionLayerTest, TestOddRows) {
+  // tiles starting on even and odd rows, in both phases of the strides
+  this->TestTiles(3);
+}
+
+TYPED_TEST(TiledFusionLayerTest, TestOneTile) {
+  this->TestTiles(16);
+}
+
+}  // namespace caffe
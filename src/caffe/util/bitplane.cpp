@@ -0,0 +1,355 @@
+#include <math.h>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "caffe/common.hpp"
+#include "caffe/util/bitplane.hpp"
+
+namespace caffe {
+
+// Elements converted per cache block: the block of integers stays in L1 while
+// it is written out plane by plane.
+static const int kBitplaneBlock = 512;
+
+// Largest float below 2^31; values are saturated to the int range so that the
+// vector conversions and the scalar one agree.
+static const float kBitplaneMax = 2147483520.0f;
+static const float kBitplaneMin = -2147483648.0f;
+
+// Fixed point integer of one value, truncated like the original i2b().
+template <typename Dtype>
+static inline unsigned fixed_point(const Dtype x) {
+  // NaN goes to the top as with the vector min / max
+  Dtype v = x < Dtype(kBitplaneMax) ? x : Dtype(kBitplaneMax);
+  v = v > Dtype(kBitplaneMin) ? v : Dtype(kBitplaneMin);
+  return (unsigned)(int)v;
+}
+
+// Fixed point integers of a block.
+template <typename Dtype>
+static inline void fixed_point_block(const Dtype* in, const int len,
+    const Dtype scale, unsigned* out) {
+  for (int i = 0; i < len; ++i) {
+    out[i] = fixed_point(in[i] * scale);
+  }
+}
+
+#if defined(__AVX2__)
+template <>
+inline void fixed_point_block<float>(const float* in, const int len,
+    const float scale, unsigned* out) {
+  const __m256 s = _mm256_set1_ps(scale);
+  const __m256 hi = _mm256_set1_ps(kBitplaneMax);
+  const __m256 lo = _mm256_set1_ps(kBitplaneMin);
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m256 x = _mm256_mul_ps(_mm256_loadu_ps(in + i), s);
+    x = _mm256_max_ps(_mm256_min_ps(x, hi), lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+        _mm256_cvttps_epi32(x));
+  }
+  for (; i < len; ++i) {
+    out[i] = fixed_point(in[i] * scale);
+  }
+}
+#endif
+
+template <typename Dtype>
+static inline void extract_plane(const unsigned* in, const int len,
+    const int b, Dtype* out) {
+  for (int i = 0; i < len; ++i) {
+    out[i] = (Dtype)((in[i] >> b) & 0x00000001);
+  }
+}
+
+#if defined(__AVX2__)
+template <>
+inline void extract_plane<float>(const unsigned* in, const int len,
+    const int b, float* out) {
+  const __m128i shift = _mm_cvtsi32_si128(b);
+  const __m256i one = _mm256_set1_epi32(1);
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    v = _mm256_and_si256(_mm256_srl_epi32(v, shift), one);
+    _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(v));
+  }
+  for (; i < len; ++i) {
+    out[i] = (float)((in[i] >> b) & 0x00000001);
+  }
+}
+#endif
+
+template <typename Dtype>
+static inline void accumulate_plane(const Dtype* in, const int len,
+    const Dtype scale, Dtype* acc) {
+  for (int i = 0; i < len; ++i) {
+    acc[i] += in[i] * scale;
+  }
+}
+
+#if defined(__AVX2__)
+template <>
+inline void accumulate_plane<float>(const float* in, const int len,
+    const float scale, float* acc) {
+  const __m256 s = _mm256_set1_ps(scale);
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m256 a = _mm256_loadu_ps(acc + i);
+    a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(in + i), s));
+    _mm256_storeu_ps(acc + i, a);
+  }
+  for (; i < len; ++i) {
+    acc[i] += in[i] * scale;
+  }
+}
+#endif
+
+template <typename Dtype>
+void i2b_cpu(const Dtype* data, const int count, const int bw, const int fl,
+    Dtype* planes, const int plane_stride) {
+  CHECK_LE(bw, 32) << "Bitplanes are extracted from 32-bit integers.";
+  const Dtype scale = powf(2, fl);
+  unsigned block[kBitplaneBlock];
+  for (int i = 0; i < count; i += kBitplaneBlock) {
+    const int len = std::min(kBitplaneBlock, count - i);
+    fixed_point_block(data + i, len, scale, block);
+    for (int b = 0; b < bw; ++b) {
+      extract_plane(block, len, b, planes + b * plane_stride + i);
+    }
+  }
+}
+
+template <typename Dtype>
+void b2i_cpu(const Dtype* planes, const int plane_stride, const int count,
+    const int bw, const int fl, Dtype* data) {
+  Dtype block[kBitplaneBlock];
+  for (int i = 0; i < count; i += kBitplaneBlock) {
+    const int len = std::min(kBitplaneBlock, count - i);
+    std::fill(block, block + len, Dtype(0));
+    // planes are summed from LSB to MSB as in the per-plane version
+    for (int b = 0; b < bw; ++b) {
+      accumulate_plane(planes + b * plane_stride + i, len,
+          (Dtype)powf(2, b - fl), block);
+    }
+    std::copy(block, block + len, data + i);
+  }
+}
+
+// Transpose len <= 64 integers into bw plane words.
+static inline void transpose_bits(const unsigned* in, const int len,
+    const int bw, uint64_t* out, const int plane_stride) {
+  for (int b = 0; b < bw; ++b) {
+    uint64_t word = 0;
+    for (int i = 0; i < len; ++i) {
+      word |= (uint64_t)((in[i] >> b) & 0x00000001) << i;
+    }
+    out[b * plane_stride] = word;
+  }
+}
+
+// Transpose one full word of 64 integers.
+template <typename Dtype>
+static inline void transpose_word(const Dtype* in, const Dtype scale,
+    const int bw, uint64_t* out, const int plane_stride) {
+  unsigned block[64];
+  fixed_point_block(in, 64, scale, block);
+  transpose_bits(block, 64, bw, out, plane_stride);
+}
+
+#if defined(__AVX512F__)
+template <>
+inline void transpose_word<float>(const float* in, const float scale,
+    const int bw, uint64_t* out, const int plane_stride) {
+  const __m512 s = _mm512_set1_ps(scale);
+  const __m512 hi = _mm512_set1_ps(kBitplaneMax);
+  const __m512 lo = _mm512_set1_ps(kBitplaneMin);
+  __m512i v[4];
+  for (int k = 0; k < 4; ++k) {
+    const __m512 x = _mm512_mul_ps(_mm512_loadu_ps(in + 16 * k), s);
+    v[k] = _mm512_cvttps_epi32(_mm512_max_ps(_mm512_min_ps(x, hi), lo));
+  }
+  for (int b = 0; b < bw; ++b) {
+    const __m512i m = _mm512_set1_epi32(static_cast<int>(1u << b));
+    out[b * plane_stride] = (uint64_t)_mm512_test_epi32_mask(v[0], m) |
+        ((uint64_t)_mm512_test_epi32_mask(v[1], m) << 16) |
+        ((uint64_t)_mm512_test_epi32_mask(v[2], m) << 32) |
+        ((uint64_t)_mm512_test_epi32_mask(v[3], m) << 48);
+  }
+}
+#elif defined(__AVX2__)
+template <>
+inline void transpose_word<float>(const float* in, const float scale,
+    const int bw, uint64_t* out, const int plane_stride) {
+  const __m256 s = _mm256_set1_ps(scale);
+  const __m256 hi = _mm256_set1_ps(kBitplaneMax);
+  const __m256 lo = _mm256_set1_ps(kBitplaneMin);
+  __m256i v[8];
+  for (int k = 0; k < 8; ++k) {
+    const __m256 x = _mm256_mul_ps(_mm256_loadu_ps(in + 8 * k), s);
+    v[k] = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(x, hi), lo));
+  }
+  // move bit b into the sign bit and collect the signs with movemask
+  for (int b = 0; b < bw; ++b) {
+    const __m128i shift = _mm_cvtsi32_si128(31 - b);
+    uint64_t word = 0;
+    for (int k = 0; k < 8; ++k) {
+      const __m256 sign = _mm256_castsi256_ps(_mm256_sll_epi32(v[k], shift));
+      word |= (uint64_t)(unsigned)_mm256_movemask_ps(sign) << (8 * k);
+    }
+    out[b * plane_stride] = word;
+  }
+}
+#endif
+
+template <typename Dtype>
+void i2b_packed_cpu(const Dtype* data, const int channels, const int spatial,
+    const int bw, const int fl, uint64_t* planes, const int plane_stride) {
+  CHECK_LE(bw, 32) << "Bitplanes are extracted from 32-bit integers.";
+  const int words = bitplane_words(spatial);
+  const Dtype scale = powf(2, fl);
+  unsigned block[64];
+  for (int c = 0; c < channels; ++c) {
+    const Dtype* in = data + c * spatial;
+    uint64_t* out = planes + c * words;
+    for (int w = 0; w < words; ++w) {
+      const int len = std::min(64, spatial - w * 64);
+      if (len == 64) {
+        transpose_word(in + w * 64, scale, bw, out + w, plane_stride);
+      } else {
+        fixed_point_block(in + w * 64, len, scale, block);
+        transpose_bits(block, len, bw, out + w, plane_stride);
+      }
+    }
+  }
+}
+
+// Rebuild len <= 64 integers from bw plane words.
+template <typename Dtype>
+static inline void untranspose_bits(const uint64_t* in, const int plane_stride,
+    const int bw, const Dtype* scale, const int len, Dtype* out) {
+  for (int i = 0; i < len; ++i) {
+    Dtype otmp = 0;
+    for (int b = 0; b < bw; ++b) {
+      if ((in[b * plane_stride] >> i) & 0x00000001) {
+        otmp += scale[b];
+      }
+    }
+    out[i] = otmp;
+  }
+}
+
+// Rebuild one full word of 64 integers.
+template <typename Dtype>
+static inline void untranspose_word(const uint64_t* in, const int plane_stride,
+    const int bw, const Dtype* scale, Dtype* out) {
+  untranspose_bits(in, plane_stride, bw, scale, 64, out);
+}
+
+#if defined(__AVX512F__)
+template <>
+inline void untranspose_word<float>(const uint64_t* in, const int plane_stride,
+    const int bw, const float* scale, float* out) {
+  for (int k = 0; k < 4; ++k) {
+    __m512 acc = _mm512_setzero_ps();
+    for (int b = 0; b < bw; ++b) {
+      const __mmask16 m = (__mmask16)(in[b * plane_stride] >> (16 * k));
+      acc = _mm512_mask_add_ps(acc, m, acc, _mm512_set1_ps(scale[b]));
+    }
+    _mm512_storeu_ps(out + 16 * k, acc);
+  }
+}
+#elif defined(__AVX2__)
+template <>
+inline void untranspose_word<float>(const uint64_t* in, const int plane_stride,
+    const int bw, const float* scale, float* out) {
+  const __m256i lane = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  for (int k = 0; k < 8; ++k) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int b = 0; b < bw; ++b) {
+      const int byte = (int)((in[b * plane_stride] >> (8 * k)) & 0xFF);
+      const __m256i bits = _mm256_and_si256(_mm256_set1_epi32(byte), lane);
+      const __m256 m = _mm256_castsi256_ps(_mm256_cmpeq_epi32(bits, lane));
+      acc = _mm256_add_ps(acc, _mm256_and_ps(m, _mm256_set1_ps(scale[b])));
+    }
+    _mm256_storeu_ps(out + 8 * k, acc);
+  }
+}
+#endif
+
+template <typename Dtype>
+void b2i_packed_cpu(const uint64_t* planes, const int plane_stride,
+    const int channels, const int spatial, const int bw, const int fl,
+    Dtype* data) {
+  CHECK_LE(bw, 32) << "Bitplanes are extracted from 32-bit integers.";
+  const int words = bitplane_words(spatial);
+  Dtype scale[32];
+  for (int b = 0; b < bw; ++b) {
+    scale[b] = powf(2, b - fl);
+  }
+  for (int c = 0; c < channels; ++c) {
+    const uint64_t* in = planes + c * words;
+    Dtype* out = data + c * spatial;
+    for (int w = 0; w < words; ++w) {
+      const int len = std::min(64, spatial - w * 64);
+      if (len == 64) {
+        untranspose_word(in + w, plane_stride, bw, scale, out + w * 64);
+      } else {
+        untranspose_bits(in + w, plane_stride, bw, scale, len, out + w * 64);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+bool bitplane_pack_channels_cpu(const Dtype* data, const int channels,
+    const int spatial, uint64_t* bits) {
+  const int words = bitplane_words(channels);
+  std::fill(bits, bits + spatial * words, uint64_t(0));
+  bool binary = true;
+  for (int c = 0; c < channels; ++c) {
+    const uint64_t bit = uint64_t(1) << (c % 64);
+    const Dtype* in = data + c * spatial;
+    uint64_t* out = bits + c / 64;
+    for (int s = 0; s < spatial; ++s) {
+      if (in[s] > 0) {
+        out[s * words] |= bit;
+        binary &= in[s] == 1;
+      } else {
+        binary &= in[s] == 0;
+      }
+    }
+  }
+  return binary;
+}
+
+// Explicit instantiation
+template void i2b_cpu<float>(const float* data, const int count, const int bw,
+    const int fl, float* planes, const int plane_stride);
+template void i2b_cpu<double>(const double* data, const int count,
+    const int bw, const int fl, double* planes, const int plane_stride);
+template void b2i_cpu<float>(const float* planes, const int plane_stride,
+    const int count, const int bw, const int fl, float* data);
+template void b2i_cpu<double>(const double* planes, const int plane_stride,
+    const int count, const int bw, const int fl, double* data);
+template void i2b_packed_cpu<float>(const float* data, const int channels,
+    const int spatial, const int bw, const int fl, uint64_t* planes,
+    const int plane_stride);
+template void i2b_packed_cpu<double>(const double* data, const int channels,
+    const int spatial, const int bw, const int fl, uint64_t* planes,
+    const int plane_stride);
+template void b2i_packed_cpu<float>(const uint64_t* planes,
+    const int plane_stride, const int channels, const int spatial,
+    const int bw, const int fl, float* data);
+template void b2i_packed_cpu<double>(const uint64_t* planes,
+    const int plane_stride, const int channels, const int spatial,
+    const int bw, const int fl, double* data);
+template bool bitplane_pack_channels_cpu<float>(const float* data,
+    const int channels, const int spatial, uint64_t* bits);
+template bool bitplane_pack_channels_cpu<double>(const double* data,
+    const int channels, const int spatial, uint64_t* bits);
+
+}  // namespace caffe
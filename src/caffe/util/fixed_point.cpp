@@ -0,0 +1,203 @@
+#include <math.h>
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "caffe/util/fixed_point.hpp"
+
+namespace caffe {
+
+// Trimming kernels, with or without rounding to nearest: scale, round half
+// away from zero like roundf, saturate (NaN passes like std::min / std::max),
+// scale back, with one scale for all elements or, per_element, one for each.
+// The SIMD loops return the elements done.
+
+static inline float round_nearest(const float x) { return roundf(x); }
+static inline double round_nearest(const double x) { return round(x); }
+
+template <bool nearest, bool per_element>
+static int trim_simd(const float* in, float* out, const int cnt,
+    const float* scale, const float max_data, const float min_data,
+    const float* inv_scale) {
+  int i = 0;
+#if defined(__AVX512F__)
+  const __m512 s0 = _mm512_set1_ps(scale[0]);
+  const __m512 hi = _mm512_set1_ps(max_data);
+  const __m512 lo = _mm512_set1_ps(min_data);
+  const __m512 inv0 = _mm512_set1_ps(inv_scale[0]);
+  const __m512 half = _mm512_set1_ps(0.5f);
+  const __m512i one = _mm512_castps_si512(_mm512_set1_ps(1.f));
+  const __m512i sign = _mm512_set1_epi32(0x80000000);
+  for (; i + 16 <= cnt; i += 16) {
+    const __m512 s = per_element ? _mm512_loadu_ps(scale + i) : s0;
+    __m512 x = _mm512_mul_ps(_mm512_loadu_ps(in + i), s);
+    if (nearest) {
+      // truncate, then step away from zero if the fraction is >= 0.5
+      const __m512 t = _mm512_roundscale_ps(x,
+          _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+      const __mmask16 up = _mm512_cmp_ps_mask(
+          _mm512_abs_ps(_mm512_sub_ps(x, t)), half, _CMP_GE_OQ);
+      const __m512 step = _mm512_castsi512_ps(_mm512_or_si512(one,
+          _mm512_and_si512(_mm512_castps_si512(x), sign)));
+      x = _mm512_mask_add_ps(t, up, t, step);
+    }
+    x = _mm512_max_ps(lo, _mm512_min_ps(hi, x));
+    const __m512 inv = per_element ? _mm512_loadu_ps(inv_scale + i) : inv0;
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(x, inv));
+  }
+#elif defined(__AVX2__)
+  const __m256 s0 = _mm256_set1_ps(scale[0]);
+  const __m256 hi = _mm256_set1_ps(max_data);
+  const __m256 lo = _mm256_set1_ps(min_data);
+  const __m256 inv0 = _mm256_set1_ps(inv_scale[0]);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 sign = _mm256_set1_ps(-0.f);
+  for (; i + 8 <= cnt; i += 8) {
+    const __m256 s = per_element ? _mm256_loadu_ps(scale + i) : s0;
+    __m256 x = _mm256_mul_ps(_mm256_loadu_ps(in + i), s);
+    if (nearest) {
+      const __m256 t = _mm256_round_ps(x,
+          _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+      const __m256 up = _mm256_cmp_ps(
+          _mm256_andnot_ps(sign, _mm256_sub_ps(x, t)), half, _CMP_GE_OQ);
+      const __m256 step = _mm256_or_ps(one, _mm256_and_ps(x, sign));
+      x = _mm256_blendv_ps(t, _mm256_add_ps(t, step), up);
+    }
+    x = _mm256_max_ps(lo, _mm256_min_ps(hi, x));
+    const __m256 inv = per_element ? _mm256_loadu_ps(inv_scale + i) : inv0;
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(x, inv));
+  }
+#endif
+  return i;
+}
+
+template <bool nearest, bool per_element>
+static int trim_simd(const double* in, double* out, const int cnt,
+    const double* scale, const double max_data, const double min_data,
+    const double* inv_scale) {
+  int i = 0;
+#if defined(__AVX512F__)
+  const __m512d s0 = _mm512_set1_pd(scale[0]);
+  const __m512d hi = _mm512_set1_pd(max_data);
+  const __m512d lo = _mm512_set1_pd(min_data);
+  const __m512d inv0 = _mm512_set1_pd(inv_scale[0]);
+  const __m512d half = _mm512_set1_pd(0.5);
+  const __m512i one = _mm512_castpd_si512(_mm512_set1_pd(1.));
+  const __m512i sign = _mm512_set1_epi64(0x8000000000000000LL);
+  for (; i + 8 <= cnt; i += 8) {
+    const __m512d s = per_element ? _mm512_loadu_pd(scale + i) : s0;
+    __m512d x = _mm512_mul_pd(_mm512_loadu_pd(in + i), s);
+    if (nearest) {
+      const __m512d t = _mm512_roundscale_pd(x,
+          _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+      const __mmask8 up = _mm512_cmp_pd_mask(
+          _mm512_abs_pd(_mm512_sub_pd(x, t)), half, _CMP_GE_OQ);
+      const __m512d step = _mm512_castsi512_pd(_mm512_or_si512(one,
+          _mm512_and_si512(_mm512_castpd_si512(x), sign)));
+      x = _mm512_mask_add_pd(t, up, t, step);
+    }
+    x = _mm512_max_pd(lo, _mm512_min_pd(hi, x));
+    const __m512d inv = per_element ? _mm512_loadu_pd(inv_scale + i) : inv0;
+    _mm512_storeu_pd(out + i, _mm512_mul_pd(x, inv));
+  }
+#elif defined(__AVX2__)
+  const __m256d s0 = _mm256_set1_pd(scale[0]);
+  const __m256d hi = _mm256_set1_pd(max_data);
+  const __m256d lo = _mm256_set1_pd(min_data);
+  const __m256d inv0 = _mm256_set1_pd(inv_scale[0]);
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m256d one = _mm256_set1_pd(1.);
+  const __m256d sign = _mm256_set1_pd(-0.);
+  for (; i + 4 <= cnt; i += 4) {
+    const __m256d s = per_element ? _mm256_loadu_pd(scale + i) : s0;
+    __m256d x = _mm256_mul_pd(_mm256_loadu_pd(in + i), s);
+    if (nearest) {
+      const __m256d t = _mm256_round_pd(x,
+          _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+      const __m256d up = _mm256_cmp_pd(
+          _mm256_andnot_pd(sign, _mm256_sub_pd(x, t)), half, _CMP_GE_OQ);
+      const __m256d step = _mm256_or_pd(one, _mm256_and_pd(x, sign));
+      x = _mm256_blendv_pd(t, _mm256_add_pd(t, step), up);
+    }
+    x = _mm256_max_pd(lo, _mm256_min_pd(hi, x));
+    const __m256d inv = per_element ? _mm256_loadu_pd(inv_scale + i) : inv0;
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(x, inv));
+  }
+#endif
+  return i;
+}
+
+template <typename Dtype, bool nearest>
+static void trim_cpu(const Dtype* in, Dtype* out, const int cnt,
+    const Dtype scale, const Dtype max_data, const Dtype min_data,
+    const Dtype inv_scale) {
+  for (int i = trim_simd<nearest, false>(in, out, cnt, &scale, max_data,
+      min_data, &inv_scale); i < cnt; ++i) {
+    Dtype x = in[i] * scale;
+    if (nearest) {
+      x = round_nearest(x);
+    }
+    out[i] = std::max(std::min(x, max_data), min_data) * inv_scale;
+  }
+}
+
+template <typename Dtype, bool nearest>
+static void trim_scaled_cpu(const Dtype* in, Dtype* out, const int cnt,
+    const Dtype* scale, const Dtype max_data, const Dtype min_data,
+    const Dtype* inv_scale) {
+  for (int i = trim_simd<nearest, true>(in, out, cnt, scale, max_data,
+      min_data, inv_scale); i < cnt; ++i) {
+    Dtype x = in[i] * scale[i];
+    if (nearest) {
+      x = round_nearest(x);
+    }
+    out[i] = std::max(std::min(x, max_data), min_data) * inv_scale[i];
+  }
+}
+
+template <typename Dtype>
+void fixed_point_trim_cpu(const Dtype* in, const int count, const Dtype scale,
+    const Dtype max_data, const Dtype min_data, const Dtype inv_scale,
+    const bool nearest, Dtype* out) {
+  if (nearest) {
+    trim_cpu<Dtype, true>(in, out, count, scale, max_data, min_data,
+        inv_scale);
+  } else {
+    trim_cpu<Dtype, false>(in, out, count, scale, max_data, min_data,
+        inv_scale);
+  }
+}
+
+template <typename Dtype>
+void fixed_point_trim_scaled_cpu(const Dtype* in, const int count,
+    const Dtype* scale, const Dtype max_data, const Dtype min_data,
+    const Dtype* inv_scale, const bool nearest, Dtype* out) {
+  if (nearest) {
+    trim_scaled_cpu<Dtype, true>(in, out, count, scale, max_data, min_data,
+        inv_scale);
+  } else {
+    trim_scaled_cpu<Dtype, false>(in, out, count, scale, max_data, min_data,
+        inv_scale);
+  }
+}
+
+// Explicit instantiation
+template void fixed_point_trim_cpu<float>(const float* in, const int count,
+    const float scale, const float max_data, const float min_data,
+    const float inv_scale, const bool nearest, float* out);
+template void fixed_point_trim_cpu<double>(const double* in, const int count,
+    const double scale, const double max_data, const double min_data,
+    const double inv_scale, const bool nearest, double* out);
+template void fixed_point_trim_scaled_cpu<float>(const float* in,
+    const int count, const float* scale, const float max_data,
+    const float min_data, const float* inv_scale, const bool nearest,
+    float* out);
+template void fixed_point_trim_scaled_cpu<double>(const double* in,
+    const int count, const double* scale, const double max_data,
+    const double min_data, const double* inv_scale, const bool nearest,
+    double* out);
+
+}  // namespace caffe
@@ -0,0 +1,744 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "caffe/util/bitplane.hpp"
+#include "caffe/util/fmap_codec.hpp"
+
+namespace caffe {
+
+static const uint32_t kCodecMagic = 0x31434d46;  // "FMC1"
+// uint32 header fields in front of the tile offsets
+static const int kHeaderFields = 9;
+
+// How RLE_GOLOMB codes a map, two bits in front of it.
+enum MapCoding {
+  MAP_ZERO = 0,
+  MAP_RAW = 1,
+  MAP_RUNS = 2,           // runs of zeros between ones
+  MAP_RUNS_INVERTED = 3   // runs of ones between zeros
+};
+
+// Appends bits LSB first to 64-bit words.
+class BitWriter {
+ public:
+  BitWriter() : acc_(0), used_(0) {}
+  // Append the count <= 64 low bits of value.
+  inline void Put(const uint64_t value, const int count) {
+    acc_ |= value << used_;
+    if (used_ + count >= 64) {
+      const int consumed = 64 - used_;
+      words_.push_back(acc_);
+      acc_ = consumed < count ? value >> consumed : 0;
+      used_ += count - 64;
+    } else {
+      used_ += count;
+    }
+  }
+  // Append q zeros and a one.
+  inline void PutUnary(int q) {
+    for (; q >= 64; q -= 64) {
+      Put(0, 64);
+    }
+    Put(uint64_t(1) << q, q + 1);
+  }
+  inline void PutRice(const int value, const int k) {
+    PutUnary(value >> k);
+    if (k > 0) {
+      Put(value & ((uint64_t(1) << k) - 1), k);
+    }
+  }
+  // Number of bits written so far.
+  inline int64_t Bits() const { return int64_t(words_.size()) * 64 + used_; }
+  // Flush the last partial word and hand out the coded bytes.
+  void Finish(string* bytes) {
+    if (used_ > 0) {
+      words_.push_back(acc_);
+      acc_ = 0;
+      used_ = 0;
+    }
+    bytes->clear();
+    if (!words_.empty()) {
+      bytes->assign(reinterpret_cast<const char*>(&words_[0]),
+          words_.size() * sizeof(uint64_t));
+    }
+  }
+
+ private:
+  vector<uint64_t> words_;
+  uint64_t acc_;
+  int used_;
+};
+
+// Reads the bits of a BitWriter back from a byte stream. Past the end it
+// reads zeros and Ok() turns false.
+class BitReader {
+ public:
+  BitReader(const char* data, const int64_t num_words)
+      : data_(data), num_words_(num_words), pos_(0) {}
+  inline uint64_t Get(const int count) {
+    const uint64_t value = Peek();
+    pos_ += count;
+    return count < 64 ? value & ((uint64_t(1) << count) - 1) : value;
+  }
+  inline int64_t GetUnary() {
+    int64_t q = 0;
+    for (uint64_t value = Peek(); !value; value = Peek()) {
+      if (pos_ >= num_words_ * 64) {
+        pos_ = num_words_ * 64 + 1;
+        return q;
+      }
+      q += 64;
+      pos_ += 64;
+    }
+    const int zeros = bitplane_lowest_bit(Peek());
+    pos_ += zeros + 1;
+    return q + zeros;
+  }
+  // A Golomb-Rice value, or limit + 1 if it is larger than limit.
+  inline int64_t GetRice(const int k, const int64_t limit) {
+    const int64_t q = GetUnary();
+    if (q > (limit >> k)) {
+      return limit + 1;
+    }
+    const int64_t value = (q << k) | static_cast<int64_t>(k > 0 ? Get(k) : 0);
+    return std::min(value, limit + 1);
+  }
+  // Whether no bit was read past the end.
+  inline bool Ok() const { return pos_ <= num_words_ * 64; }
+
+ private:
+  inline uint64_t Word(const int64_t i) const {
+    uint64_t word = 0;
+    if (i < num_words_) {
+      memcpy(&word, data_ + i * sizeof(uint64_t), sizeof(uint64_t));
+    }
+    return word;
+  }
+  // The 64 bits starting at pos_.
+  inline uint64_t Peek() const {
+    const int offset = pos_ & 63;
+    uint64_t value = Word(pos_ >> 6) >> offset;
+    if (offset > 0) {
+      value |= Word((pos_ >> 6) + 1) << (64 - offset);
+    }
+    return value;
+  }
+
+  const char* data_;
+  int64_t num_words_;
+  int64_t pos_;
+};
+
+// Sum of the Golomb-Rice code lengths of the runs.
+struct RunCost {
+  explicit RunCost(const int k) : k(k), bits(0) {}
+  inline void operator()(const int run) { bits += (run >> k) + 1 + k; }
+  int k;
+  int64_t bits;
+};
+
+// Golomb-Rice code of the runs.
+struct RunWriter {
+  RunWriter(const int k, BitWriter* out) : k(k), out(out) {}
+  inline void operator()(const int run) { out->PutRice(run, k); }
+  int k;
+  BitWriter* out;
+};
+
+// Call visit with the length of every run of unmarked bits that ends in a
+// marked bit, and of the run after the last marked bit. The ones are marked,
+// or the zeros if inverted.
+template <typename Visitor>
+static inline void for_each_run(const uint64_t* map, const int spatial,
+    const bool inverted, Visitor* visit) {
+  const int words = bitplane_words(spatial);
+  int begin = 0;
+  for (int w = 0; w < words; ++w) {
+    uint64_t word = inverted ? ~map[w] : map[w];
+    if (w == words - 1 && spatial % 64) {
+      word &= (uint64_t(1) << (spatial % 64)) - 1;
+    }
+    for (; word; word &= word - 1) {
+      const int s = w * 64 + bitplane_lowest_bit(word);
+      (*visit)(s - begin);
+      begin = s + 1;
+    }
+  }
+  (*visit)(spatial - begin);
+}
+
+static void encode_map(const uint64_t* map, const int spatial,
+    BitWriter* out) {
+  const int words = bitplane_words(spatial);
+  int ones = 0;
+  for (int w = 0; w < words; ++w) {
+    ones += bitplane_popcount(map[w]);
+  }
+  if (ones == 0) {
+    out->Put(MAP_ZERO, 2);
+    return;
+  }
+  // Runs between the minority bits, k from their mean length
+  const bool inverted = 2 * ones > spatial;
+  const int marks = inverted ? spatial - ones : ones;
+  const int mean = (spatial - marks) / (marks + 1);
+  int k = 0;
+  while ((2 << k) <= mean) {
+    ++k;
+  }
+  RunCost cost(k);
+  for_each_run(map, spatial, inverted, &cost);
+  if (cost.bits + 5 < spatial) {
+    out->Put(inverted ? MAP_RUNS_INVERTED : MAP_RUNS, 2);
+    out->Put(k, 5);
+    RunWriter writer(k, out);
+    for_each_run(map, spatial, inverted, &writer);
+  } else {
+    out->Put(MAP_RAW, 2);
+    for (int w = 0; w < words; ++w) {
+      out->Put(map[w], std::min(64, spatial - w * 64));
+    }
+  }
+}
+
+// Returns false if the runs do not add up to the map.
+static bool decode_map(BitReader* in, const int spatial, uint64_t* map) {
+  const int words = bitplane_words(spatial);
+  std::fill(map, map + words, uint64_t(0));
+  const int coding = static_cast<int>(in->Get(2));
+  if (coding == MAP_ZERO) {
+    return true;
+  }
+  if (coding == MAP_RAW) {
+    for (int w = 0; w < words; ++w) {
+      map[w] = in->Get(std::min(64, spatial - w * 64));
+    }
+    return true;
+  }
+  // the encoder keeps 2^k below the mean run
+  const int k = static_cast<int>(in->Get(5));
+  if ((int64_t(1) << k) > spatial) {
+    return false;
+  }
+  int64_t pos = in->GetRice(k, spatial);
+  while (pos < spatial) {
+    map[pos >> 6] |= uint64_t(1) << (pos & 63);
+    pos += in->GetRice(k, spatial - pos - 1) + 1;
+  }
+  if (pos != spatial) {
+    return false;
+  }
+  if (coding == MAP_RUNS_INVERTED) {
+    for (int w = 0; w < words; ++w) {
+      map[w] = ~map[w];
+    }
+    if (spatial % 64) {
+      map[words - 1] &= (uint64_t(1) << (spatial % 64)) - 1;
+    }
+  }
+  return true;
+}
+
+// Adaptive binary range coder with 11-bit probabilities of a zero.
+static const int kProbBits = 11;
+static const int kMoveBits = 5;
+static const uint32_t kTopValue = 1 << 24;
+
+class RangeEncoder {
+ public:
+  RangeEncoder()
+      : low_(0), range_(0xFFFFFFFF), cache_(0), cache_size_(1) {}
+  inline void Encode(uint16_t* prob, const int bit) {
+    const uint32_t bound = (range_ >> kProbBits) * *prob;
+    if (bit) {
+      low_ += bound;
+      range_ -= bound;
+      *prob -= *prob >> kMoveBits;
+    } else {
+      range_ = bound;
+      *prob += ((1 << kProbBits) - *prob) >> kMoveBits;
+    }
+    while (range_ < kTopValue) {
+      range_ <<= 8;
+      ShiftLow();
+    }
+  }
+  // Number of bits written so far, with the fraction still in the range.
+  inline double Bits() const {
+    return 8.0 * (bytes_.size() + cache_size_) - log2(range_);
+  }
+  void Finish(string* bytes) {
+    for (int i = 0; i < 5; ++i) {
+      ShiftLow();
+    }
+    bytes->swap(bytes_);
+  }
+
+ private:
+  void ShiftLow() {
+    if (static_cast<uint32_t>(low_) < 0xFF000000u || (low_ >> 32) != 0) {
+      const uint8_t carry = static_cast<uint8_t>(low_ >> 32);
+      uint8_t byte = cache_;
+      do {
+        bytes_.push_back(static_cast<char>(byte + carry));
+        byte = 0xFF;
+      } while (--cache_size_ != 0);
+      cache_ = static_cast<uint8_t>(low_ >> 24);
+    }
+    ++cache_size_;
+    low_ = (low_ & 0x00FFFFFF) << 8;
+  }
+
+  string bytes_;
+  uint64_t low_;
+  uint32_t range_;
+  uint8_t cache_;
+  int64_t cache_size_;
+};
+
+// Decodes a RangeEncoder stream. Past the end it reads zeros and Ok() turns
+// false.
+class RangeDecoder {
+ public:
+  RangeDecoder(const char* data, const int64_t size)
+      : data_(data), size_(size), pos_(0), range_(0xFFFFFFFF), code_(0) {
+    for (int i = 0; i < 5; ++i) {
+      code_ = (code_ << 8) | Next();
+    }
+  }
+  inline int Decode(uint16_t* prob) {
+    const uint32_t bound = (range_ >> kProbBits) * *prob;
+    int bit;
+    if (code_ < bound) {
+      range_ = bound;
+      *prob += ((1 << kProbBits) - *prob) >> kMoveBits;
+      bit = 0;
+    } else {
+      code_ -= bound;
+      range_ -= bound;
+      *prob -= *prob >> kMoveBits;
+      bit = 1;
+    }
+    while (range_ < kTopValue) {
+      range_ <<= 8;
+      code_ = (code_ << 8) | Next();
+    }
+    return bit;
+  }
+  // Whether no byte was read past the end.
+  inline bool Ok() const { return pos_ <= size_; }
+
+ private:
+  inline uint32_t Next() {
+    if (pos_ >= size_) {
+      ++pos_;
+      return 0;
+    }
+    return static_cast<uint8_t>(data_[pos_++]);
+  }
+
+  const char* data_;
+  int64_t size_;
+  int64_t pos_;
+  uint32_t range_;
+  uint32_t code_;
+};
+
+// CABAC contexts of a plane: 16 neighbourhoods of the left, up, up-left and
+// up-right bits times 3 states of the bit in the higher planes (zero,
+// zero but a higher plane set, set), and one for the all-zero map flag.
+static const int kContexts = 16 * 3 + 1;
+static const int kMapContext = 16 * 3;
+
+static inline int bit_at(const uint64_t* map, const int s) {
+  return static_cast<int>((map[s >> 6] >> (s & 63)) & 1);
+}
+
+static inline int cabac_context(const uint64_t* map, const uint64_t* higher,
+    const uint64_t* significant, const int h, const int w, const int width) {
+  const int s = h * width + w;
+  int context = 0;
+  if (w > 0) {
+    context |= bit_at(map, s - 1);
+  }
+  if (h > 0) {
+    context |= bit_at(map, s - width) << 1;
+    if (w > 0) {
+      context |= bit_at(map, s - width - 1) << 2;
+    }
+    if (w + 1 < width) {
+      context |= bit_at(map, s - width + 1) << 3;
+    }
+  }
+  if (higher) {
+    context += 16 * (bit_at(higher, s) ? 2 : bit_at(significant, s));
+  }
+  return context;
+}
+
+// A tile: the planes of channels [c0, c1) of image n.
+struct CodecTile {
+  int bw, channels, height, width, words;
+  int n, c0, c1;
+  inline int offset(const int b, const int c) const {
+    return ((n * bw + b) * channels + c) * words;
+  }
+};
+
+static void encode_tile_rle(const uint64_t* planes, const CodecTile& tile,
+    string* out, double* plane_bits) {
+  BitWriter writer;
+  for (int b = tile.bw - 1; b >= 0; --b) {
+    const int64_t begin = writer.Bits();
+    for (int c = tile.c0; c < tile.c1; ++c) {
+      encode_map(planes + tile.offset(b, c), tile.height * tile.width,
+          &writer);
+    }
+    plane_bits[b] = writer.Bits() - begin;
+  }
+  writer.Finish(out);
+}
+
+// Returns false if the tile is corrupt or truncated.
+static bool decode_tile_rle(const char* data, const int64_t size,
+    const CodecTile& tile, uint64_t* planes) {
+  // every map takes at least its two coding bits
+  if (int64_t(tile.bw) * (tile.c1 - tile.c0) * 2 > size * 8) {
+    return false;
+  }
+  BitReader reader(data, size / sizeof(uint64_t));
+  for (int b = tile.bw - 1; b >= 0; --b) {
+    for (int c = tile.c0; c < tile.c1; ++c) {
+      if (!decode_map(&reader, tile.height * tile.width,
+          planes + tile.offset(b, c))) {
+        return false;
+      }
+    }
+  }
+  return reader.Ok();
+}
+
+static void encode_tile_cabac(const uint64_t* planes, const CodecTile& tile,
+    string* out, double* plane_bits) {
+  const int width = tile.width;
+  vector<uint16_t> probs(tile.bw * kContexts, 1 << (kProbBits - 1));
+  vector<uint64_t> significant((tile.c1 - tile.c0) * tile.words, 0);
+  RangeEncoder encoder;
+  for (int b = tile.bw - 1; b >= 0; --b) {
+    uint16_t* prob = &probs[b * kContexts];
+    const double begin = encoder.Bits();
+    for (int c = tile.c0; c < tile.c1; ++c) {
+      const uint64_t* map = planes + tile.offset(b, c);
+      const uint64_t* higher =
+          b + 1 < tile.bw ? planes + tile.offset(b + 1, c) : NULL;
+      uint64_t* sig = &significant[(c - tile.c0) * tile.words];
+      uint64_t any = 0;
+      for (int w = 0; w < tile.words; ++w) {
+        any |= map[w];
+      }
+      encoder.Encode(prob + kMapContext, any != 0);
+      if (!any) {
+        continue;
+      }
+      for (int h = 0; h < tile.height; ++h) {
+        for (int w = 0; w < width; ++w) {
+          encoder.Encode(prob + cabac_context(map, higher, sig, h, w, width),
+              bit_at(map, h * width + w));
+        }
+      }
+      for (int w = 0; w < tile.words; ++w) {
+        sig[w] |= map[w];
+      }
+    }
+    plane_bits[b] = encoder.Bits() - begin;
+  }
+  encoder.Finish(out);
+}
+
+// Returns false if the tile is truncated.
+static bool decode_tile_cabac(const char* data, const int64_t size,
+    const CodecTile& tile, uint64_t* planes) {
+  const int width = tile.width;
+  vector<uint16_t> probs(tile.bw * kContexts, 1 << (kProbBits - 1));
+  vector<uint64_t> significant((tile.c1 - tile.c0) * tile.words, 0);
+  RangeDecoder decoder(data, size);
+  for (int b = tile.bw - 1; b >= 0; --b) {
+    uint16_t* prob = &probs[b * kContexts];
+    for (int c = tile.c0; c < tile.c1; ++c) {
+      uint64_t* map = planes + tile.offset(b, c);
+      const uint64_t* higher =
+          b + 1 < tile.bw ? planes + tile.offset(b + 1, c) : NULL;
+      uint64_t* sig = &significant[(c - tile.c0) * tile.words];
+      std::fill(map, map + tile.words, uint64_t(0));
+      if (!decoder.Decode(prob + kMapContext)) {
+        continue;
+      }
+      for (int h = 0; h < tile.height; ++h) {
+        for (int w = 0; w < width; ++w) {
+          const int s = h * width + w;
+          if (decoder.Decode(
+              prob + cabac_context(map, higher, sig, h, w, width))) {
+            map[s >> 6] |= uint64_t(1) << (s & 63);
+          }
+        }
+      }
+      for (int w = 0; w < tile.words; ++w) {
+        sig[w] |= map[w];
+      }
+    }
+  }
+  return decoder.Ok();
+}
+
+// Check the stream and return its header fields and tile offsets, or NULL if
+// it is not a valid stream.
+static const uint32_t* read_header(const char* stream, const size_t size) {
+  if (size < kHeaderFields * sizeof(uint32_t)) {
+    LOG(ERROR) << "Truncated feature map stream.";
+    return NULL;
+  }
+  const uint32_t* header = reinterpret_cast<const uint32_t*>(stream);
+  if (header[0] != kCodecMagic) {
+    LOG(ERROR) << "Not a feature map stream.";
+    return NULL;
+  }
+  if (header[1] != FeatureMapCodec::RLE_GOLOMB &&
+      header[1] != FeatureMapCodec::CABAC) {
+    LOG(ERROR) << "Unknown feature map coding " << header[1] << ".";
+    return NULL;
+  }
+  // num, bw, channels, height and width, and the number of elements they
+  // make, are ints
+  const uint64_t int_max = std::numeric_limits<int>::max();
+  uint64_t elements = 1;
+  for (int i = 2; i <= 6; ++i) {
+    elements *= header[i];
+    if (header[i] > int_max || elements > int_max) {
+      LOG(ERROR) << "Corrupt feature map stream.";
+      return NULL;
+    }
+  }
+  const uint64_t tiles = header[8];
+  if (size < (kHeaderFields + tiles + 1) * sizeof(uint32_t)) {
+    LOG(ERROR) << "Truncated feature map stream.";
+    return NULL;
+  }
+  // one tile per image and group of tile_channels channels
+  const uint64_t tile_channels = header[7];
+  if (tile_channels == 0 || tiles != header[2] *
+      ((header[4] + tile_channels - 1) / tile_channels)) {
+    LOG(ERROR) << "Corrupt feature map stream.";
+    return NULL;
+  }
+  // the tiles one after the other after the offsets
+  const uint32_t* offsets = header + kHeaderFields;
+  if (offsets[0] != 0) {
+    LOG(ERROR) << "Corrupt feature map stream.";
+    return NULL;
+  }
+  for (uint64_t t = 0; t < tiles; ++t) {
+    if (offsets[t] > offsets[t + 1]) {
+      LOG(ERROR) << "Corrupt feature map stream.";
+      return NULL;
+    }
+  }
+  if (size < (kHeaderFields + tiles + 1) * sizeof(uint32_t) +
+      offsets[tiles]) {
+    LOG(ERROR) << "Truncated feature map stream.";
+    return NULL;
+  }
+  return header;
+}
+
+FeatureMapCodec::FeatureMapCodec(const Mode mode, const int tile_bits)
+    : mode_(mode), tile_bits_(tile_bits) {
+  CHECK_GT(tile_bits, 0);
+}
+
+void FeatureMapCodec::Encode(const uint64_t* planes, const int num,
+    const int bw, const int channels, const int height, const int width,
+    string* stream, vector<double>* plane_bits) const {
+  CodecTile shape;
+  shape.bw = bw;
+  shape.channels = channels;
+  shape.height = height;
+  shape.width = width;
+  shape.words = bitplane_words(height * width);
+  const int64_t image_bits = int64_t(bw) * height * width;
+  const int tile_channels = static_cast<int>(std::max(int64_t(1),
+      std::min(int64_t(channels), tile_bits_ / std::max(int64_t(1),
+      image_bits))));
+  const int channel_tiles = (channels + tile_channels - 1) / tile_channels;
+  const int tiles = num * channel_tiles;
+  vector<string> coded(tiles);
+  vector<double> tile_bits(tiles * bw);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int t = 0; t < tiles; ++t) {
+    CodecTile tile = shape;
+    tile.n  = t / channel_tiles;
+    tile.c0 = (t % channel_tiles) * tile_channels;
+    tile.c1 = std::min(channels, tile.c0 + tile_channels);
+    if (mode_ == CABAC) {
+      encode_tile_cabac(planes, tile, &coded[t], &tile_bits[t * bw]);
+    } else {
+      encode_tile_rle(planes, tile, &coded[t], &tile_bits[t * bw]);
+    }
+  }
+  // header, offsets and tiles
+  vector<uint32_t> header(kHeaderFields + tiles + 1);
+  header[0] = kCodecMagic;
+  header[1] = mode_;
+  header[2] = num;
+  header[3] = bw;
+  header[4] = channels;
+  header[5] = height;
+  header[6] = width;
+  header[7] = tile_channels;
+  header[8] = tiles;
+  // the offsets are uint32
+  for (int t = 0; t < tiles; ++t) {
+    CHECK_LE(coded[t].size(), std::numeric_limits<uint32_t>::max() -
+        header[kHeaderFields + t])
+        << "Feature map stream of 4 GiB or more.";
+    header[kHeaderFields + t + 1] = header[kHeaderFields + t] +
+        coded[t].size();
+  }
+  const size_t header_size = header.size() * sizeof(uint32_t);
+  stream->resize(header_size + header[kHeaderFields + tiles]);
+  memcpy(&(*stream)[0], &header[0], header_size);
+  for (int t = 0; t < tiles; ++t) {
+    stream->replace(header_size + header[kHeaderFields + t], coded[t].size(),
+        coded[t]);
+  }
+  if (plane_bits) {
+    plane_bits->assign(bw, 0);
+    for (int t = 0; t < tiles; ++t) {
+      for (int b = 0; b < bw; ++b) {
+        (*plane_bits)[b] += tile_bits[t * bw + b];
+      }
+    }
+    for (int b = 0; b < bw; ++b) {
+      (*plane_bits)[b] /= double(num) * channels * height * width;
+    }
+  }
+}
+
+template <typename Dtype>
+void FeatureMapCodec::EncodeBits(const Dtype* bits, const int num,
+    const int bw, const int channels, const int height, const int width,
+    string* stream, vector<double>* plane_bits) const {
+  const int maps = num * bw * channels;
+  const int words = bitplane_words(height * width);
+  vector<uint64_t> planes(maps * words);
+  i2b_packed_cpu(bits, maps, height * width, 1, 0, &planes[0], maps * words);
+  Encode(&planes[0], num, bw, channels, height, width, stream, plane_bits);
+}
+
+bool FeatureMapCodec::DecodeShape(const char* stream, const size_t size,
+    int* num, int* bw, int* channels, int* height, int* width) {
+  const uint32_t* header = read_header(stream, size);
+  if (!header) {
+    return false;
+  }
+  *num = header[2];
+  *bw = header[3];
+  *channels = header[4];
+  *height = header[5];
+  *width = header[6];
+  return true;
+}
+
+bool FeatureMapCodec::DecodeShape(const string& stream, int* num, int* bw,
+    int* channels, int* height, int* width) {
+  return DecodeShape(stream.data(), stream.size(), num, bw, channels, height,
+      width);
+}
+
+bool FeatureMapCodec::Decode(const string& stream, uint64_t* planes) {
+  const uint32_t* header = read_header(stream.data(), stream.size());
+  return header &&
+      DecodeImages(stream.data(), stream.size(), 0, header[2], planes);
+}
+
+bool FeatureMapCodec::DecodeImages(const char* stream, const size_t size,
+    const int first, const int count, uint64_t* planes) {
+  const uint32_t* header = read_header(stream, size);
+  if (!header) {
+    return false;
+  }
+  const int mode = header[1];
+  if (first < 0 || count < 0 || int64_t(first) + count > header[2]) {
+    LOG(ERROR) << "Images [" << first << ", " << int64_t(first) + count
+        << ") out of range of " << header[2] << ".";
+    return false;
+  }
+  CodecTile shape;
+  shape.bw = header[3];
+  shape.channels = header[4];
+  shape.height = header[5];
+  shape.width = header[6];
+  shape.words = bitplane_words(shape.height * shape.width);
+  const int tile_channels = header[7];
+  const int tiles = header[8];
+  const int channel_tiles =
+      (shape.channels + tile_channels - 1) / tile_channels;
+  const uint32_t* offsets = header + kHeaderFields;
+  const char* data = stream + (kHeaderFields + tiles + 1) * sizeof(uint32_t);
+  // only the tiles of the requested images
+  const int begin = first * channel_tiles;
+  const int end = (first + count) * channel_tiles;
+  int corrupt = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:corrupt)
+#endif
+  for (int t = begin; t < end; ++t) {
+    CodecTile tile = shape;
+    tile.n  = t / channel_tiles - first;
+    tile.c0 = (t % channel_tiles) * tile_channels;
+    tile.c1 = std::min(shape.channels, tile.c0 + tile_channels);
+    const int64_t tile_size = int64_t(offsets[t + 1]) - offsets[t];
+    const bool ok = mode == CABAC ?
+        decode_tile_cabac(data + offsets[t], tile_size, tile, planes) :
+        decode_tile_rle(data + offsets[t], tile_size, tile, planes);
+    corrupt += !ok;
+  }
+  if (corrupt) {
+    LOG(ERROR) << corrupt << " corrupt tiles in feature map stream.";
+    return false;
+  }
+  return true;
+}
+
+template <typename Dtype>
+bool FeatureMapCodec::DecodeBits(const string& stream, Dtype* bits) {
+  int num, bw, channels, height, width;
+  if (!DecodeShape(stream, &num, &bw, &channels, &height, &width)) {
+    return false;
+  }
+  const int maps = num * bw * channels;
+  const int words = bitplane_words(height * width);
+  vector<uint64_t> planes(maps * words);
+  if (!Decode(stream, &planes[0])) {
+    return false;
+  }
+  b2i_packed_cpu(&planes[0], maps * words, maps, height * width, 1, 0, bits);
+  return true;
+}
+
+template void FeatureMapCodec::EncodeBits<float>(const float* bits,
+    const int num, const int bw, const int channels, const int height,
+    const int width, string* stream, vector<double>* plane_bits) const;
+template void FeatureMapCodec::EncodeBits<double>(const double* bits,
+    const int num, const int bw, const int channels, const int height,
+    const int width, string* stream, vector<double>* plane_bits) const;
+template bool FeatureMapCodec::DecodeBits<float>(const string& stream,
+    float* bits);
+template bool FeatureMapCodec::DecodeBits<double>(const string& stream,
+    double* bits);
+
+}  // namespace caffe
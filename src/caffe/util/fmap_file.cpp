@@ -0,0 +1,96 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>  // NOLINT(readability/streams)
+#include <limits>
+#include <string>
+
+#include "caffe/util/fmap_file.hpp"
+
+namespace caffe {
+
+static const uint32_t kFileMagic = 0x31464d46;  // "FMF1"
+static const uint32_t kFileVersion = 1;
+static const int kFileFields = 11;
+
+void FeatureMapFile::Write(const string& filename, const string& stream,
+    const int fl) {
+  int num, bw, channels, height, width;
+  CHECK(FeatureMapCodec::DecodeShape(stream, &num, &bw, &channels, &height,
+      &width)) << "Invalid feature map stream for " << filename;
+  uint32_t header[kFileFields];
+  header[0] = kFileMagic;
+  header[1] = kFileVersion;
+  header[2] = num;
+  header[3] = channels;
+  header[4] = height;
+  header[5] = width;
+  header[6] = bw;
+  header[7] = fl;
+  header[8] = PACKED_MSB_FIRST;
+  header[9] = reinterpret_cast<const uint32_t*>(stream.data())[1];  // codec
+  CHECK_LE(stream.size(), std::numeric_limits<uint32_t>::max())
+      << "Feature map stream of 4 GiB or more.";
+  header[10] = stream.size();
+  std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
+  CHECK(file) << "Cannot create feature map file " << filename;
+  file.write(reinterpret_cast<const char*>(header), sizeof(header));
+  file.write(stream.data(), stream.size());
+  CHECK(file) << "Cannot write feature map file " << filename;
+}
+
+FeatureMapFile::FeatureMapFile(const string& filename)
+    : map_(MAP_FAILED), map_size_(0) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  CHECK_NE(fd, -1) << "Cannot open feature map file " << filename;
+  struct stat st;
+  CHECK_EQ(fstat(fd, &st), 0) << "Cannot stat feature map file " << filename;
+  map_size_ = st.st_size;
+  CHECK_GE(map_size_, kFileFields * sizeof(uint32_t))
+      << "Truncated feature map file " << filename;
+  map_ = mmap(NULL, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  CHECK(map_ != MAP_FAILED) << "Cannot map feature map file " << filename;
+  const uint32_t* header = static_cast<const uint32_t*>(map_);
+  CHECK_EQ(header[0], kFileMagic) << filename << " is not a feature map file.";
+  CHECK_EQ(header[1], kFileVersion)
+      << "Unsupported feature map file version " << header[1];
+  num_ = header[2];
+  channels_ = header[3];
+  height_ = header[4];
+  width_ = header[5];
+  bw_ = header[6];
+  fl_ = static_cast<int32_t>(header[7]);
+  CHECK_EQ(header[8], PACKED_MSB_FIRST)
+      << "Unsupported plane order " << header[8];
+  codec_ = static_cast<FeatureMapCodec::Mode>(header[9]);
+  stream_ = static_cast<const char*>(map_) + kFileFields * sizeof(uint32_t);
+  stream_size_ = header[10];
+  CHECK_GE(map_size_, kFileFields * sizeof(uint32_t) + stream_size_)
+      << "Truncated feature map file " << filename;
+  // the shape the file gives has to be the one of the stream
+  int num, bw, channels, height, width;
+  CHECK(FeatureMapCodec::DecodeShape(stream_, stream_size_, &num, &bw,
+      &channels, &height, &width))
+      << "Corrupt feature map file " << filename;
+  CHECK(num == num_ && bw == bw_ && channels == channels_ &&
+      height == height_ && width == width_ &&
+      static_cast<uint32_t>(codec_) ==
+      reinterpret_cast<const uint32_t*>(stream_)[1])
+      << "Header of " << filename << " does not match its stream.";
+}
+
+FeatureMapFile::~FeatureMapFile() {
+  if (map_ != MAP_FAILED) {
+    munmap(map_, map_size_);
+  }
+}
+
+bool FeatureMapFile::Decode(const int first, const int count,
+    uint64_t* planes) const {
+  return FeatureMapCodec::DecodeImages(stream_, stream_size_, first, count,
+      planes);
+}
+
+}  // namespace caffe
@@ -0,0 +1,69 @@
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/fold_relu.hpp"
+
+namespace caffe {
+
+// The index of the ConvolutionRistretto or DeconvolutionRistretto layer a
+// ReLU at layer relu can be folded into, or -1.
+static int FoldTarget(const NetParameter& param, const int relu,
+    const vector<bool>& folded) {
+  const LayerParameter& layer = param.layer(relu);
+  if (layer.type() != "ReLU" || layer.bottom_size() != 1 ||
+      layer.top_size() != 1 || layer.bottom(0) != layer.top(0) ||
+      layer.relu_param().negative_slope() != 0 ||
+      layer.loss_weight_size() > 0 || layer.include_size() > 0 ||
+      layer.exclude_size() > 0) {
+    return -1;
+  }
+  const string& blob = layer.top(0);
+  for (int i = relu - 1; i >= 0; --i) {
+    if (folded[i]) {
+      continue;
+    }
+    const LayerParameter& producer = param.layer(i);
+    for (int j = 0; j < producer.bottom_size(); ++j) {
+      if (producer.bottom(j) == blob) {
+        return -1;
+      }
+    }
+    for (int j = 0; j < producer.top_size(); ++j) {
+      if (producer.top(j) == blob) {
+        const bool conv = producer.type() == "ConvolutionRistretto" ||
+            producer.type() == "DeconvolutionRistretto";
+        return conv && producer.top_size() == 1 ? i : -1;
+      }
+    }
+  }
+  return -1;
+}
+
+void FoldRistrettoReLU(const NetParameter& param, NetParameter* param_folded) {
+  param_folded->CopyFrom(param);
+  param_folded->clear_layer();
+  vector<bool> folded(param.layer_size(), false);
+  vector<bool> fused_relu(param.layer_size(), false);
+  for (int i = 0; i < param.layer_size(); ++i) {
+    const int target = FoldTarget(param, i, folded);
+    if (target >= 0) {
+      folded[i] = true;
+      fused_relu[target] = true;
+      LOG(INFO) << "Folding " << param.layer(i).name() << " into "
+          << param.layer(target).name();
+    }
+  }
+  for (int i = 0; i < param.layer_size(); ++i) {
+    if (folded[i]) {
+      continue;
+    }
+    LayerParameter* layer = param_folded->add_layer();
+    layer->CopyFrom(param.layer(i));
+    if (fused_relu[i]) {
+      layer->mutable_quantization_param()->set_fused_relu(true);
+    }
+  }
+}
+
+}  // namespace caffe
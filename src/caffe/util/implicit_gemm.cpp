@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "caffe/common.hpp"
+#include "caffe/util/fixed_point.hpp"
+#include "caffe/util/implicit_gemm.hpp"
+
+namespace caffe {
+
+// Rows of a packed weight block
+static const int kGemmBlockRows = 4;
+// Columns of the register block
+static const int kGemmBlockCols = 16;
+// Columns of a task, packed into a panel by the implicit GEMM
+static const int kGemmTileCols = 64;
+// Weight rows of a task of packed_gemm_cpu, and of a pass of the implicit
+// GEMM over its panel
+static const int kGemmTileRows = 32;
+// Columns and depth of the products packed_gemm_cpu multiplies faster than
+// single-threaded OpenBLAS, which it does not block over depth to match
+static const int kPackedGemmMinCols = 16;
+static const int kPackedGemmMaxCols = 48;
+static const int kPackedGemmMinDepth = 256;
+
+#if defined(__AVX2__)
+static inline __m256 gemm_madd(const __m256 a, const __m256 b,
+    const __m256 c) {
+#if defined(__FMA__)
+  return _mm256_fmadd_ps(a, b, c);
+#else
+  return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+#endif
+
+// acc (4, 16) = block (depth, 4) x b (depth, 16), the rows of b ldb apart.
+template <typename Dtype>
+static inline void gemm_block(const Dtype* block, const int depth,
+    const Dtype* b, const int ldb, Dtype acc[][kGemmBlockCols]) {
+  for (int r = 0; r < kGemmBlockRows; ++r) {
+    std::fill(acc[r], acc[r] + kGemmBlockCols, Dtype(0));
+  }
+  for (int k = 0; k < depth; ++k) {
+    const Dtype* x = b + k * ldb;
+    for (int r = 0; r < kGemmBlockRows; ++r) {
+      const Dtype w = block[k * kGemmBlockRows + r];
+      for (int j = 0; j < kGemmBlockCols; ++j) {
+        acc[r][j] += w * x[j];
+      }
+    }
+  }
+}
+
+#if defined(__AVX2__)
+template <>
+inline void gemm_block<float>(const float* block, const int depth,
+    const float* b, const int ldb, float acc[][kGemmBlockCols]) {
+  __m256 lo[kGemmBlockRows];
+  __m256 hi[kGemmBlockRows];
+  for (int r = 0; r < kGemmBlockRows; ++r) {
+    lo[r] = _mm256_setzero_ps();
+    hi[r] = _mm256_setzero_ps();
+  }
+  for (int k = 0; k < depth; ++k) {
+    const __m256 x0 = _mm256_loadu_ps(b + k * ldb);
+    const __m256 x1 = _mm256_loadu_ps(b + k * ldb + 8);
+    for (int r = 0; r < kGemmBlockRows; ++r) {
+      const __m256 w = _mm256_broadcast_ss(block + k * kGemmBlockRows + r);
+      lo[r] = gemm_madd(w, x0, lo[r]);
+      hi[r] = gemm_madd(w, x1, hi[r]);
+    }
+  }
+  for (int r = 0; r < kGemmBlockRows; ++r) {
+    _mm256_storeu_ps(acc[r], lo[r]);
+    _mm256_storeu_ps(acc[r] + 8, hi[r]);
+  }
+}
+#endif
+
+// acc (4) = block (depth, 4) x x (depth).
+template <typename Dtype>
+static inline void gemv_block(const Dtype* block, const int depth,
+    const Dtype* x, Dtype* acc) {
+  std::fill(acc, acc + kGemmBlockRows, Dtype(0));
+  for (int k = 0; k < depth; ++k) {
+    for (int r = 0; r < kGemmBlockRows; ++r) {
+      acc[r] += block[k * kGemmBlockRows + r] * x[k];
+    }
+  }
+}
+
+#if defined(__AVX2__)
+// x[k] and x[k + 1] spread over the 4 rows of two depths
+static inline __m256 gemv_pair(const float* x) {
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(x[0])),
+      _mm_set1_ps(x[1]), 1);
+}
+
+template <>
+inline void gemv_block<float>(const float* block, const int depth,
+    const float* x, float* acc) {
+  __m256 s0 = _mm256_setzero_ps();
+  __m256 s1 = _mm256_setzero_ps();
+  int k = 0;
+  for (; k + 4 <= depth; k += 4) {
+    s0 = gemm_madd(_mm256_loadu_ps(block + k * kGemmBlockRows),
+        gemv_pair(x + k), s0);
+    s1 = gemm_madd(_mm256_loadu_ps(block + k * kGemmBlockRows + 8),
+        gemv_pair(x + k + 2), s1);
+  }
+  s0 = _mm256_add_ps(s0, s1);
+  _mm_storeu_ps(acc, _mm_add_ps(_mm256_castps256_ps128(s0),
+      _mm256_extractf128_ps(s0, 1)));
+  for (; k < depth; ++k) {
+    for (int r = 0; r < kGemmBlockRows; ++r) {
+      acc[r] += block[k * kGemmBlockRows + r] * x[k];
+    }
+  }
+}
+#endif
+
+template <typename Dtype>
+void gemm_pack_weights_cpu(const Dtype* weight, const int rows,
+    const int depth, const bool transpose, Dtype* packed) {
+  const int blocks = (rows + kGemmBlockRows - 1) / kGemmBlockRows;
+  for (int b = 0; b < blocks; ++b) {
+    Dtype* block = packed + b * kGemmBlockRows * depth;
+    for (int k = 0; k < depth; ++k) {
+      for (int i = 0; i < kGemmBlockRows; ++i) {
+        const int r = b * kGemmBlockRows + i;
+        block[k * kGemmBlockRows + i] = r >= rows ? Dtype(0) :
+            transpose ? weight[k * rows + r] : weight[r * depth + k];
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void packed_gemm_cpu(const Dtype* packed, const int rows, const int depth,
+    const Dtype* col, const int cols, Dtype* output) {
+  const int tiles = (cols + kGemmTileCols - 1) / kGemmTileCols;
+  const int chunks = (rows + kGemmTileRows - 1) / kGemmTileRows;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+  {
+    vector<Dtype> tail(std::max(depth, 1) * kGemmBlockCols);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (int t = 0; t < tiles * chunks; ++t) {
+      const int n0 = t / chunks * kGemmTileCols;
+      const int n1 = std::min(n0 + kGemmTileCols, cols);
+      const int r0 = t % chunks * kGemmTileRows;
+      const int r1 = std::min(r0 + kGemmTileRows, rows);
+      for (int j = n0; j < n1; j += kGemmBlockCols) {
+        const int block_cols = std::min(kGemmBlockCols, n1 - j);
+        const Dtype* b = col + j;
+        int ldb = cols;
+        if (block_cols < kGemmBlockCols) {
+          // the last columns, zero-padded to a block
+          for (int k = 0; k < depth; ++k) {
+            Dtype* x = &tail[k * kGemmBlockCols];
+            std::copy(col + k * cols + j, col + k * cols + j + block_cols, x);
+            std::fill(x + block_cols, x + kGemmBlockCols, Dtype(0));
+          }
+          b = &tail[0];
+          ldb = kGemmBlockCols;
+        }
+        for (int r = r0; r < r1; r += kGemmBlockRows) {
+          Dtype acc[kGemmBlockRows][kGemmBlockCols];
+          gemm_block(packed + r * depth, depth, b, ldb, acc);
+          for (int i = 0; i < std::min(kGemmBlockRows, r1 - r); ++i) {
+            std::copy(acc[i], acc[i] + block_cols, output + (r + i) * cols + j);
+          }
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void packed_gemv_cpu(const Dtype* packed, const int rows, const int depth,
+    const Dtype* x, Dtype* y) {
+  const int blocks = (rows + kGemmBlockRows - 1) / kGemmBlockRows;
+#ifdef _OPENMP
+#pragma omp parallel for if (static_cast<int64_t>(rows) * depth >= 65536)
+#endif
+  for (int b = 0; b < blocks; ++b) {
+    Dtype acc[kGemmBlockRows];
+    gemv_block(packed + b * kGemmBlockRows * depth, depth, x, acc);
+    const int r = b * kGemmBlockRows;
+    std::copy(acc, acc + std::min(kGemmBlockRows, rows - r), y + r);
+  }
+}
+
+template <typename Dtype>
+bool packed_gemv_preferred() {
+  // the scalar kernel
+  return false;
+}
+
+#if defined(__AVX2__)
+template <>
+bool packed_gemv_preferred<float>() {
+  return true;
+}
+#endif
+
+template <typename Dtype>
+bool packed_gemm_preferred(const int depth, const int cols) {
+  return packed_gemv_preferred<Dtype>() && depth >= kPackedGemmMinDepth &&
+      cols >= kPackedGemmMinCols && cols <= kPackedGemmMaxCols;
+}
+
+// The patches of output pixels [n0, n0 + cols) as a (depth, 64) panel, zero
+// past cols and trimmed if trim is given, and the output offset of each
+// pixel. Each row is trimmed while it is in L1.
+template <typename Dtype>
+static void implicit_gemm_pack(const Dtype* input, const int channels,
+    const int height, const int width, const int* kernel, const int* pad,
+    const int* stride, const int* dilation, const int out_w,
+    const int row_stride, const int col_stride, const int n0, const int cols,
+    const GemmInputTrim<Dtype>* trim, Dtype* panel, int* offsets) {
+  int ih0[kGemmTileCols];
+  int iw0[kGemmTileCols];
+  for (int j = 0; j < cols; ++j) {
+    const int oh = (n0 + j) / out_w;
+    const int ow = (n0 + j) % out_w;
+    ih0[j] = oh * stride[0] - pad[0];
+    iw0[j] = ow * stride[1] - pad[1];
+    offsets[j] = oh * row_stride + ow * col_stride;
+  }
+  const int taps = kernel[0] * kernel[1];
+  for (int k = 0; k < channels * taps; ++k) {
+    const Dtype* plane = input + k / taps * height * width;
+    const int dh = k / kernel[1] % kernel[0] * dilation[0];
+    const int dw = k % kernel[1] * dilation[1];
+    Dtype* row = panel + k * kGemmTileCols;
+    for (int j = 0; j < cols; ++j) {
+      const int ih = ih0[j] + dh;
+      const int iw = iw0[j] + dw;
+      row[j] = ih >= 0 && ih < height && iw >= 0 && iw < width ?
+          plane[ih * width + iw] : Dtype(0);
+    }
+    std::fill(row + cols, row + kGemmTileCols, Dtype(0));
+    if (trim) {
+      fixed_point_trim_cpu(row, kGemmTileCols, trim->scale, trim->max_data,
+          trim->min_data, trim->inv_scale, trim->nearest, row);
+    }
+  }
+}
+
+template <typename Dtype>
+void implicit_gemm_conv_cpu(const Dtype* packed, const int rows,
+    const Dtype* input, const int channels, const int height, const int width,
+    const int* kernel, const int* pad, const int* stride, const int* dilation,
+    const int out_h, const int out_w, Dtype* output, const int channel_stride,
+    const int row_stride, const int col_stride,
+    const GemmInputTrim<Dtype>* trim) {
+  const int depth = channels * kernel[0] * kernel[1];
+  const int dim = out_h * out_w;
+  const int tiles = (dim + kGemmTileCols - 1) / kGemmTileCols;
+#ifdef _OPENMP
+#pragma omp parallel if (tiles > 1)
+#endif
+  {
+    vector<Dtype> panel(std::max(depth, 1) * kGemmTileCols);
+    int offsets[kGemmTileCols];
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (int t = 0; t < tiles; ++t) {
+      // the panel is packed once and multiplied with all weight rows
+      const int n0 = t * kGemmTileCols;
+      const int cols = std::min(kGemmTileCols, dim - n0);
+      implicit_gemm_pack(input, channels, height, width, kernel, pad, stride,
+          dilation, out_w, row_stride, col_stride, n0, cols, trim, &panel[0],
+          offsets);
+      for (int r0 = 0; r0 < rows; r0 += kGemmTileRows) {
+        const int r1 = std::min(r0 + kGemmTileRows, rows);
+        for (int j = 0; j < cols; j += kGemmBlockCols) {
+          const int block_cols = std::min(kGemmBlockCols, cols - j);
+          for (int r = r0; r < r1; r += kGemmBlockRows) {
+            Dtype acc[kGemmBlockRows][kGemmBlockCols];
+            gemm_block(packed + r * depth, depth, &panel[j], kGemmTileCols,
+                acc);
+            for (int i = 0; i < std::min(kGemmBlockRows, r1 - r); ++i) {
+              Dtype* out = output + (r + i) * channel_stride;
+              for (int n = 0; n < block_cols; ++n) {
+                out[offsets[j + n]] = acc[i][n];
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// Explicit instantiation
+template void gemm_pack_weights_cpu<float>(const float* weight,
+    const int rows, const int depth, const bool transpose, float* packed);
+template void gemm_pack_weights_cpu<double>(const double* weight,
+    const int rows, const int depth, const bool transpose, double* packed);
+template void packed_gemm_cpu<float>(const float* packed, const int rows,
+    const int depth, const float* col, const int cols, float* output);
+template void packed_gemm_cpu<double>(const double* packed, const int rows,
+    const int depth, const double* col, const int cols, double* output);
+template void packed_gemv_cpu<float>(const float* packed, const int rows,
+    const int depth, const float* x, float* y);
+template void packed_gemv_cpu<double>(const double* packed, const int rows,
+    const int depth, const double* x, double* y);
+template bool packed_gemm_preferred<float>(const int depth, const int cols);
+template bool packed_gemm_preferred<double>(const int depth, const int cols);
+template bool packed_gemv_preferred<float>();
+template bool packed_gemv_preferred<double>();
+template void implicit_gemm_conv_cpu<float>(const float* packed,
+    const int rows, const float* input, const int channels, const int height,
+    const int width, const int* kernel, const int* pad, const int* stride,
+    const int* dilation, const int out_h, const int out_w, float* output,
+    const int channel_stride, const int row_stride, const int col_stride,
+    const GemmInputTrim<float>* trim);
+template void implicit_gemm_conv_cpu<double>(const double* packed,
+    const int rows, const double* input, const int channels, const int height,
+    const int width, const int* kernel, const int* pad, const int* stride,
+    const int* dilation, const int out_h, const int out_w, double* output,
+    const int channel_stride, const int row_stride, const int col_stride,
+    const GemmInputTrim<double>* trim);
+
+}  // namespace caffe